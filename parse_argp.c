@@ -30,6 +30,24 @@ struct sa_opts sa_opts = {
 	.atrace_cat = { 0 },
 	.function_graph = { 0 },
 	.function_filter = { 0 },
+	.consumer_threads = 1,
+	.num_rb_size = 0,
+	.rb_size = { 0 },
+	.rb_size_auto = false,
+	.pelt_deadband = 0,
+	.pelt_min_interval = 0,
+	.histogram = false,
+	.histogram_interval = 1,
+	.residency = false,
+	.softirq_threshold = 0,
+	.irq_threshold = 0,
+	.wakeup_latency_threshold = 0,
+	.placement_events = false,
+	.load_balance_stats = false,
+	.load_balance_threshold = 0,
+	.ipi_matrix = false,
+	.ipi_top = 10,
+	.cpu_idle_miss_events = false,
 	/* events */
 	.load_avg_cpu = false,
 	.runnable_avg_cpu = false,
@@ -52,10 +70,16 @@ struct sa_opts sa_opts = {
 	.load_balance = false,
 	.ipi = false,
 	.irq = false,
+	.wakeup_latency = false,
+	.placement = false,
+	.sugov = false,
+	.idle_governor = false,
 	/* filters */
 	.num_pids = 0,
+	.num_tgids = 0,
 	.num_comms = 0,
 	.pid = { 0 },
+	.tgid = { 0 },
 	.comm = { { 0 } },
 };
 
@@ -74,6 +98,23 @@ enum sa_opts_flags {
 	OPT_ATRACE_CAT,
 	OPT_FUNCTION_GRAPH,
 	OPT_FUNCTION_FILTER,
+	OPT_CONSUMER_THREADS,
+	OPT_RB_SIZE,
+	OPT_RB_SIZE_AUTO,
+	OPT_PELT_DEADBAND,
+	OPT_PELT_MIN_INTERVAL,
+	OPT_HISTOGRAM,
+	OPT_HISTOGRAM_INTERVAL,
+	OPT_RESIDENCY,
+	OPT_SOFTIRQ_THRESHOLD,
+	OPT_IRQ_THRESHOLD,
+	OPT_WAKEUP_LATENCY_THRESHOLD,
+	OPT_PLACEMENT_EVENTS,
+	OPT_LOAD_BALANCE_STATS,
+	OPT_LOAD_BALANCE_THRESHOLD,
+	OPT_IPI_MATRIX,
+	OPT_IPI_TOP,
+	OPT_CPU_IDLE_MISS_EVENTS,
 
 	/* events */
 	OPT_LOAD_AVG,
@@ -93,13 +134,21 @@ enum sa_opts_flags {
 	OPT_UTIL_EST_CPU,
 	OPT_UTIL_EST_TASK,
 	OPT_CPU_NR_RUNNING,
+	OPT_CPU_FREQ,
 	OPT_CPU_IDLE,
+	OPT_SOFTIRQ,
+	OPT_SCHED_SWITCH,
 	OPT_LOAD_BALANCE,
 	OPT_IPI,
 	OPT_IRQ,
+	OPT_WAKEUP_LATENCY,
+	OPT_PLACEMENT,
+	OPT_SUGOV,
+	OPT_IDLE_GOVERNOR,
 
 	/* filters */
 	OPT_FILTER_PID,
+	OPT_FILTER_TGID,
 	OPT_FILTER_COMM,
 };
 
@@ -116,6 +165,23 @@ static const struct argp_option options[] = {
 	{ "atrace_cat", OPT_ATRACE_CAT, "ATRACE_CATEGORY", 0, "Perfetto atrace category to add to perfetto config. Repeat for each category to add." },
 	{ "function_graph", OPT_FUNCTION_GRAPH, "FUNCTION", 0, "Trace function call graph for a kernel FUNCTION. Based on ftrace function graph functionality. Repeat for each function to graph." },
 	{ "function_filter", OPT_FUNCTION_FILTER, "FUNCTION", 0, "Filter the function call for a kernel FUNCTION. Based on ftrace function filter functionality. Repeat for each function to filter." },
+	{ "consumer_threads", OPT_CONSUMER_THREADS, "NUM", 0, "Number of threads to drain BPF ring buffers with, 1 by default. Ring buffers are sharded across the threads." },
+	{ "rb_size", OPT_RB_SIZE, "RINGBUFFER=SIZE(KiB)", 0, "Size of a BPF ringbuffer, eg: task_pelt=1024. Rounded up to a power of 2. Repeat for each ringbuffer to resize." },
+	{ "rb_size_auto", OPT_RB_SIZE_AUTO, 0, 0, "Size BPF ringbuffers based on number of CPUs and enabled events. --rb_size takes precedence." },
+	{ "pelt_deadband", OPT_PELT_DEADBAND, "N", 0, "Don't emit PELT samples unless a signal moved by more than N since it was last emitted." },
+	{ "pelt_min_interval", OPT_PELT_MIN_INTERVAL, "USEC", 0, "Emit PELT samples that didn't move beyond --pelt_deadband at most once every USEC microseconds." },
+	{ "histogram", OPT_HISTOGRAM, 0, 0, "Collect the distribution of CPU and task util_avg, runnable_avg and util_est instead of every sample." },
+	{ "histogram_interval", OPT_HISTOGRAM_INTERVAL, "SEC", 0, "Emit --histogram summaries every SEC seconds, 1 by default." },
+	{ "residency", OPT_RESIDENCY, 0, 0, "Accumulate time each CPU spends in each idle state, frequency and util_avg bucket into a csv file next to the trace." },
+	{ "softirq_threshold", OPT_SOFTIRQ_THRESHOLD, "USEC", 0, "Emit softirqs that took longer than USEC microseconds as slices with --softirq." },
+	{ "irq_threshold", OPT_IRQ_THRESHOLD, "USEC", 0, "Emit irq handlers that took longer than USEC microseconds as slices with --irq." },
+	{ "wakeup_latency_threshold", OPT_WAKEUP_LATENCY_THRESHOLD, "USEC", 0, "Emit tasks that waited longer than USEC microseconds to run as slices with --wakeup_latency." },
+	{ "placement_events", OPT_PLACEMENT_EVENTS, 0, 0, "Emit every decision of --placement with the task util, uclamp and CPU capacities." },
+	{ "load_balance_stats", OPT_LOAD_BALANCE_STATS, 0, 0, "Aggregate --load_balance phases into duration histograms and load_balance() outcomes per CPU and sched domain level into a csv file next to the trace instead of emitting every entry and exit." },
+	{ "load_balance_threshold", OPT_LOAD_BALANCE_THRESHOLD, "USEC", 0, "Emit load balance phases that took longer than USEC microseconds as slices with --load_balance_stats." },
+	{ "ipi_matrix", OPT_IPI_MATRIX, 0, 0, "Count --ipi per sending CPU, target CPU, callsite and callback into csv files next to the trace instead of emitting every IPI. Multicast IPIs count once per target CPU." },
+	{ "ipi_top", OPT_IPI_TOP, "N", 0, "Number of callbacks sending the most IPIs to list for each CPU with --ipi_matrix, 10 by default." },
+	{ "cpu_idle_miss_events", OPT_CPU_IDLE_MISS_EVENTS, 0, 0, "Emit every cpu_idle_miss as a slice. --idle_governor counts them per CPU and idle state instead." },
 	/* events */
 	{ "load_avg", OPT_LOAD_AVG, 0, 0, "Collect load_avg for CPU, tasks and thermal." },
 	{ "runnable_avg", OPT_RUNNABLE_AVG, 0, 0, "Collect runnable_avg for CPU and tasks." },
@@ -134,12 +200,20 @@ static const struct argp_option options[] = {
 	{ "util_est_cpu", OPT_UTIL_EST_CPU, 0, 0, "Collect util_est for CPU." },
 	{ "util_est_task", OPT_UTIL_EST_TASK, 0, 0, "Collect util_est for tasks." },
 	{ "cpu_nr_running", OPT_CPU_NR_RUNNING, 0, 0, "Collect nr_running tasks for each CPU." },
+	{ "cpu_freq", OPT_CPU_FREQ, 0, 0, "Collect time each CPU and each task spent at each frequency into csv files next to the trace." },
 	{ "cpu_idle", OPT_CPU_IDLE, 0, 0, "Collect info about cpu idle states for each CPU." },
+	{ "softirq", OPT_SOFTIRQ, 0, 0, "Collect duration histograms of each softirq for each CPU into a csv file next to the trace." },
+	{ "sched_switch", OPT_SCHED_SWITCH, 0, 0, "Drop PELT signals of tasks to 0 while they are not running." },
 	{ "load_balance", OPT_LOAD_BALANCE, 0, 0, "Collect load balance related info." },
 	{ "ipi", OPT_IPI, 0, 0, "Collect ipi related info." },
-	{ "irq", OPT_IRQ, 0, 0, "Enable perfetto irq atrace category." },
+	{ "irq", OPT_IRQ, 0, 0, "Collect duration histograms of each irq for each CPU into a csv file next to the trace, without the perfetto irq atrace category." },
+	{ "wakeup_latency", OPT_WAKEUP_LATENCY, 0, 0, "Collect histograms of the delay between a task becoming runnable and running for each CPU, task and cgroup into a csv file next to the trace." },
+	{ "placement", OPT_PLACEMENT, 0, 0, "Collect the prev_cpu to new_cpu matrix of wakeup placement and EAS decisions for each task into a csv file next to the trace." },
+	{ "sugov", OPT_SUGOV, 0, 0, "Collect schedutil requested frequencies, util and updates dropped by rate_limit_us for each policy." },
+	{ "idle_governor", OPT_IDLE_GOVERNOR, 0, 0, "Collect the matrix of idle states selected by the teo or menu governor vs the ideal ones for each CPU into a csv file next to the trace." },
 	/* filters */
 	{ "pid", OPT_FILTER_PID, "PID", 0, "Collect data for task match pid only. Can be provided multiple times." },
+	{ "tgid", OPT_FILTER_TGID, "TGID", 0, "Collect data for tasks that belong to process tgid only. Can be provided multiple times." },
 	{ "comm", OPT_FILTER_COMM, "COMM", 0, "Collect data for tasks that contain comm only. Can be provided multiple times." },
 	{ 0 },
 };
@@ -194,6 +268,152 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		sa_opts.function_filter[sa_opts.num_function_filter] = arg;
 		sa_opts.num_function_filter++;
 		break;
+	case OPT_CONSUMER_THREADS:
+		errno = 0;
+		sa_opts.consumer_threads = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported consumer_threads value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "consumer_threads: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_RB_SIZE:
+		if (sa_opts.num_rb_size >= MAX_FILTERS_NUM) {
+			fprintf(stderr, "Can't accept more --rb_size, dropping %s\n", arg);
+			break;
+		}
+		sa_opts.rb_size[sa_opts.num_rb_size] = arg;
+		sa_opts.num_rb_size++;
+		break;
+	case OPT_RB_SIZE_AUTO:
+		sa_opts.rb_size_auto = true;
+		break;
+	case OPT_PELT_DEADBAND:
+		errno = 0;
+		sa_opts.pelt_deadband = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported pelt_deadband value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "pelt_deadband: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_PELT_MIN_INTERVAL:
+		errno = 0;
+		sa_opts.pelt_min_interval = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported pelt_min_interval value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "pelt_min_interval: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_HISTOGRAM:
+		sa_opts.histogram = true;
+		break;
+	case OPT_HISTOGRAM_INTERVAL:
+		errno = 0;
+		sa_opts.histogram_interval = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported histogram_interval value\n");
+			return errno;
+		}
+		if (end_ptr == arg || !sa_opts.histogram_interval) {
+			fprintf(stderr, "histogram_interval: must be at least 1 second\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_RESIDENCY:
+		sa_opts.residency = true;
+		break;
+	case OPT_SOFTIRQ_THRESHOLD:
+		errno = 0;
+		sa_opts.softirq_threshold = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported softirq_threshold value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "softirq_threshold: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_IRQ_THRESHOLD:
+		errno = 0;
+		sa_opts.irq_threshold = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported irq_threshold value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "irq_threshold: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_WAKEUP_LATENCY_THRESHOLD:
+		errno = 0;
+		sa_opts.wakeup_latency_threshold = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported wakeup_latency_threshold value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "wakeup_latency_threshold: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_PLACEMENT_EVENTS:
+		sa_opts.placement_events = true;
+		break;
+	case OPT_LOAD_BALANCE_STATS:
+		sa_opts.load_balance_stats = true;
+		break;
+	case OPT_LOAD_BALANCE_THRESHOLD:
+		errno = 0;
+		sa_opts.load_balance_threshold = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported load_balance_threshold value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "load_balance_threshold: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_IPI_MATRIX:
+		sa_opts.ipi_matrix = true;
+		break;
+	case OPT_IPI_TOP:
+		errno = 0;
+		sa_opts.ipi_top = strtoul(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported ipi_top value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "ipi_top: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		break;
+	case OPT_CPU_IDLE_MISS_EVENTS:
+		sa_opts.cpu_idle_miss_events = true;
+		break;
 	/* events */
 	case OPT_LOAD_AVG:
 		sa_opts.load_avg_cpu = true;
@@ -254,9 +474,18 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case OPT_CPU_NR_RUNNING:
 		sa_opts.cpu_nr_running = true;
 		break;
+	case OPT_CPU_FREQ:
+		sa_opts.cpu_freq = true;
+		break;
 	case OPT_CPU_IDLE:
 		sa_opts.cpu_idle = true;
 		break;
+	case OPT_SOFTIRQ:
+		sa_opts.softirq = true;
+		break;
+	case OPT_SCHED_SWITCH:
+		sa_opts.sched_switch = true;
+		break;
 	case OPT_LOAD_BALANCE:
 		sa_opts.load_balance = true;
 		break;
@@ -266,6 +495,18 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 	case OPT_IRQ:
 		sa_opts.irq = true;
 		break;
+	case OPT_WAKEUP_LATENCY:
+		sa_opts.wakeup_latency = true;
+		break;
+	case OPT_PLACEMENT:
+		sa_opts.placement = true;
+		break;
+	case OPT_SUGOV:
+		sa_opts.sugov = true;
+		break;
+	case OPT_IDLE_GOVERNOR:
+		sa_opts.idle_governor = true;
+		break;
 	case OPT_FILTER_PID:
 		if (sa_opts.num_pids >= MAX_FILTERS_NUM) {
 			fprintf(stderr, "Can't accept more --pid, dropping %s\n", arg);
@@ -284,6 +525,24 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
 		}
 		sa_opts.num_pids++;
 		break;
+	case OPT_FILTER_TGID:
+		if (sa_opts.num_tgids >= MAX_FILTERS_NUM) {
+			fprintf(stderr, "Can't accept more --tgid, dropping %s\n", arg);
+			break;
+		}
+		errno = 0;
+		sa_opts.tgid[sa_opts.num_tgids] = strtol(arg, &end_ptr, 0);
+		if (errno != 0) {
+			perror("Unsupported tgid value\n");
+			return errno;
+		}
+		if (end_ptr == arg) {
+			fprintf(stderr, "tgid: no digits were found\n");
+			argp_usage(state);
+			return -EINVAL;
+		}
+		sa_opts.num_tgids++;
+		break;
 	case OPT_FILTER_COMM:
 		if (sa_opts.num_comms >= MAX_FILTERS_NUM) {
 			fprintf(stderr, "Can't accept more --comm, dropping %s\n", arg);
@@ -26,6 +26,24 @@ struct sa_opts {
 	char *atrace_cat[MAX_FILTERS_NUM];
 	char *function_graph[MAX_FILTERS_NUM];
 	char *function_filter[MAX_FILTERS_NUM];
+	unsigned int consumer_threads;
+	unsigned int num_rb_size;
+	char *rb_size[MAX_FILTERS_NUM];
+	bool rb_size_auto;
+	unsigned int pelt_deadband;
+	unsigned int pelt_min_interval;
+	bool histogram;
+	unsigned int histogram_interval;
+	bool residency;
+	unsigned int softirq_threshold;
+	unsigned int irq_threshold;
+	unsigned int wakeup_latency_threshold;
+	bool placement_events;
+	bool load_balance_stats;
+	unsigned int load_balance_threshold;
+	bool ipi_matrix;
+	unsigned int ipi_top;
+	bool cpu_idle_miss_events;
 	/* events */
 	bool load_avg_cpu;
 	bool runnable_avg_cpu;
@@ -47,14 +65,22 @@ struct sa_opts {
 	bool load_balance;
 	bool ipi;
 	bool irq;
+	bool wakeup_latency;
+	bool placement;
+	bool sugov;
+	bool idle_governor;
 	/* filters */
 	unsigned int num_pids;
+	unsigned int num_tgids;
 	unsigned int num_comms;
 	pid_t pid[MAX_FILTERS_NUM];
+	pid_t tgid[MAX_FILTERS_NUM];
 	char comm[MAX_FILTERS_NUM][TASK_COMM_LEN];
 };
 
+#ifndef __SA_BPF_BUILD
 extern struct sa_opts sa_opts;
 extern const struct argp argp;
+#endif
 
 #endif /* __PARSE_ARGS_H__ */
@@ -6,141 +6,281 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_NUM_SYMBOLS		500000
 #define LINE_SIZE		256
-#define SYMBOL_LEN		128
 
-struct symbol {
-	void *address;
-	char symbol[SYMBOL_LEN];
+/*
+ * Symbols are kept sorted by address in a dense array that is binary searched,
+ * with names in a single string pool @names[offsets[i]]. Both grow while
+ * reading /proc/kallsyms, which is already mostly sorted.
+ */
+static unsigned long *addresses;
+static unsigned int *offsets;
+static unsigned int nr_symbols;
+static char *names;
+static size_t names_size;
+static bool ready;
+
+struct ksym {
+	unsigned long address;
+	unsigned int offset;
 };
 
-static struct symbol symbols[MAX_NUM_SYMBOLS];
-static bool ready;
+/*
+ * Small direct-mapped cache of the last lookups, callsites repeat a lot. Per
+ * thread as ring buffers can be drained by several.
+ */
+#define KSYM_CACHE_SIZE		256
+
+struct ksym_cache {
+	unsigned long address;
+	const char *name;
+};
 
+static __thread struct ksym_cache ksym_cache[KSYM_CACHE_SIZE];
 
 static int cmp(const void *a, const void *b)
 {
-	struct symbol *i = (struct symbol *)a;
-	struct symbol *j = (struct symbol *)b;
+	const struct ksym *i = a;
+	const struct ksym *j = b;
 
-	return i->address - j->address;
+	if (i->address != j->address)
+		return i->address < j->address ? -1 : 1;
+
+	/* Keep the order of kallsyms for aliases */
+	return i->offset < j->offset ? -1 : i->offset > j->offset;
 }
 
-void parse_kallsyms(void)
+static bool kptr_restricted(void)
 {
 	char line[LINE_SIZE] = { 0 };
-	unsigned int i = 0;
 	FILE *fp;
 
 	fp = fopen("/proc/sys/kernel/kptr_restrict", "r");
-	if (fp) {
-		if (fgets(line, LINE_SIZE, fp)) {
-			char *end_ptr;
-			int val = strtol(line, &end_ptr, 0);
-			if (val >= 2) {
-				fprintf(stderr, "/proc/sys/kernel/kptr_restrict is %d, won't be able to parse kallsyms\n", val);
-				fclose(fp);
-				return;
-			}
-		}
-		fclose(fp);
-	} else {
+	if (!fp) {
 		fprintf(stderr, "Failed to open /proc/sys/kernel/kptr_restrict, might fail to parse kallsyms\n");
+		return false;
 	}
 
+	if (fgets(line, LINE_SIZE, fp)) {
+		int val = strtol(line, NULL, 0);
+		if (val >= 2) {
+			fprintf(stderr, "/proc/sys/kernel/kptr_restrict is %d, won't be able to parse kallsyms\n", val);
+			fclose(fp);
+			return true;
+		}
+	}
+
+	fclose(fp);
+
+	return false;
+}
+
+/*
+ * Parse one "address type name [module]" line. @name points into @line and is
+ * NUL terminated in place.
+ */
+static bool parse_line(char *line, unsigned long *address, char **name, size_t *len)
+{
+	char *end_ptr, *c;
+
+	errno = 0;
+	*address = strtoul(line, &end_ptr, 16);
+	if (errno != 0 || end_ptr == line || *end_ptr != ' ')
+		return false;
+
+	/* Skip ' type ' */
+	c = end_ptr + 1;
+	if (!*c || c[1] != ' ')
+		return false;
+	c += 2;
+
+	*name = c;
+	*len = strcspn(c, " \t\n");
+	if (!*len)
+		return false;
+	c[*len] = '\0';
+
+	return true;
+}
+
+static void kallsyms_free(void)
+{
+	free(addresses);
+	free(offsets);
+	free(names);
+	addresses = NULL;
+	offsets = NULL;
+	names = NULL;
+	nr_symbols = 0;
+	names_size = 0;
+}
+
+void parse_kallsyms(void)
+{
+	size_t names_alloc = 0, line_size = 0, len;
+	unsigned int i, nr_alloc = 0;
+	struct ksym *syms = NULL;
+	bool sorted = true;
+	char *line = NULL;
+	char *name;
+	FILE *fp;
+
+	if (ready)
+		return;
+
+	if (kptr_restricted())
+		return;
+
 	fp = fopen("/proc/kallsyms", "r");
 	if (!fp) {
 		fprintf(stderr, "Failed to open /proc/kallsyms\n");
 		return;
 	}
 
-	while (fgets(line, LINE_SIZE, fp) && i < MAX_NUM_SYMBOLS) {
-		char *end_ptr;
-		char *token;
+	while (getline(&line, &line_size, fp) > 0) {
+		unsigned long address;
 
-		/* Get address first */
-		token = strtok(line, " ");
-		if (!token) {
+		if (!parse_line(line, &address, &name, &len)) {
 			fprintf(stderr, "Error parsing kallsyms\n");
 			break;
 		}
 
-		errno = 0;
-		symbols[i].address = (void *)strtoul(line, &end_ptr, 16);
-		if (errno != 0) {
-			perror("Unsupported address value\n");
-			break;
-		}
-		if (end_ptr == line) {
-			fprintf(stderr, "address: no digits were found\n");
-			break;
-		}
+		if (nr_symbols == nr_alloc) {
+			struct ksym *tmp;
 
-		/* Skip 'type' field */
-		token = strtok(NULL, " ");
-		if (!token) {
-			fprintf(stderr, "Error parsing kallsyms\n");
-			break;
+			nr_alloc = nr_alloc ? nr_alloc * 2 : 65536;
+			tmp = realloc(syms, nr_alloc * sizeof(*syms));
+			if (!tmp)
+				goto out_nomem;
+			syms = tmp;
 		}
 
-		/* Get symbol name */
-		token = strtok(NULL, " ");
-		if (!token) {
-			fprintf(stderr, "Error parsing kallsyms\n");
-			break;
+		if (names_size + len + 1 > names_alloc) {
+			char *tmp;
+
+			names_alloc = names_alloc ? names_alloc * 2 : 1 << 20;
+			tmp = realloc(names, names_alloc);
+			if (!tmp)
+				goto out_nomem;
+			names = tmp;
 		}
 
-		strncpy(symbols[i].symbol, token, SYMBOL_LEN-1);
-		symbols[i].symbol[SYMBOL_LEN-1] = '0';
-		i++;
+		if (nr_symbols && address < syms[nr_symbols - 1].address)
+			sorted = false;
+
+		syms[nr_symbols].address = address;
+		syms[nr_symbols].offset = names_size;
+		memcpy(names + names_size, name, len + 1);
+		names_size += len + 1;
+		nr_symbols++;
 	}
 
 	fclose(fp);
+	free(line);
+
+	if (!nr_symbols) {
+		free(syms);
+		kallsyms_free();
+		return;
+	}
+
+	if (!sorted)
+		qsort(syms, nr_symbols, sizeof(*syms), cmp);
+
+	addresses = malloc(nr_symbols * sizeof(*addresses));
+	offsets = malloc(nr_symbols * sizeof(*offsets));
+	if (!addresses || !offsets) {
+		free(syms);
+		kallsyms_free();
+		fprintf(stderr, "Failed to allocate kallsyms\n");
+		return;
+	}
+
+	for (i = 0; i < nr_symbols; i++) {
+		addresses[i] = syms[i].address;
+		offsets[i] = syms[i].offset;
+	}
 
-	qsort(symbols, MAX_NUM_SYMBOLS, sizeof(struct symbol), cmp);
+	free(syms);
 
 	ready = true;
+	return;
+
+out_nomem:
+	fprintf(stderr, "Failed to allocate kallsyms\n");
+	fclose(fp);
+	free(line);
+	free(syms);
+	kallsyms_free();
 }
 
-static char *____find_kallsyms(unsigned int start, unsigned int end, void *address)
+/*
+ * Index of the last symbol at or below @address. The loop has no data
+ * dependent branch, the compiler turns the select into a cmov.
+ */
+static unsigned int kallsyms_index(unsigned long address)
 {
-	while (start <= end-1) {
-		if (symbols[start].address <= address &&
-		    symbols[start+1].address >= address)
-			return symbols[start].symbol;
-		start++;
-	}
+	const unsigned long *base = addresses;
+	unsigned int n = nr_symbols;
 
-	fprintf(stderr, "Couldn't find_kallsyms() for address: %p\n", address);
+	while (n > 1) {
+		unsigned int half = n / 2;
 
-	return NULL;
+		base = base[half] <= address ? base + half : base;
+		n -= half;
+	}
+
+	return base - addresses;
 }
 
-static char *__find_kallsyms(unsigned int start, unsigned int pivot,
-			     unsigned int end, void *address)
+char *find_kallsyms(void *address)
 {
-	if (end - start <= 100)
-		return ____find_kallsyms(start, end, address);
+	unsigned long addr = (unsigned long)address;
+	struct ksym_cache *cache;
+	unsigned int i;
 
-	if (address == symbols[pivot].address)
-		return symbols[pivot].symbol;
+	if (!address || !ready)
+		return NULL;
 
-	if (address > symbols[pivot].address)
-		return __find_kallsyms(pivot, pivot+(end-pivot)/2, end, address);
+	cache = &ksym_cache[(addr ^ addr >> 12) % KSYM_CACHE_SIZE];
+	if (cache->address == addr && cache->name)
+		return (char *)cache->name;
 
-	if (address < symbols[pivot].address)
-		return __find_kallsyms(start, start+(pivot-start)/2, pivot, address);
+	i = kallsyms_index(addr);
+	if (addresses[i] > addr) {
+		fprintf(stderr, "Couldn't find_kallsyms() for address: %p\n", address);
+		return NULL;
+	}
 
-	fprintf(stderr, "Reached unexpeted path while searching for address: %p\n", address);
+	cache->address = addr;
+	cache->name = names + offsets[i];
 
-	return NULL;
+	return (char *)cache->name;
 }
 
-char *find_kallsyms(void *address)
+/*
+ * Static functions can be emitted as .isra/.constprop clones when gcc changes
+ * their signature, return the name @name is known by in kallsyms. NULL if it
+ * isn't there, @name itself if kallsyms couldn't be parsed.
+ */
+const char *find_kallsyms_function(const char *name)
 {
-	if (!address || !ready)
-		return NULL;
+	size_t len = strlen(name);
+	const char *clone = NULL;
+	const char *symbol;
+
+	if (!ready)
+		return name;
+
+	for (symbol = names; symbol < names + names_size; symbol += strlen(symbol) + 1) {
+		if (strncmp(symbol, name, len))
+			continue;
+		if (symbol[len] == '\0')
+			return symbol;
+		if (!clone && (!strncmp(symbol + len, ".isra.", 6) ||
+			       !strncmp(symbol + len, ".constprop.", 11)))
+			clone = symbol;
+	}
 
-	return __find_kallsyms(0, MAX_NUM_SYMBOLS/2, MAX_NUM_SYMBOLS-1, address);
+	return clone;
 }
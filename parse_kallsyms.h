@@ -5,5 +5,6 @@
 
 void parse_kallsyms(void);
 char *find_kallsyms(void *address);
+const char *find_kallsyms_function(const char *name);
 
 #endif /* __PARSE_KALLSYMS_H__ */
@@ -5,7 +5,10 @@
 #include <fcntl.h>
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <perfetto.h>
+#include <string>
+#include <unordered_map>
 
 #include "parse_argp.h"
 #include "sched-analyzer-events.h"
@@ -13,10 +16,17 @@
 PERFETTO_DEFINE_CATEGORIES(
 	perfetto::Category("pelt-cpu").SetDescription("Track PELT at CPU level"),
 	perfetto::Category("pelt-task").SetDescription("Track PELT at task level"),
+	perfetto::Category("pelt-histogram").SetDescription("Track distribution of PELT signals"),
 	perfetto::Category("nr-running-cpu").SetDescription("Track number of tasks running on each CPU"),
 	perfetto::Category("cpu-idle").SetDescription("Track cpu idle info for each CPU"),
 	perfetto::Category("load-balance").SetDescription("Track load balance internals"),
 	perfetto::Category("ipi").SetDescription("Track inter-processor interrupts"),
+	perfetto::Category("softirq").SetDescription("Track long softirqs"),
+	perfetto::Category("irq").SetDescription("Track long irq handlers"),
+	perfetto::Category("wakeup-latency").SetDescription("Track long wakeup to running delays"),
+	perfetto::Category("placement").SetDescription("Track wakeup CPU selection of tasks"),
+	perfetto::Category("sugov").SetDescription("Track schedutil frequency requests"),
+	perfetto::Category("ringbuffer").SetDescription("Track sched-analyzer BPF ring buffers health"),
 );
 
 PERFETTO_TRACK_EVENT_STATIC_STORAGE();
@@ -25,6 +35,12 @@ enum sched_analyzer_track_ids {
 	SA_TRACK_ID_CPU_IDLE_MISS = 1,		/* must start from none 0 */
 	SA_TRACK_ID_LOAD_BALANCE,
 	SA_TRACK_ID_IPI,
+	SA_TRACK_ID_PELT_HIST,
+	SA_TRACK_ID_SOFTIRQ,
+	SA_TRACK_ID_IRQ,
+	SA_TRACK_ID_WAKEUP_LATENCY,
+	SA_TRACK_ID_PLACEMENT,
+	SA_TRACK_ID_SUGOV,
 };
 
 #define TRACK_SPACING		1000
@@ -32,6 +48,120 @@ enum sched_analyzer_track_ids {
 
 #define FAKE_DURATION		10000  /* 10us */
 
+/*
+ * Counter tracks are created once per (cpu or pid, counter) and reused for
+ * every event instead of formatting and hashing the track name each time.
+ */
+enum sa_counter {
+	SA_COUNTER_LOAD_AVG,
+	SA_COUNTER_RUNNABLE_AVG,
+	SA_COUNTER_UTIL_AVG,
+	SA_COUNTER_UCLAMPED_AVG,
+	SA_COUNTER_UTIL_EST_ENQUEUED,
+	SA_COUNTER_UTIL_EST_EWMA,
+	SA_COUNTER_UTIL_AVG_RT,
+	SA_COUNTER_UTIL_AVG_DL,
+	SA_COUNTER_UTIL_AVG_IRQ,
+	SA_COUNTER_LOAD_AVG_THERMAL,
+	SA_COUNTER_NR_RUNNING,
+	SA_COUNTER_IDLE_STATE,
+	SA_COUNTER_MISFIT_TASK_LOAD,
+	SA_COUNTER_REQUESTED_FREQ,
+	SA_COUNTER_SUGOV_UTIL,
+	SA_COUNTER_ACTUAL_FREQ,
+	SA_COUNTER_RB_FILL,
+	SA_COUNTER_RB_DROPS,
+	SA_COUNTER_MAX,
+};
+
+static const char * const sa_counter_names[SA_COUNTER_MAX] = {
+	"load_avg",
+	"runnable_avg",
+	"util_avg",
+	"uclamped_avg",
+	"util_est.enqueued",
+	"util_est.ewma",
+	"util_avg_rt",
+	"util_avg_dl",
+	"util_avg_irq",
+	"load_avg_thermal",
+	"nr_running",
+	"idle_state",
+	"misfit_task_load",
+	"requested_freq",
+	"sugov_util",
+	"actual_freq",
+	"fill%",
+	"drops",
+};
+
+struct sa_counter_track {
+	/* DynamicString doesn't own the name, must be declared before track */
+	std::string name;
+	char comm[TASK_COMM_LEN];
+	perfetto::CounterTrack track;
+
+	sa_counter_track(const char *track_name, const char *task_comm)
+		: name(track_name), track(perfetto::DynamicString{name})
+	{
+		strncpy(comm, task_comm ? task_comm : "", TASK_COMM_LEN);
+	}
+};
+
+typedef std::unordered_map<uint64_t, std::shared_ptr<sa_counter_track>> sa_counter_tracks;
+
+static std::mutex counter_tracks_lock;
+static sa_counter_tracks cpu_counter_tracks;
+static sa_counter_tracks task_counter_tracks;
+static sa_counter_tracks rb_counter_tracks;
+
+static inline uint64_t counter_key(int id, enum sa_counter counter)
+{
+	return (uint64_t)(uint32_t)id << 8 | counter;
+}
+
+static std::shared_ptr<sa_counter_track> cpu_counter(int cpu, enum sa_counter counter)
+{
+	std::lock_guard<std::mutex> guard(counter_tracks_lock);
+	auto &track = cpu_counter_tracks[counter_key(cpu, counter)];
+
+	if (!track) {
+		char track_name[64];
+		snprintf(track_name, sizeof(track_name), "CPU%d %s",
+			 cpu, sa_counter_names[counter]);
+		track = std::make_shared<sa_counter_track>(track_name, nullptr);
+	}
+
+	return track;
+}
+
+/*
+ * Track names contain the comm; start a new track if the task was renamed.
+ */
+static std::shared_ptr<sa_counter_track> task_counter(const char *comm, int pid,
+						      enum sa_counter counter)
+{
+	std::lock_guard<std::mutex> guard(counter_tracks_lock);
+	auto &track = task_counter_tracks[counter_key(pid, counter)];
+
+	if (!track || strncmp(track->comm, comm, TASK_COMM_LEN)) {
+		char track_name[64];
+		snprintf(track_name, sizeof(track_name), "%s-%d %s",
+			 comm, pid, sa_counter_names[counter]);
+		track = std::make_shared<sa_counter_track>(track_name, comm);
+	}
+
+	return track;
+}
+
+extern "C" void release_task_counters(int pid)
+{
+	std::lock_guard<std::mutex> guard(counter_tracks_lock);
+
+	for (int i = 0; i < SA_COUNTER_MAX; i++)
+		task_counter_tracks.erase(counter_key(pid, (enum sa_counter)i));
+}
+
 
 extern "C" void init_perfetto(void)
 {
@@ -120,8 +250,6 @@ extern "C" void start_perfetto_trace(void)
 	ftrace_cfg.add_ftrace_events("task/task_newtask");
 	ftrace_cfg.add_ftrace_events("task/task_rename");
 	ftrace_cfg.add_ftrace_events("ftrace/print");
-	if (sa_opts.irq)
-		ftrace_cfg.add_atrace_categories("irq");
 
 	for (unsigned int i = 0; i < sa_opts.num_ftrace_event; i++)
 		ftrace_cfg.add_ftrace_events(sa_opts.ftrace_event[i]);
@@ -189,138 +317,194 @@ extern "C" void stop_perfetto_trace(void)
 
 extern "C" void trace_cpu_load_avg(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d load_avg", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_LOAD_AVG);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_runnable_avg(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d runnable_avg", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_RUNNABLE_AVG);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_util_avg(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d util_avg", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_UTIL_AVG);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_uclamped_avg(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d uclamped_avg", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_UCLAMPED_AVG);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_util_est_enqueued(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d util_est.enqueued", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_UTIL_EST_ENQUEUED);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_util_avg_rt(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d util_avg_rt", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_UTIL_AVG_RT);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_util_avg_dl(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d util_avg_rt", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_UTIL_AVG_DL);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_util_avg_irq(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d util_avg_rt", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_UTIL_AVG_IRQ);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_load_avg_thermal(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d load_avg_thermal", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_LOAD_AVG_THERMAL);
 
-	TRACE_COUNTER("pelt-cpu", track_name, ts, value);
+	TRACE_COUNTER("pelt-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_task_load_avg(uint64_t ts, const char *name, int pid, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "%s-%d load_avg", name, pid);
+	auto track = task_counter(name, pid, SA_COUNTER_LOAD_AVG);
 
-	TRACE_COUNTER("pelt-task", track_name, ts, value);
+	TRACE_COUNTER("pelt-task", track->track, ts, value);
 }
 
 extern "C" void trace_task_runnable_avg(uint64_t ts, const char *name, int pid, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "%s-%d runnable_avg", name, pid);
+	auto track = task_counter(name, pid, SA_COUNTER_RUNNABLE_AVG);
 
-	TRACE_COUNTER("pelt-task", track_name, ts, value);
+	TRACE_COUNTER("pelt-task", track->track, ts, value);
 }
 
 extern "C" void trace_task_util_avg(uint64_t ts, const char *name, int pid, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "%s-%d util_avg", name, pid);
+	auto track = task_counter(name, pid, SA_COUNTER_UTIL_AVG);
 
-	TRACE_COUNTER("pelt-task", track_name, ts, value);
+	TRACE_COUNTER("pelt-task", track->track, ts, value);
 }
 
 extern "C" void trace_task_uclamped_avg(uint64_t ts, const char *name, int pid, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "%s-%d uclamped_avg", name, pid);
+	auto track = task_counter(name, pid, SA_COUNTER_UCLAMPED_AVG);
 
-	TRACE_COUNTER("pelt-task", track_name, ts, value);
+	TRACE_COUNTER("pelt-task", track->track, ts, value);
 }
 
 extern "C" void trace_task_util_est_enqueued(uint64_t ts, const char *name, int pid, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "%s-%d util_est.enqueued", name, pid);
+	auto track = task_counter(name, pid, SA_COUNTER_UTIL_EST_ENQUEUED);
 
-	TRACE_COUNTER("pelt-task", track_name, ts, value);
+	TRACE_COUNTER("pelt-task", track->track, ts, value);
 }
 
 extern "C" void trace_task_util_est_ewma(uint64_t ts, const char *name, int pid, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "%s-%d util_est.ewma", name, pid);
+	auto track = task_counter(name, pid, SA_COUNTER_UTIL_EST_EWMA);
+
+	TRACE_COUNTER("pelt-task", track->track, ts, value);
+}
+
+static const char * const pelt_hist_names[PELT_HIST_NR_SIGNALS] = {
+	"runnable_avg histogram",
+	"util_avg histogram",
+	"util_est.enqueued histogram",
+};
+
+/*
+ * One track per (cpu or pid, signal). Ids are above anything TRACK_ID() hands
+ * out.
+ */
+static perfetto::Track pelt_hist_track(bool task, int id, int signal,
+				       const char *track_name)
+{
+	perfetto::Track track((uint64_t)TRACK_ID(PELT_HIST) << 40 |
+			      (uint64_t)task << 39 |
+			      (uint64_t)(uint32_t)id << 4 | signal);
+	auto desc = track.Serialize();
+
+	desc.set_name(track_name);
+	perfetto::TrackEvent::SetTrackDescriptor(track, desc);
+
+	return track;
+}
+
+/*
+ * A slice covering the interval the histogram was collected over, with the
+ * count of each bucket as arguments.
+ */
+static void trace_pelt_hist(perfetto::Track track, uint64_t start, uint64_t end,
+			    int signal, const unsigned long long *buckets)
+{
+	TRACE_EVENT_BEGIN("pelt-histogram",
+			  perfetto::StaticString{pelt_hist_names[signal]},
+			  track, start, [&](perfetto::EventContext ctx) {
+		char name[16];
+
+		for (int i = 0; i < PELT_HIST_NR_BUCKETS; i++) {
+			int lo = i * PELT_HIST_BUCKET_WIDTH;
+
+			if (i == PELT_HIST_NR_BUCKETS - 1)
+				snprintf(name, sizeof(name), "%d+", lo);
+			else
+				snprintf(name, sizeof(name), "%d-%d", lo,
+					 lo + PELT_HIST_BUCKET_WIDTH - 1);
+			ctx.AddDebugAnnotation(perfetto::DynamicString{name}, buckets[i]);
+		}
+	});
+
+	TRACE_EVENT_END("pelt-histogram", track, end);
+}
+
+extern "C" void trace_cpu_pelt_hist(uint64_t start, uint64_t end, int cpu,
+				    int signal, const unsigned long long *buckets)
+{
+	char track_name[64];
+
+	snprintf(track_name, sizeof(track_name), "CPU%d %s", cpu, pelt_hist_names[signal]);
+
+	trace_pelt_hist(pelt_hist_track(false, cpu, signal, track_name),
+			start, end, signal, buckets);
+}
+
+extern "C" void trace_task_pelt_hist(uint64_t start, uint64_t end, const char *name,
+				     int pid, int signal, const unsigned long long *buckets)
+{
+	char track_name[64];
+
+	snprintf(track_name, sizeof(track_name), "%s-%d %s", name, pid, pelt_hist_names[signal]);
 
-	TRACE_COUNTER("pelt-task", track_name, ts, value);
+	trace_pelt_hist(pelt_hist_track(true, pid, signal, track_name),
+			start, end, signal, buckets);
 }
 
 extern "C" void trace_cpu_nr_running(uint64_t ts, int cpu, int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d nr_running", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_NR_RUNNING);
 
-	TRACE_COUNTER("nr-running-cpu", track_name, ts, value);
+	TRACE_COUNTER("nr-running-cpu", track->track, ts, value);
 }
 
 extern "C" void trace_cpu_idle(uint64_t ts, int cpu, int state)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d idle_state", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_IDLE_STATE);
 
-	TRACE_COUNTER("cpu-idle", track_name, ts, state);
+	TRACE_COUNTER("cpu-idle", track->track, ts, state);
 }
 
 extern "C" void trace_cpu_idle_miss(uint64_t ts, int cpu, int state, int miss)
@@ -335,7 +519,7 @@ extern "C" void trace_cpu_idle_miss(uint64_t ts, int cpu, int state, int miss)
 			ts + FAKE_DURATION);
 }
 
-extern "C" void trace_lb_entry(uint64_t ts, int this_cpu, int lb_cpu, char *phase)
+extern "C" void trace_lb_entry(uint64_t ts, int this_cpu, int lb_cpu, const char *phase)
 {
 	TRACE_EVENT_BEGIN("load-balance", phase,
 			  perfetto::Track(TRACK_ID(LOAD_BALANCE) + this_cpu),
@@ -348,44 +532,67 @@ extern "C" void trace_lb_exit(uint64_t ts, int this_cpu, int lb_cpu)
 			perfetto::Track(TRACK_ID(LOAD_BALANCE) + this_cpu), ts);
 }
 
-extern "C" void trace_lb_sd_stats(uint64_t ts, struct lb_sd_stats *sd_stats)
+/*
+ * A whole phase, on the same track entry/exit slices would have been.
+ */
+extern "C" void trace_lb_phase(uint64_t ts, int this_cpu, int lb_cpu, const char *phase,
+			       int sd_level, const char *outcome, uint64_t duration)
 {
-	char track_name[64];
-	int i;
+	perfetto::Track track(TRACK_ID(LOAD_BALANCE) + this_cpu);
 
-	for (i = 0; i < MAX_SD_LEVELS; i++) {
-		if (sd_stats->level[i] == -1 && !sd_stats->balance_interval[i])
-			break;
+	if (outcome)
+		TRACE_EVENT_BEGIN("load-balance", perfetto::StaticString{phase}, track, ts,
+				  "CPU", lb_cpu, "LEVEL", sd_level, "OUTCOME", outcome);
+	else
+		TRACE_EVENT_BEGIN("load-balance", perfetto::StaticString{phase}, track, ts,
+				  "CPU", lb_cpu);
 
-		snprintf(track_name, sizeof(track_name), "CPU%d.level%d.balance_interval",
-			 sd_stats->cpu, sd_stats->level[i]);
+	TRACE_EVENT_END("load-balance", track, ts + duration);
+}
+
+/*
+ * One counter per (cpu, sched domain level), only updated when the interval
+ * changes.
+ */
+static sa_counter_tracks sd_interval_tracks;
+
+static std::shared_ptr<sa_counter_track> sd_interval_counter(int cpu, int level)
+{
+	std::lock_guard<std::mutex> guard(counter_tracks_lock);
+	auto &track = sd_interval_tracks[(uint64_t)(uint32_t)cpu << 8 | (uint8_t)level];
 
-		TRACE_COUNTER("load-balance", track_name, ts, sd_stats->balance_interval[i]);
+	if (!track) {
+		char track_name[64];
+		snprintf(track_name, sizeof(track_name), "CPU%d.level%d.balance_interval",
+			 cpu, level);
+		track = std::make_shared<sa_counter_track>(track_name, nullptr);
 	}
+
+	return track;
 }
 
-extern "C" void trace_lb_overloaded(uint64_t ts, unsigned int value)
+extern "C" void trace_lb_sd_interval(uint64_t ts, int cpu, int level, unsigned int interval)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "rd.overloaded");
+	auto track = sd_interval_counter(cpu, level);
 
-	TRACE_COUNTER("load-balance", track_name, ts, value);
+	TRACE_COUNTER("load-balance", track->track, ts, interval);
 }
 
-extern "C" void trace_lb_overutilized(uint64_t ts, unsigned int value)
+extern "C" void trace_lb_overloaded(uint64_t ts, unsigned int value)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "rd.overutilized");
+	TRACE_COUNTER("load-balance", "rd.overloaded", ts, value);
+}
 
-	TRACE_COUNTER("load-balance", track_name, ts, value);
+extern "C" void trace_lb_overutilized(uint64_t ts, unsigned int value)
+{
+	TRACE_COUNTER("load-balance", "rd.overutilized", ts, value);
 }
 
 extern "C" void trace_lb_misfit(uint64_t ts, int cpu, unsigned long misfit_task_load)
 {
-	char track_name[32];
-	snprintf(track_name, sizeof(track_name), "CPU%d misfit_task_load", cpu);
+	auto track = cpu_counter(cpu, SA_COUNTER_MISFIT_TASK_LOAD);
 
-	TRACE_COUNTER("load-balance", track_name, ts, misfit_task_load);
+	TRACE_COUNTER("load-balance", track->track, ts, misfit_task_load);
 }
 
 extern "C" void trace_ipi_send_cpu(uint64_t ts, int from_cpu, int target_cpu,
@@ -405,6 +612,180 @@ extern "C" void trace_ipi_send_cpu(uint64_t ts, int from_cpu, int target_cpu,
 			ts + FAKE_DURATION);
 }
 
+extern "C" void trace_softirq(uint64_t ts, int cpu, const char *name, uint64_t duration)
+{
+	TRACE_EVENT_BEGIN("softirq", perfetto::DynamicString{name},
+			  perfetto::Track(TRACK_ID(SOFTIRQ) + cpu), ts, "CPU", cpu);
+
+	TRACE_EVENT_END("softirq", perfetto::Track(TRACK_ID(SOFTIRQ) + cpu),
+			ts + duration);
+}
+
+/*
+ * Per CPU slice tracks with a name, the descriptor is only emitted once.
+ */
+static std::mutex named_tracks_lock;
+static std::unordered_map<uint64_t, bool> named_tracks;
+
+static perfetto::Track named_cpu_track(uint64_t id, const char *fmt, int cpu)
+{
+	perfetto::Track track(id + cpu);
+	std::lock_guard<std::mutex> guard(named_tracks_lock);
+	bool &named = named_tracks[id + cpu];
+
+	if (!named) {
+		char track_name[32];
+		auto desc = track.Serialize();
+
+		snprintf(track_name, sizeof(track_name), fmt, cpu);
+		desc.set_name(track_name);
+		perfetto::TrackEvent::SetTrackDescriptor(track, desc);
+		named = true;
+	}
+
+	return track;
+}
+
+/*
+ * Per task slice tracks with a name, ids are above anything TRACK_ID() hands
+ * out. The name isn't updated if the task is renamed.
+ */
+static perfetto::Track named_task_track(uint64_t id, const char *fmt,
+					const char *comm, int pid)
+{
+	perfetto::Track track(id << 40 | (uint32_t)pid);
+	std::lock_guard<std::mutex> guard(named_tracks_lock);
+	bool &named = named_tracks[id << 40 | (uint32_t)pid];
+
+	if (!named) {
+		char track_name[64];
+		auto desc = track.Serialize();
+
+		snprintf(track_name, sizeof(track_name), fmt, comm, pid);
+		desc.set_name(track_name);
+		perfetto::TrackEvent::SetTrackDescriptor(track, desc);
+		named = true;
+	}
+
+	return track;
+}
+
+extern "C" void trace_irq(uint64_t ts, int cpu, int irq, const char *name, uint64_t duration)
+{
+	/* Named like the irq slices and tracks perfetto builds from ftrace */
+	auto track = named_cpu_track(TRACK_ID(IRQ), "Irq Cpu %d", cpu);
+	char slice_name[IRQ_NAME_LEN + 8];
+
+	snprintf(slice_name, sizeof(slice_name), "IRQ (%s)", name);
+
+	TRACE_EVENT_BEGIN("irq", perfetto::DynamicString{slice_name},
+			  track, ts, "irq", irq);
+
+	TRACE_EVENT_END("irq", track, ts + duration);
+}
+
+extern "C" void trace_wakeup_latency(uint64_t ts, int cpu, const char *name,
+				     int pid, uint64_t delay)
+{
+	/* A task waits on one rq at a time, its delays never overlap */
+	auto track = named_task_track(TRACK_ID(WAKEUP_LATENCY), "%s-%d runnable delay",
+				      name, pid);
+
+	TRACE_EVENT_BEGIN("wakeup-latency", "runnable delay",
+			  track, ts, "CPU", cpu);
+
+	TRACE_EVENT_END("wakeup-latency", track, ts + delay);
+}
+
+/*
+ * Decisions are shown on the CPU the task was placed on.
+ */
+extern "C" void trace_placement(uint64_t ts, const char *name, struct placement_event *e)
+{
+	auto track = named_cpu_track(TRACK_ID(PLACEMENT), "CPU%d placement", e->new_cpu);
+	const char *decision = e->decision == PLACEMENT_EAS ?
+			       "find_energy_efficient_cpu()" : "select_task_rq_fair()";
+
+	TRACE_EVENT_BEGIN("placement", perfetto::DynamicString{name}, track, ts,
+			  "PID", e->pid,
+			  "DECISION", decision,
+			  "PREV_CPU", e->prev_cpu,
+			  "NEW_CPU", e->new_cpu,
+			  "UTIL_AVG", e->util_avg,
+			  "UCLAMP_MIN", (int)e->uclamp_min,
+			  "UCLAMP_MAX", (int)e->uclamp_max,
+			  "PREV_CAPACITY", e->capacity[0],
+			  "PREV_CAPACITY_ORIG", e->capacity_orig[0],
+			  "NEW_CAPACITY", e->capacity[1],
+			  "NEW_CAPACITY_ORIG", e->capacity_orig[1]);
+
+	TRACE_EVENT_END("placement", track, ts + FAKE_DURATION);
+}
+
+/*
+ * Requests are per policy, on the track of policy->cpu. The util is the one of
+ * the CPU which triggered the update.
+ */
+extern "C" void trace_sugov_requested_freq(uint64_t ts, int cpu, unsigned long util,
+					   unsigned int freq)
+{
+	auto freq_track = cpu_counter(cpu, SA_COUNTER_REQUESTED_FREQ);
+	auto util_track = cpu_counter(cpu, SA_COUNTER_SUGOV_UTIL);
+
+	TRACE_COUNTER("sugov", freq_track->track, ts, freq);
+	TRACE_COUNTER("sugov", util_track->track, ts, util);
+}
+
+extern "C" void trace_sugov_rate_limited(uint64_t ts, int cpu, int update_cpu)
+{
+	auto track = named_cpu_track(TRACK_ID(SUGOV), "CPU%d sugov rate limited", cpu);
+
+	TRACE_EVENT_BEGIN("sugov", "rate_limited", track, ts, "UPDATE_CPU", update_cpu);
+
+	TRACE_EVENT_END("sugov", track, ts + FAKE_DURATION);
+}
+
+extern "C" void trace_cpu_actual_freq(uint64_t ts, int cpu, unsigned int freq)
+{
+	auto track = cpu_counter(cpu, SA_COUNTER_ACTUAL_FREQ);
+
+	TRACE_COUNTER("sugov", track->track, ts, freq);
+}
+
+/*
+ * Ring buffers are identified by their enum sa_rb_id, @name is only used to
+ * name the track the first time.
+ */
+static std::shared_ptr<sa_counter_track> rb_counter(int rb, const char *name,
+						    enum sa_counter counter)
+{
+	std::lock_guard<std::mutex> guard(counter_tracks_lock);
+	auto &track = rb_counter_tracks[counter_key(rb, counter)];
+
+	if (!track) {
+		char track_name[64];
+		snprintf(track_name, sizeof(track_name), "%s_rb %s",
+			 name, sa_counter_names[counter]);
+		track = std::make_shared<sa_counter_track>(track_name, nullptr);
+	}
+
+	return track;
+}
+
+extern "C" void trace_rb_fill(uint64_t ts, int rb, const char *name, int value)
+{
+	auto track = rb_counter(rb, name, SA_COUNTER_RB_FILL);
+
+	TRACE_COUNTER("ringbuffer", track->track, ts, value);
+}
+
+extern "C" void trace_rb_drops(uint64_t ts, int rb, const char *name, unsigned long long value)
+{
+	auto track = rb_counter(rb, name, SA_COUNTER_RB_DROPS);
+
+	TRACE_COUNTER("ringbuffer", track->track, ts, value);
+}
+
 #if 0
 extern "C" int main(int argc, char **argv)
 {
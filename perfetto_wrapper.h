@@ -1,11 +1,12 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 /* Copyright (C) 2023 Qais Yousef */
-struct lb_sd_stats;
+struct placement_event;
 
 void init_perfetto(void);
 void flush_perfetto(void);
 void start_perfetto_trace(void);
 void stop_perfetto_trace(void);
+void release_task_counters(int pid);
 void trace_cpu_load_avg(uint64_t ts, int cpu, int value);
 void trace_cpu_runnable_avg(uint64_t ts, int cpu, int value);
 void trace_cpu_util_avg(uint64_t ts, int cpu, int value);
@@ -21,15 +22,31 @@ void trace_task_util_avg(uint64_t ts, const char *name, int pid, int value);
 void trace_task_uclamped_avg(uint64_t ts, const char *name, int pid, int value);
 void trace_task_util_est_enqueued(uint64_t ts, const char *name, int pid, int value);
 void trace_task_util_est_ewma(uint64_t ts, const char *name, int pid, int value);
+void trace_cpu_pelt_hist(uint64_t start, uint64_t end, int cpu,
+			 int signal, const unsigned long long *buckets);
+void trace_task_pelt_hist(uint64_t start, uint64_t end, const char *name,
+			  int pid, int signal, const unsigned long long *buckets);
 void trace_cpu_nr_running(uint64_t ts, int cpu, int value);
 void trace_cpu_idle(uint64_t ts, int cpu, int state);
 void trace_cpu_idle_miss(uint64_t ts, int cpu, int state, int miss);
-void trace_lb_entry(uint64_t ts, int this_cpu, int lb_cpu, char *phase);
+void trace_lb_entry(uint64_t ts, int this_cpu, int lb_cpu, const char *phase);
 void trace_lb_exit(uint64_t ts, int this_cpu, int lb_cpu);
-void trace_lb_sd_stats(uint64_t ts, struct lb_sd_stats *sd_stats);
+void trace_lb_phase(uint64_t ts, int this_cpu, int lb_cpu, const char *phase,
+		    int sd_level, const char *outcome, uint64_t duration);
+void trace_lb_sd_interval(uint64_t ts, int cpu, int level, unsigned int interval);
 void trace_lb_overloaded(uint64_t ts, unsigned int value);
 void trace_lb_overutilized(uint64_t ts, unsigned int value);
 void trace_lb_misfit(uint64_t ts, int cpu, unsigned long misfit_task_load);
 void trace_ipi_send_cpu(uint64_t ts, int from_cpu, int target_cpu,
 			char *callsite, void *callsitep,
 			char *callback, void *callbackp);
+void trace_softirq(uint64_t ts, int cpu, const char *name, uint64_t duration);
+void trace_irq(uint64_t ts, int cpu, int irq, const char *name, uint64_t duration);
+void trace_wakeup_latency(uint64_t ts, int cpu, const char *name, int pid, uint64_t delay);
+void trace_placement(uint64_t ts, const char *name, struct placement_event *e);
+void trace_sugov_requested_freq(uint64_t ts, int cpu, unsigned long util,
+				unsigned int freq);
+void trace_sugov_rate_limited(uint64_t ts, int cpu, int update_cpu);
+void trace_cpu_actual_freq(uint64_t ts, int cpu, unsigned int freq);
+void trace_rb_fill(uint64_t ts, int rb, const char *name, int value);
+void trace_rb_drops(uint64_t ts, int rb, const char *name, unsigned long long value);
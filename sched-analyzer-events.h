@@ -19,36 +19,132 @@ enum pelt_type {
 	PELT_TYPE_DL,
 	PELT_TYPE_IRQ,
 	PELT_TYPE_THERMAL,
+	/* Not a PELT signal, a task_meta_event on task_pelt_rb */
+	PELT_TYPE_TASK_META,
 };
 
-struct rq_pelt_event {
+#define PELT_NR_RQ_TYPES	(PELT_TYPE_THERMAL + 1)
+
+/*
+ * PELT events are variable length. Most producers only know about one or two
+ * signals, so instead of shipping every signal with -1 for the missing ones,
+ * @fields tells which signals are present and they follow the fixed part of
+ * the event packed in enum pelt_field order.
+ *
+ * All PELT signals fit in 32 bits, producers saturate anything bigger.
+ */
+enum pelt_field {
+	PELT_LOAD_AVG,
+	PELT_RUNNABLE_AVG,
+	PELT_UTIL_AVG,
+	PELT_UTIL_EST_ENQUEUED,
+	PELT_UTIL_EST_EWMA,
+	PELT_UCLAMP_MIN,
+	PELT_UCLAMP_MAX,
+	PELT_NR_FIELDS,
+};
+
+#define PELT_F(field)		(1 << PELT_##field)
+
+/* Stored in the upper bits of pelt_event->type */
+#define PELT_TYPE_MASK		0x0f
+#define PELT_FLAG_RUNNING	0x10
+#define PELT_FLAG_EXITED	0x20
+
+struct pelt_event {
 	unsigned long long ts;
-	int cpu;
-	enum pelt_type type;
-	unsigned long load_avg;
-	unsigned long runnable_avg;
-	unsigned long util_avg;
-	unsigned long util_est_enqueued;
-	unsigned long util_est_ewma;
-	unsigned long uclamp_min;
-	unsigned long uclamp_max;
+	pid_t pid;
+	unsigned short cpu;
+	unsigned char type;
+	unsigned char fields;
+};
+
+struct rq_pelt_event {
+	struct pelt_event hdr;
+	unsigned int values[];
 };
 
 struct task_pelt_event {
-	unsigned long long ts;
+	struct pelt_event hdr;
+	unsigned int values[];
+};
+
+/*
+ * Task events don't carry the comm. It is announced once on task_pelt_rb the
+ * first time a task is seen and again whenever it is renamed.
+ */
+struct task_meta_event {
+	struct pelt_event hdr;
+	char comm[TASK_COMM_LEN];
+};
+
+#define RQ_PELT_EVENT_SIZE(nr)		(sizeof(struct rq_pelt_event) + (nr) * sizeof(unsigned int))
+#define TASK_PELT_EVENT_SIZE(nr)	(sizeof(struct task_pelt_event) + (nr) * sizeof(unsigned int))
+
+/*
+ * --histogram counts PELT samples in linear buckets instead of emitting them.
+ * Signals are in capacity units, anything at or above 1024 lands in the last
+ * bucket.
+ */
+enum pelt_hist_signal {
+	PELT_HIST_RUNNABLE_AVG,
+	PELT_HIST_UTIL_AVG,
+	PELT_HIST_UTIL_EST,
+	PELT_HIST_NR_SIGNALS,
+};
+
+#define PELT_HIST_BUCKET_WIDTH	64
+#define PELT_HIST_NR_BUCKETS	(1024 / PELT_HIST_BUCKET_WIDTH + 1)
+
+struct pelt_hist {
+	unsigned long long buckets[PELT_HIST_NR_BUCKETS];
+};
+
+struct task_pelt_hist_key {
+	pid_t pid;
+	unsigned short slot;
+	unsigned short signal;
+};
+
+/*
+ * --residency accumulates the time each CPU spent in each idle state, util_avg
+ * bucket and frequency. The current state and when it was entered are kept
+ * along, userspace adds the time spent in it since when reading.
+ */
+#define SA_MAX_IDLE_STATES	10
+
+struct cpu_residency {
+	unsigned long long idle_ts;
+	unsigned long long util_ts;
+	unsigned long long freq_ts;
+	unsigned int idle_idx;
+	unsigned int util_bucket;
+	unsigned int freq;
+	/* Indexed by idle state + 1, 0 is time spent out of idle */
+	unsigned long long idle[SA_MAX_IDLE_STATES + 1];
+	unsigned long long util[PELT_HIST_NR_BUCKETS];
+};
+
+/* Frequencies aren't known in advance, freq_residency is a hash */
+struct freq_residency_key {
 	int cpu;
+	unsigned int freq;
+};
+
+/*
+ * --cpu_freq, time each task ran at each frequency. Accounted when a task
+ * switches out and when the frequency of the CPU it runs on changes.
+ */
+struct task_freq_residency_key {
 	pid_t pid;
-	char comm[TASK_COMM_LEN];
-	unsigned long load_avg;
-	unsigned long runnable_avg;
-	unsigned long util_avg;
-	unsigned long util_est_enqueued;
-	unsigned long util_est_ewma;
-	unsigned long uclamp_min;
-	unsigned long uclamp_max;
-	int running;
+	unsigned int freq;
 };
 
+struct cpu_freq_task {
+	unsigned long long ts;
+	pid_t pid;
+	unsigned int freq;
+};
 
 struct rq_nr_running_event {
 	unsigned long long ts;
@@ -61,7 +157,6 @@ struct sched_switch_event {
 	unsigned long long ts;
 	int cpu;
 	pid_t pid;
-	char comm[TASK_COMM_LEN];
 	int running;
 };
 
@@ -80,6 +175,129 @@ struct softirq_event {
 	unsigned long duration;
 };
 
+/*
+ * --softirq and --irq statistics, kept per CPU. Bucket i of the duration
+ * histogram counts handlers that took [2^i, 2^(i+1)) usec, the first one
+ * anything below 2 usec and the last anything longer.
+ */
+#define SA_NR_SOFTIRQS			10
+#define DURATION_HIST_NR_BUCKETS	20
+
+struct duration_stats {
+	unsigned long long count;
+	unsigned long long time;
+	unsigned long long buckets[DURATION_HIST_NR_BUCKETS];
+};
+
+/*
+ * --wakeup_latency, time a task spent runnable between being woken up or
+ * preempted and running. Above --wakeup_latency_threshold each delay is
+ * sent individually.
+ */
+struct wakeup_event {
+	unsigned long long ts;
+	unsigned long long delay;
+	int cpu;
+	pid_t pid;
+};
+
+#define IRQ_NAME_LEN	32
+
+struct irq_event {
+	unsigned long long ts;
+	unsigned long long duration;
+	int cpu;
+	int irq;
+	char name[IRQ_NAME_LEN];
+};
+
+/*
+ * --placement, wakeup CPU selection of fair tasks. The EAS decision is a step
+ * of the select_task_rq_fair() one, and is only taken when EAS is enabled.
+ */
+enum placement_decision {
+	PLACEMENT_SELECT_TASK_RQ,
+	PLACEMENT_EAS,
+	PLACEMENT_NR_DECISIONS,
+};
+
+struct placement_event {
+	unsigned long long ts;
+	pid_t pid;
+	int decision;
+	int prev_cpu;
+	int new_cpu;
+	unsigned int util_avg;
+	unsigned int uclamp_min;
+	unsigned int uclamp_max;
+	/* capacity and original capacity of prev_cpu then new_cpu */
+	unsigned int capacity[2];
+	unsigned int capacity_orig[2];
+};
+
+/* Per task prev_cpu -> new_cpu matrix */
+struct placement_key {
+	pid_t pid;
+	unsigned short prev_cpu;
+	unsigned short new_cpu;
+	int decision;
+};
+
+struct placement_stats {
+	unsigned long long count;
+	unsigned long long util_avg;
+};
+
+/*
+ * --sugov, frequency requests of schedutil. Events are sent for each new
+ * frequency requested, the first update of a row dropped by rate_limit_us and
+ * each actual frequency change.
+ */
+enum sugov_event_type {
+	SUGOV_REQUEST,
+	SUGOV_RATE_LIMITED,
+	SUGOV_FREQ,
+};
+
+struct sugov_event {
+	unsigned long long ts;
+	int type;
+	/* policy->cpu, or the CPU which changed frequency for SUGOV_FREQ */
+	int cpu;
+	/* CPU which triggered the update and its util */
+	int update_cpu;
+	unsigned long util;
+	unsigned int requested_freq;
+	unsigned int cur_freq;
+};
+
+/* Indexed by policy->cpu, updated by all the CPUs of the policy */
+struct sugov_stats {
+	unsigned long long requests;
+	unsigned long long rate_limited;
+	bool rate_limited_reported;
+};
+
+/*
+ * --idle_governor, confusion matrix of the state selected by the cpuidle
+ * governor vs the deepest state whose target residency fits the time the CPU
+ * actually stayed idle. Each cell sums the sleep length the governor predicted
+ * and the actual residency.
+ */
+struct idle_gov_cell {
+	unsigned long long count;
+	unsigned long long predicted_ns;
+	unsigned long long residency_ns;
+};
+
+struct idle_gov_stats {
+	/* [selected][ideal] */
+	struct idle_gov_cell matrix[SA_MAX_IDLE_STATES][SA_MAX_IDLE_STATES];
+	/* cpu_idle_miss of each entered state, too deep and too shallow */
+	unsigned long long miss_below[SA_MAX_IDLE_STATES];
+	unsigned long long miss_above[SA_MAX_IDLE_STATES];
+};
+
 enum lb_phases {
 	LB_NOHZ_IDLE_BALANCE,
 	LB_RUN_REBALANCE_DOMAINS,
@@ -88,28 +306,81 @@ enum lb_phases {
 	LB_PICK_NEXT_TASK_FAIR,
 	LB_NEWIDLE_BALANCE,
 	LB_LOAD_BALANCE,
+	LB_NR_PHASES,
 };
 
 #define MAX_SD_LEVELS		10
 
-struct lb_sd_stats {
-	int cpu;
-	int level[MAX_SD_LEVELS];
-	unsigned int balance_interval[MAX_SD_LEVELS];
+/*
+ * What load_balance() achieved. It failed when find_busiest_group() found an
+ * imbalance but no task could be moved.
+ */
+enum lb_outcome {
+	LB_BALANCED,
+	LB_PULLED,
+	LB_FAILED,
+	LB_NR_OUTCOMES,
 };
 
-struct lb_event {
+/*
+ * lb_rb carries phase events and sched domain balance_interval changes, told
+ * apart by @type.
+ */
+enum lb_record_type {
+	LB_RECORD_PHASE,
+	LB_RECORD_SD_INTERVAL,
+};
+
+struct lb_hdr {
 	unsigned long long ts;
-	int this_cpu;
-	int lb_cpu;
-	enum lb_phases phase;
-	bool entry;
-	unsigned int overloaded;
-	unsigned int overutilized;
+	/* CPU running the phase, or whose domain changed interval */
+	unsigned short cpu;
+	unsigned char type;
+};
+
+/*
+ * With --load_balance_stats, phases longer than --load_balance_threshold are
+ * sent whole on exit, starting at @ts and lasting @duration. @sd_level and
+ * @outcome are only known for load_balance(), -1 otherwise. So are the root
+ * domain flags and misfit_task_load if not read.
+ */
+struct lb_event {
+	struct lb_hdr hdr;
+	unsigned long long duration;
 	unsigned long misfit_task_load;
-	struct lb_sd_stats sd_stats;
+	unsigned short lb_cpu;
+	unsigned char phase;
+	bool entry;
+	signed char sd_level;
+	signed char outcome;
+	signed char overloaded;
+	signed char overutilized;
+};
+
+/*
+ * Only sent when the balance_interval of a domain, scaled by busy_factor when
+ * the CPU is busy, changed since it was last seen.
+ */
+struct lb_sd_event {
+	struct lb_hdr hdr;
+	int level;
+	unsigned int balance_interval;
 };
 
+/*
+ * --load_balance_stats, kept per CPU running the phase. Indexed by
+ * LB_STATS_KEY(), phases other than load_balance() don't balance a particular
+ * domain and are accounted at level 0.
+ */
+struct lb_stats {
+	struct duration_stats duration;
+	unsigned long long outcome[LB_NR_OUTCOMES];
+	unsigned long long nr_moved;
+};
+
+#define LB_STATS_KEY(phase, level)	((phase) * MAX_SD_LEVELS + (level))
+#define LB_STATS_NR_KEYS		(LB_NR_PHASES * MAX_SD_LEVELS)
+
 struct ipi_event {
 	unsigned long long ts;
 	int from_cpu;
@@ -118,6 +389,95 @@ struct ipi_event {
 	void *callback;
 };
 
+/*
+ * --ipi_matrix, number of IPIs sent for each key. Addresses are symbolized by
+ * userspace when writing the tables only.
+ */
+#define IPI_MATRIX_MAX_ENTRIES	16384
+
+struct ipi_key {
+	int from_cpu;
+	int target_cpu;
+	unsigned long long callsite;
+	unsigned long long callback;
+};
+
+/*
+ * Ring buffers and the programs writing into them. Used to account for events
+ * lost because a ring buffer was full.
+ */
+enum sa_rb_id {
+	SA_RB_RQ_PELT,
+	SA_RB_TASK_PELT,
+	SA_RB_RQ_NR_RUNNING,
+	SA_RB_SCHED_SWITCH,
+	SA_RB_FREQ_IDLE,
+	SA_RB_SOFTIRQ,
+	SA_RB_LB,
+	SA_RB_IPI,
+	SA_RB_IRQ,
+	SA_RB_WAKEUP,
+	SA_RB_PLACEMENT,
+	SA_RB_SUGOV,
+	SA_RB_MAX,
+};
+
+enum sa_prog_id {
+	SA_PROG_PELT_SE,
+	SA_PROG_UTIL_EST_SE,
+	SA_PROG_PELT_CFS,
+	SA_PROG_UTIL_EST_CFS,
+	SA_PROG_PELT_RT,
+	SA_PROG_PELT_DL,
+	SA_PROG_PELT_IRQ,
+	SA_PROG_PELT_THERMAL,
+	SA_PROG_SCHED_UPDATE_NR_RUNNING,
+	SA_PROG_SCHED_SWITCH,
+	SA_PROG_SCHED_PROCESS_FREE,
+	SA_PROG_CPU_IDLE,
+	SA_PROG_CPU_IDLE_MISS,
+	SA_PROG_SOFTIRQ_EXIT,
+	SA_PROG_NOHZ_IDLE_BALANCE_ENTRY,
+	SA_PROG_NOHZ_IDLE_BALANCE_EXIT,
+	SA_PROG_RUN_REBALANCE_DOMAINS_ENTRY,
+	SA_PROG_RUN_REBALANCE_DOMAINS_EXIT,
+	SA_PROG_REBALANCE_DOMAINS_ENTRY,
+	SA_PROG_REBALANCE_DOMAINS_EXIT,
+	SA_PROG_BALANCE_FAIR_ENTRY,
+	SA_PROG_BALANCE_FAIR_EXIT,
+	SA_PROG_PICK_NEXT_TASK_FAIR_ENTRY,
+	SA_PROG_PICK_NEXT_TASK_FAIR_EXIT,
+	SA_PROG_NEWIDLE_BALANCE_ENTRY,
+	SA_PROG_NEWIDLE_BALANCE_EXIT,
+	SA_PROG_LOAD_BALANCE_ENTRY,
+	SA_PROG_LOAD_BALANCE_EXIT,
+	SA_PROG_IPI_SEND_CPU,
+	SA_PROG_SCHED_SWITCH_META,
+	SA_PROG_TASK_RENAME,
+	SA_PROG_IRQ_HANDLER_EXIT,
+	SA_PROG_WAKEUP_LATENCY,
+	SA_PROG_SELECT_TASK_RQ_FAIR,
+	SA_PROG_FIND_ENERGY_EFFICIENT_CPU,
+	SA_PROG_SUGOV_UPDATE_SINGLE_FREQ,
+	SA_PROG_SUGOV_UPDATE_SHARED,
+	SA_PROG_SUGOV_CPU_FREQUENCY,
+	SA_PROG_MAX,
+};
+
+/*
+ * Settings userspace can change while BPF programs are running.
+ */
+struct sa_runtime {
+	/* Stop emitting events, set while shutting down */
+	bool paused;
+	/* --histogram slot BPF is counting into, userspace reads the other */
+	unsigned int hist_slot;
+};
+
+struct rb_fill {
+	unsigned long long avail_data;
+	unsigned long long ring_size;
+};
 
 #ifdef __VMLINUX_H__
 char hi_softirq[TASK_COMM_LEN] = "hi";
@@ -14,8 +14,13 @@ extern int LINUX_KERNEL_VERSION __kconfig;
 
 /*
  * Global variables shared with userspace counterpart.
+ *
+ * sa_opts is set before load and read-only after, so the verifier knows its
+ * value and drops code paths for disabled options. Settings that need to
+ * change while running live in sa_runtime.
  */
-struct sa_opts sa_opts;
+const volatile struct sa_opts sa_opts;
+struct sa_runtime sa_runtime;
 
 char LICENSE[] SEC("license") = "GPL";
 
@@ -30,6 +35,7 @@ char LICENSE[] SEC("license") = "GPL";
  */
 struct task_struct__old {
 	int cpu;
+	long state;
 } __attribute__((preserve_access_index));
 
 struct util_est {
@@ -51,27 +57,333 @@ struct sched_avg__pre68 {
 
 
 #define RB_SIZE		(256 * 1024)
+#define SCHED_CAPACITY_SCALE	1024
+
+/*
+ * Softirqs run and are accounted on the local CPU, they don't nest.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, u64);
+} softirq_entry SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, SA_NR_SOFTIRQS);
+	__type(key, int);
+	__type(value, struct duration_stats);
+} softirq_stats SEC(".maps");
+
+/*
+ * Same for hard irqs, handlers don't nest either. irq numbers are sparse.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, u64);
+} irq_entry SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 4096);
+	__type(key, int);
+	__type(value, struct duration_stats);
+} irq_stats SEC(".maps");
+
+/*
+ * Entry state of each load balance phase. Phases nest into each other but
+ * never into themselves, and run with preemption disabled, so a per-CPU slot
+ * for each phase is enough.
+ */
+struct lb_phase_state {
+	u64 ts;
+	/* load_balance() only, find_busiest_group() env and what it found */
+	u64 env;
+	long imbalance;
+	int lb_cpu;
+	int sd_level;
+	bool active;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, LB_NR_PHASES);
+	__type(key, int);
+	__type(value, struct lb_phase_state);
+} lb_state SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, LB_STATS_NR_KEYS);
+	__type(key, int);
+	__type(value, struct lb_stats);
+} lb_stats SEC(".maps");
+
+/*
+ * Last balance_interval sent for each domain, indexed by
+ * rq cpu * MAX_SD_LEVELS + domain depth. nohz idle balance runs
+ * rebalance_domains() of idle CPUs remotely so this can't be a per-CPU array.
+ * Userspace sizes it with --load_balance.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, u32);
+} lb_sd_interval SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 8192);
-	__type(key, pid_t);
-	__type(value, int);
-} sched_switch SEC(".maps");
+	__uint(max_entries, IPI_MATRIX_MAX_ENTRIES);
+	__type(key, struct ipi_key);
+	__type(value, u64);
+} ipi_matrix SEC(".maps");
+
+/*
+ * Last PELT signals emitted, for --pelt_deadband and --pelt_min_interval.
+ */
+struct pelt_last {
+	u64 ts[PELT_NR_FIELDS];
+	u32 values[PELT_NR_FIELDS];
+};
+
+/*
+ * Indexed by rq cpu * PELT_NR_RQ_TYPES + pelt_type. rq signals are often
+ * updated remotely so this can't be a per-CPU array. Userspace sizes it when
+ * filtering is enabled.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct pelt_last);
+} rq_pelt_last SEC(".maps");
+
+/*
+ * Per task state, lives and dies with the task so there's no limit on the
+ * number of tasks we can track. Kept up to date by handle_sched_switch().
+ */
+struct task_state {
+	bool comm_announced;
+	bool running;
+	/* When the task became runnable, for --wakeup_latency */
+	u64 runnable_ts;
+	struct pelt_last pelt;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, int);
+	__type(value, struct task_state);
+} task_state SEC(".maps");
+
+/*
+ * --histogram buckets, counted into slot sa_runtime.hist_slot while userspace
+ * reads and resets the other one, an interval after switching away from it.
+ *
+ * rq_pelt_hist is indexed by (cpu * 2 + slot) * PELT_HIST_NR_SIGNALS + signal.
+ * Like rq_pelt_last it can't be a per-CPU array. Userspace sizes it when
+ * --histogram is enabled.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct pelt_hist);
+} rq_pelt_hist SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 65536);
+	__type(key, struct task_pelt_hist_key);
+	__type(value, struct pelt_hist);
+} task_pelt_hist SEC(".maps");
+
+struct pelt_hist pelt_hist_zero;
+
+/*
+ * --residency, cpu_residency is indexed by cpu and sized by userspace. Updates
+ * come from remote CPUs too but are serialized by the rq lock, idle being
+ * local and frequency changes being serialized per policy.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct cpu_residency);
+} cpu_residency SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__uint(max_entries, 8192);
+	__type(key, struct freq_residency_key);
+	__type(value, u64);
+} freq_residency SEC(".maps");
+
+/*
+ * Task running on each CPU and the frequency it runs at, indexed by cpu and
+ * sized by userspace. Frequency changes can come from a remote CPU.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
 	__type(key, int);
+	__type(value, struct cpu_freq_task);
+} cpu_freq_task SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 65536);
+	__type(key, struct task_freq_residency_key);
 	__type(value, u64);
-} softirq_entry SEC(".maps");
+} task_freq_residency SEC(".maps");
+
+/*
+ * --wakeup_latency histograms, accounted by sched_switch on the CPU the task
+ * switches in. A task only runs on one CPU at a time but a cgroup doesn't.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct duration_stats);
+} cpu_wakeup_latency SEC(".maps");
 
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 8192);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 65536);
+	__type(key, pid_t);
+	__type(value, struct duration_stats);
+} task_wakeup_latency SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, 4096);
+	__type(key, u64);
+	__type(value, struct duration_stats);
+} cgroup_wakeup_latency SEC(".maps");
+
+/*
+ * --placement prev_cpu -> new_cpu matrix of each task, dropped by userspace
+ * once the task exited. The kprobe fallback
+ * stashes the arguments on entry, wakeups run with irqs disabled so a per-CPU
+ * slot for each decision is enough.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(max_entries, 65536);
+	__type(key, struct placement_key);
+	__type(value, struct placement_stats);
+} placement_matrix SEC(".maps");
+
+struct placement_args {
+	struct task_struct *p;
+	int prev_cpu;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, PLACEMENT_NR_DECISIONS);
+	__type(key, int);
+	__type(value, struct placement_args);
+} placement_args SEC(".maps");
+
+/*
+ * --sugov counters indexed by policy->cpu and sized by userspace. The kprobe
+ * fallback stashes the arguments on entry, sugov hooks run with irqs disabled.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct sugov_stats);
+} sugov_stats SEC(".maps");
+
+struct sugov_args {
+	struct update_util_data *hook;
+	u64 time;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct sugov_args);
+} sugov_args SEC(".maps");
+
+/*
+ * --idle_governor, the governor runs on the CPU going idle so everything is
+ * per-CPU. The last decision is kept until the CPU leaves the idle state it
+ * selected, when the residency it led to is known.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct idle_gov_stats);
+} idle_gov_stats SEC(".maps");
+
+struct idle_gov_last {
+	bool valid;
+	/* The CPU entered the selected state at @idle_ts */
+	bool entered;
+	int selected;
+	s64 predicted_ns;
+	u64 idle_ts;
+	struct cpuidle_driver *drv;
+	struct cpuidle_device *dev;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, int);
+	__type(value, struct idle_gov_last);
+} idle_gov_last SEC(".maps");
+
+/*
+ * Filters populated by userspace from --pid, --tgid and --comm.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_FILTERS_NUM);
+	__type(key, pid_t);
+	__type(value, bool);
+} filter_pid SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, MAX_FILTERS_NUM);
+	__type(key, pid_t);
+	__type(value, bool);
+} filter_tgid SEC(".maps");
+
+/*
+ * Matching comm is expensive, cache the result per pid. Entries are dropped
+ * when the task is freed or renamed.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 16384);
+	__type(key, pid_t);
+	__type(value, bool);
+} filter_comm_cache SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
 	__type(key, int);
-	__type(value, int);
-} lb_map SEC(".maps");
+	__type(value, u64);
+} filtered_events SEC(".maps");
 
 /*
  * We define multiple ring buffers, one per event.
@@ -116,25 +428,116 @@ struct {
        __uint(max_entries, RB_SIZE);
 } ipi_rb SEC(".maps");
 
-static inline bool entity_is_task(struct sched_entity *se)
+struct {
+       __uint(type, BPF_MAP_TYPE_RINGBUF);
+       __uint(max_entries, RB_SIZE);
+} irq_rb SEC(".maps");
+
+struct {
+       __uint(type, BPF_MAP_TYPE_RINGBUF);
+       __uint(max_entries, RB_SIZE);
+} wakeup_rb SEC(".maps");
+
+struct {
+       __uint(type, BPF_MAP_TYPE_RINGBUF);
+       __uint(max_entries, RB_SIZE);
+} placement_rb SEC(".maps");
+
+struct {
+       __uint(type, BPF_MAP_TYPE_RINGBUF);
+       __uint(max_entries, RB_SIZE);
+} sugov_rb SEC(".maps");
+
+/*
+ * Events lost because bpf_ringbuf_reserve() failed, per program. Each program
+ * writes into a single ring buffer, userspace knows which.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, SA_PROG_MAX);
+	__type(key, int);
+	__type(value, u64);
+} rb_drops SEC(".maps");
+
+/*
+ * Fill level of each ring buffer, sampled periodically by userspace running
+ * sample_rb_fill().
+ */
+struct rb_fill rb_fill[SA_RB_MAX];
+
+static __always_inline void *sa_ringbuf_reserve(void *rb, u64 size, int prog)
+{
+	void *e;
+
+	if (sa_runtime.paused)
+		return 0;
+
+	e = bpf_ringbuf_reserve(rb, size, 0);
+
+	if (!e) {
+		u64 *drops = bpf_map_lookup_elem(&rb_drops, &prog);
+		if (drops)
+			(*drops)++;
+	}
+
+	return e;
+}
+
+static __always_inline void pelt_event_init(struct pelt_event *hdr, u64 ts,
+					    int cpu, pid_t pid, u8 type, u8 fields)
+{
+	hdr->ts = ts;
+	hdr->pid = pid;
+	hdr->cpu = cpu;
+	hdr->type = type;
+	hdr->fields = fields;
+}
+
+static __always_inline unsigned int pelt_u32(unsigned long val)
+{
+	return val > (u32)-1 ? (u32)-1 : val;
+}
+
+/*
+ * tp_btf programs get BTF typed pointers that can be dereferenced directly,
+ * raw_tp ones need a bpf_probe_read_kernel() for every access. Handlers are
+ * written once and told which kind of pointer they got with @direct. It is
+ * a constant for each program, so the other path is compiled out.
+ *
+ * Pointers derived with container_of() can't be dereferenced directly, the
+ * verifier rejects the negative offset.
+ */
+#define SA_READ(direct, src, a)						\
+	((direct) ? (src)->a : BPF_CORE_READ(src, a))
+
+static __always_inline bool entity_is_task(struct sched_entity *se, bool direct)
 {
 	if (bpf_core_field_exists(se->my_q))
-		return !BPF_CORE_READ(se, my_q);
+		return !SA_READ(direct, se, my_q);
 	else
 		return true;
 }
 
-static inline struct rq *rq_of(struct cfs_rq *cfs_rq)
+/*
+ * rq_of() returns a pointer that can be dereferenced directly only if
+ * cfs_rq->rq exists, see rq_direct().
+ */
+static __always_inline struct rq *rq_of(struct cfs_rq *cfs_rq, bool direct)
 {
 	if (bpf_core_field_exists(cfs_rq->rq))
-		return BPF_CORE_READ(cfs_rq, rq);
+		return SA_READ(direct, cfs_rq, rq);
 	else
 		return container_of(cfs_rq, struct rq, cfs);
 }
 
-static inline bool cfs_rq_is_root(struct cfs_rq *cfs_rq)
+static __always_inline bool rq_direct(struct cfs_rq *cfs_rq, bool direct)
 {
-	struct rq *rq = rq_of(cfs_rq);
+	return direct && bpf_core_field_exists(cfs_rq->rq);
+}
+
+static __always_inline bool cfs_rq_is_root(struct cfs_rq *cfs_rq, bool direct)
+{
+	struct rq *rq = rq_of(cfs_rq, direct);
 
 	if (rq)
 		return &rq->cfs == cfs_rq;
@@ -142,972 +545,2453 @@ static inline bool cfs_rq_is_root(struct cfs_rq *cfs_rq)
 		return false;
 }
 
-SEC("raw_tp/pelt_se_tp")
-int BPF_PROG(handle_pelt_se, struct sched_entity *se)
-{
-	if (entity_is_task(se)) {
-		struct task_struct *p = container_of(se, struct task_struct, se);
-		unsigned long uclamp_min, uclamp_max;
-		struct task_pelt_event *e;
-		char comm[TASK_COMM_LEN];
-		int *running, cpu;
-		pid_t pid;
+struct comm_match_ctx {
+	char comm[TASK_COMM_LEN];
+	bool match;
+};
 
-		if (bpf_core_field_exists(p->wake_cpu)) {
-			cpu = BPF_CORE_READ(p, wake_cpu);
-		} else {
-			struct task_struct__old *p_old = (void *)p;
-			cpu = BPF_CORE_READ(p_old, cpu);
+/*
+ * Same as strstr(comm, sa_opts.comm[idx]) which is what --comm promises.
+ */
+static long comm_match(u32 idx, struct comm_match_ctx *ctx)
+{
+	unsigned int i, j;
+	const volatile char *filter;
+
+	if (idx >= MAX_FILTERS_NUM)
+		return 1;
+
+	filter = sa_opts.comm[idx];
+
+	for (i = 0; i < TASK_COMM_LEN; i++) {
+		for (j = 0; i + j < TASK_COMM_LEN; j++) {
+			if (!filter[j]) {
+				ctx->match = true;
+				return 1;
+			}
+			if (ctx->comm[i + j] != filter[j])
+				break;
 		}
-		pid = BPF_CORE_READ(p, pid);
-		BPF_CORE_READ_STR_INTO(&comm, p, comm);
-
-		running = bpf_map_lookup_elem(&sched_switch, &pid);
+		if (!ctx->comm[i])
+			break;
+	}
 
-		uclamp_min = -1;
-		uclamp_max = -1;
+	return 0;
+}
 
-		if (bpf_core_field_exists(p->uclamp_req[UCLAMP_MIN].value))
-			uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp_req[UCLAMP_MIN].value);
-		if (bpf_core_field_exists(p->uclamp_req[UCLAMP_MAX].value))
-			uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp_req[UCLAMP_MAX].value);
+/*
+ * Return true if the task doesn't match any of --pid, --tgid or --comm. @comm
+ * is matched instead of p->comm if set.
+ */
+static inline bool __task_filtered(struct task_struct *p, pid_t pid, const char *comm)
+{
+	struct comm_match_ctx ctx = { 0 };
+	bool *cached;
+	pid_t tgid;
 
-		bpf_printk("[%s] Req: uclamp_min = %lu uclamp_max = %lu",
-			   comm, uclamp_min, uclamp_max);
+	if (!sa_opts.num_pids && !sa_opts.num_tgids && !sa_opts.num_comms)
+		return false;
 
-		if (bpf_core_field_exists(p->uclamp[UCLAMP_MIN].value)) {
-			bool active = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].active);
-			if (active)
-				uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].value);
-		}
-		if (bpf_core_field_exists(p->uclamp[UCLAMP_MAX].value)) {
-			bool active = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].active);
-			if (active)
-				uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].value);
-		}
+	if (sa_opts.num_pids && bpf_map_lookup_elem(&filter_pid, &pid))
+		return false;
 
-		bpf_printk("[%s] Eff: uclamp_min = %lu uclamp_max = %lu",
-			   comm, uclamp_min, uclamp_max);
+	if (sa_opts.num_tgids) {
+		tgid = BPF_CORE_READ(p, tgid);
+		if (bpf_map_lookup_elem(&filter_tgid, &tgid))
+			return false;
+	}
 
-		e = bpf_ringbuf_reserve(&task_pelt_rb, sizeof(*e), 0);
-		if (e) {
-			e->ts = bpf_ktime_get_boot_ns();
-			e->cpu = cpu;
-			e->pid = pid;
-			BPF_CORE_READ_STR_INTO(&e->comm, p, comm);
-			e->load_avg = BPF_CORE_READ(se, avg.load_avg);
-			e->runnable_avg = BPF_CORE_READ(se, avg.runnable_avg);
-			e->util_avg = BPF_CORE_READ(se, avg.util_avg);
-			e->util_est_enqueued = -1;
-			e->util_est_ewma = -1;
-			e->uclamp_min = uclamp_min;
-			e->uclamp_max = uclamp_max;
-			if (running)
-				e->running = 1;
+	if (sa_opts.num_comms) {
+		cached = bpf_map_lookup_elem(&filter_comm_cache, &pid);
+		if (cached) {
+			ctx.match = *cached;
+		} else {
+			if (comm)
+				bpf_probe_read_kernel_str(&ctx.comm, sizeof(ctx.comm), comm);
 			else
-				e->running = 0;
-			bpf_ringbuf_submit(e, 0);
+				BPF_CORE_READ_STR_INTO(&ctx.comm, p, comm);
+			bpf_loop(sa_opts.num_comms, comm_match, &ctx, 0);
+			bpf_map_update_elem(&filter_comm_cache, &pid, &ctx.match, BPF_ANY);
 		}
+		if (ctx.match)
+			return false;
 	}
 
-	return 0;
+	return true;
 }
 
-SEC("raw_tp/sched_util_est_se_tp")
-int BPF_PROG(handle_util_est_se, struct sched_entity *se)
+static inline bool task_filtered(struct task_struct *p, pid_t pid)
 {
-	if (entity_is_task(se)) {
-		struct task_struct *p = container_of(se, struct task_struct, se);
-		unsigned long util_est_enqueued, util_est_ewma;
-		struct task_pelt_event *e;
-		char comm[TASK_COMM_LEN];
-		int *running, cpu;
-		pid_t pid;
+	return __task_filtered(p, pid, 0);
+}
 
-		if (bpf_core_field_exists(p->wake_cpu)) {
-			cpu = BPF_CORE_READ(p, wake_cpu);
-		} else {
-			struct task_struct__old *p_old = (void *)p;
-			cpu = BPF_CORE_READ(p_old, cpu);
-		}
-		pid = BPF_CORE_READ(p, pid);
-		BPF_CORE_READ_STR_INTO(&comm, p, comm);
+/*
+ * Same as task_filtered() but account for the dropped event.
+ */
+static inline bool ignore_task(struct task_struct *p, pid_t pid)
+{
+	int zero = 0;
+	u64 *count;
 
-		running = bpf_map_lookup_elem(&sched_switch, &pid);
+	if (!task_filtered(p, pid))
+		return false;
 
-		if (LINUX_KERNEL_VERSION < KERNEL_VERSION(6, 8, 0)) {
-			struct sched_avg__pre68 *avg_old = (void *)&se->avg;
-			util_est_enqueued = BPF_PROBE_READ(avg_old, util_est.enqueued);
-			util_est_ewma = BPF_PROBE_READ(avg_old, util_est.ewma);
-		} else {
-			util_est_enqueued = BPF_CORE_READ(se, avg.util_est);
-			util_est_ewma = 0;
-		}
+	count = bpf_map_lookup_elem(&filtered_events, &zero);
+	if (count)
+		(*count)++;
 
-		e = bpf_ringbuf_reserve(&task_pelt_rb, sizeof(*e), 0);
-		if (e) {
-			e->ts = bpf_ktime_get_boot_ns();
-			e->cpu = cpu;
-			e->pid = pid;
-			BPF_CORE_READ_STR_INTO(&e->comm, p, comm);
-			e->load_avg = -1;
-			e->runnable_avg = -1;
-			e->util_avg = -1;
-			e->util_est_enqueued = util_est_enqueued & ~UTIL_AVG_UNCHANGED;
-			e->util_est_ewma = util_est_ewma;
-			e->uclamp_min = -1;
-			e->uclamp_max = -1;
-			if (running)
-				e->running = 1;
-			else
-				e->running = 0;
-			bpf_ringbuf_submit(e, 0);
-		}
-	}
+	return true;
+}
 
-	return 0;
+static inline bool task_events_enabled(void)
+{
+	return sa_opts.load_avg_task || sa_opts.runnable_avg_task ||
+	       sa_opts.util_avg_task || sa_opts.util_est_task ||
+	       sa_opts.wakeup_latency || sa_opts.placement;
 }
 
-SEC("raw_tp/pelt_cfs_tp")
-int BPF_PROG(handle_pelt_cfs, struct cfs_rq *cfs_rq)
+static __always_inline void emit_task_meta(pid_t pid, const char *comm, int prog)
 {
-	if (cfs_rq_is_root(cfs_rq)) {
-		struct rq *rq = rq_of(cfs_rq);
-		int cpu = BPF_CORE_READ(rq, cpu);
-		struct rq_pelt_event *e;
+	struct task_meta_event *e;
+	int cpu = bpf_get_smp_processor_id();
 
-		unsigned long uclamp_min = -1;
-		unsigned long uclamp_max = -1;
+	e = sa_ringbuf_reserve(&task_pelt_rb, sizeof(*e), prog);
+	if (e) {
+		pelt_event_init(&e->hdr, bpf_ktime_get_boot_ns(), cpu, pid,
+				PELT_TYPE_TASK_META, 0);
+		bpf_probe_read_kernel_str(&e->comm, sizeof(e->comm), comm);
+		bpf_ringbuf_submit(e, 0);
+	}
+}
 
-		if (bpf_core_field_exists(rq->uclamp[UCLAMP_MIN].value))
-			uclamp_min = BPF_CORE_READ(rq, uclamp[UCLAMP_MIN].value);
-		if (bpf_core_field_exists(rq->uclamp[UCLAMP_MAX].value))
-			uclamp_max = BPF_CORE_READ(rq, uclamp[UCLAMP_MAX].value);
-
-		bpf_printk("cfs: [CPU%d] uclamp_min = %lu uclamp_max = %lu",
-			   cpu, uclamp_min, uclamp_max);
-
-		e = bpf_ringbuf_reserve(&rq_pelt_rb, sizeof(*e), 0);
-		if (e) {
-			e->ts = bpf_ktime_get_boot_ns();
-			e->cpu = cpu;
-			e->type = PELT_TYPE_CFS;
-			e->load_avg = BPF_CORE_READ(cfs_rq, avg.load_avg);
-			e->runnable_avg = BPF_CORE_READ(cfs_rq, avg.runnable_avg);
-			e->util_avg = BPF_CORE_READ(cfs_rq, avg.util_avg);
-			e->util_est_enqueued = -1;
-			e->util_est_ewma = -1;
-			e->uclamp_min = uclamp_min;
-			e->uclamp_max = uclamp_max;
-			bpf_ringbuf_submit(e, 0);
-		}
-	}
-
-	return 0;
+/*
+ * @p must be a trusted pointer, as passed to tp_btf programs or returned by
+ * bpf_get_current_task_btf().
+ */
+static __always_inline struct task_state *get_task_state(struct task_struct *p)
+{
+	return bpf_task_storage_get(&task_state, p, 0,
+				    BPF_LOCAL_STORAGE_GET_F_CREATE);
 }
 
-SEC("raw_tp/sched_util_est_cfs_tp")
-int BPF_PROG(handle_util_est_cfs, struct cfs_rq *cfs_rq)
+/*
+ * Tell userspace the comm of @p the first time we see it.
+ */
+static __always_inline void announce_task(struct task_struct *p,
+					  struct task_state *state, int prog)
 {
-	if (cfs_rq_is_root(cfs_rq)) {
-		unsigned long util_est_enqueued, util_est_ewma;
-		struct rq *rq = rq_of(cfs_rq);
-		int cpu = BPF_CORE_READ(rq, cpu);
-		struct rq_pelt_event *e;
+	pid_t pid = p->pid;
 
+	if (!pid || !state || state->comm_announced)
+		return;
 
-		if (LINUX_KERNEL_VERSION < KERNEL_VERSION(6, 8, 0)) {
-			struct sched_avg__pre68 *avg_old = (void *)&cfs_rq->avg;
-			util_est_enqueued = BPF_PROBE_READ(avg_old, util_est.enqueued);
-			util_est_ewma = BPF_PROBE_READ(avg_old, util_est.ewma);
-		} else {
-			util_est_enqueued = BPF_CORE_READ(cfs_rq, avg.util_est);
-			util_est_ewma = 0;
-		}
+	/* Filtered tasks are marked too so that we don't check them again */
+	state->comm_announced = true;
 
-		bpf_printk("cfs: [CPU%d] util_est.enqueued = %lu util_est.ewma = %lu",
-			   cpu, util_est_enqueued, util_est_ewma);
+	if (!task_filtered(p, pid))
+		emit_task_meta(pid, p->comm, prog);
+}
 
-		e = bpf_ringbuf_reserve(&rq_pelt_rb, sizeof(*e), 0);
-		if (e) {
-			e->ts = bpf_ktime_get_boot_ns();
-			e->cpu = cpu;
-			e->load_avg = -1;
-			e->runnable_avg = -1;
-			e->util_avg = -1;
-			e->util_est_enqueued = util_est_enqueued & ~UTIL_AVG_UNCHANGED;
-			e->util_est_ewma = util_est_ewma;
-			e->uclamp_min = -1;
-			e->uclamp_max = -1;
-			bpf_ringbuf_submit(e, 0);
-		}
-	}
+extern struct task_struct *bpf_task_from_pid(s32 pid) __ksym __weak;
+extern void bpf_task_release(struct task_struct *p) __ksym __weak;
 
-	return 0;
+static __always_inline bool pelt_filtering(void)
+{
+	return sa_opts.pelt_deadband || sa_opts.pelt_min_interval;
 }
 
-SEC("raw_tp/pelt_rt_tp")
-int BPF_PROG(handle_pelt_rt, struct rq *rq)
+/*
+ * Task storage needs a trusted task pointer which PELT tracepoints don't
+ * provide, @p comes from container_of(). Current has one, and tp_btf programs
+ * can get one for any other task by looking it up by pid.
+ *
+ * The lookup by pid takes a reference on the task, so it is only done when
+ * the per task last values are needed to filter the sample. Other tasks are
+ * announced when they next run, userspace reads /proc for them meanwhile.
+ */
+static __always_inline struct task_state *task_state_of(struct task_struct *p,
+							pid_t pid, bool direct,
+							int prog)
 {
-	int cpu = BPF_CORE_READ(rq, cpu);
-	struct rq_pelt_event *e;
+	struct task_struct *curr = bpf_get_current_task_btf();
+	struct task_state *state = 0;
+	struct task_struct *t;
+
+	if ((void *)p == (void *)curr) {
+		state = get_task_state(curr);
+		announce_task(curr, state, prog);
+		return state;
+	}
 
-	if (!bpf_core_field_exists(rq->avg_rt))
+	if (!direct || !pelt_filtering() || !bpf_ksym_exists(bpf_task_from_pid))
 		return 0;
 
-	unsigned long util_avg = BPF_CORE_READ(rq, avg_rt.util_avg);
-
-	e = bpf_ringbuf_reserve(&rq_pelt_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->type = PELT_TYPE_RT;
-		e->load_avg = -1;
-		e->runnable_avg = -1;
-		e->util_avg = util_avg;
-		e->util_est_enqueued = -1;
-		e->util_est_ewma = -1;
-		e->uclamp_min = -1;
-		e->uclamp_max = -1;
-		bpf_ringbuf_submit(e, 0);
+	t = bpf_task_from_pid(pid);
+	if (t) {
+		state = get_task_state(t);
+		announce_task(t, state, prog);
+		bpf_task_release(t);
 	}
 
-	return 0;
+	return state;
 }
 
-SEC("raw_tp/pelt_dl_tp")
-int BPF_PROG(handle_pelt_dl, struct rq *rq)
+static __always_inline bool task_running(struct task_struct *p,
+					 struct task_state *state)
 {
-	int cpu = BPF_CORE_READ(rq, cpu);
-	struct rq_pelt_event *e;
-
-	if (!bpf_core_field_exists(rq->avg_dl))
-		return 0;
-
-	unsigned long util_avg = BPF_CORE_READ(rq, avg_dl.util_avg);
+	if (state)
+		return state->running;
 
-	e = bpf_ringbuf_reserve(&rq_pelt_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->type = PELT_TYPE_DL;
-		e->load_avg = -1;
-		e->runnable_avg = -1;
-		e->util_avg = util_avg;
-		e->util_est_enqueued = -1;
-		e->util_est_ewma = -1;
-		e->uclamp_min = -1;
-		e->uclamp_max = -1;
-		bpf_ringbuf_submit(e, 0);
-	}
+	if (bpf_core_field_exists(p->on_cpu))
+		return BPF_CORE_READ(p, on_cpu);
 
-	return 0;
+	return false;
 }
 
-SEC("raw_tp/pelt_irq_tp")
-int BPF_PROG(handle_pelt_irq, struct rq *rq)
+static __always_inline struct pelt_last *rq_pelt_last_of(int cpu, int type)
 {
-	int cpu = BPF_CORE_READ(rq, cpu);
-	struct rq_pelt_event *e;
+	int key = cpu * PELT_NR_RQ_TYPES + type;
 
-	if (!bpf_core_field_exists(rq->avg_irq))
+	if (!pelt_filtering())
 		return 0;
 
-	unsigned long util_avg = BPF_CORE_READ(rq, avg_irq.util_avg);
+	return bpf_map_lookup_elem(&rq_pelt_last, &key);
+}
 
-	e = bpf_ringbuf_reserve(&rq_pelt_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->type = PELT_TYPE_IRQ;
-		e->load_avg = -1;
-		e->runnable_avg = -1;
-		e->util_avg = util_avg;
-		e->util_est_enqueued = -1;
-		e->util_est_ewma = -1;
-		e->uclamp_min = -1;
-		e->uclamp_max = -1;
-		bpf_ringbuf_submit(e, 0);
-	}
+static __always_inline struct pelt_last *task_pelt_last_of(struct task_state *state)
+{
+	if (!pelt_filtering() || !state)
+		return 0;
 
-	return 0;
+	return &state->pelt;
 }
 
-SEC("raw_tp/pelt_thermal_tp")
-int BPF_PROG(handle_pelt_thermal, struct rq *rq)
+/*
+ * Emit only if one of the signals moved by more than --pelt_deadband since it
+ * was last emitted, or if it wasn't emitted for --pelt_min_interval.
+ * @values are packed in enum pelt_field order.
+ */
+static __always_inline bool pelt_changed(struct pelt_last *last, u8 fields,
+					 const u32 *values, unsigned int nr,
+					 u64 now)
 {
-	int cpu = BPF_CORE_READ(rq, cpu);
-	struct rq_pelt_event *e;
+	u64 min_interval = sa_opts.pelt_min_interval * 1000ULL;
+	unsigned int i, n = 0;
 
-	if (!bpf_core_field_exists(rq->avg_thermal))
-		return 0;
+	if (!last)
+		return true;
 
-	unsigned long load_avg = BPF_CORE_READ(rq, avg_thermal.load_avg);
+	for (i = 0; i < PELT_NR_FIELDS; i++) {
+		u32 prev, cur;
 
-	e = bpf_ringbuf_reserve(&rq_pelt_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->type = PELT_TYPE_THERMAL;
-		e->load_avg = load_avg;
-		e->runnable_avg = -1;
-		e->util_avg = -1;
-		e->util_est_enqueued = -1;
-		e->util_est_ewma = -1;
-		e->uclamp_min = -1;
-		e->uclamp_max = -1;
-		bpf_ringbuf_submit(e, 0);
+		if (!(fields & (1 << i)))
+			continue;
+		if (n >= nr)
+			break;
+
+		prev = last->values[i];
+		cur = values[n++];
+
+		if (!last->ts[i])
+			return true;
+		if ((cur > prev ? cur - prev : prev - cur) > sa_opts.pelt_deadband)
+			return true;
+		if (min_interval && now - last->ts[i] >= min_interval)
+			return true;
 	}
 
-	return 0;
+	return false;
 }
 
-SEC("raw_tp/sched_update_nr_running_tp")
-int BPF_PROG(handle_sched_update_nr_running, struct rq *rq, int change)
+static __always_inline void pelt_update_last(struct pelt_last *last, u8 fields,
+					     const u32 *values, unsigned int nr,
+					     u64 now)
 {
-	int cpu = BPF_CORE_READ(rq, cpu);
-	struct rq_nr_running_event *e;
+	unsigned int i, n = 0;
 
-	int nr_running = BPF_CORE_READ(rq, nr_running);
+	if (!last)
+		return;
 
-	bpf_printk("[CPU%d] nr_running = %d change = %d",
-		  cpu, nr_running, change);
+	for (i = 0; i < PELT_NR_FIELDS; i++) {
+		if (!(fields & (1 << i)))
+			continue;
+		if (n >= nr)
+			break;
 
-	e = bpf_ringbuf_reserve(&rq_nr_running_rb, sizeof(*e), 0);
-	if (e) {
-	       e->ts = bpf_ktime_get_boot_ns();
-	       e->cpu = cpu;
-	       e->nr_running = nr_running;
-	       e->change = change;
-	       bpf_ringbuf_submit(e, 0);
+		last->ts[i] = now;
+		last->values[i] = values[n++];
 	}
-
-	return 0;
 }
 
-SEC("raw_tp/sched_switch")
-int BPF_PROG(handle_sched_switch, bool preempt,
-	     struct task_struct *prev, struct task_struct *next)
+static __always_inline void pelt_hist_add(struct pelt_hist *hist, u32 value)
 {
-	int cpu;
-	if (bpf_core_field_exists(prev->wake_cpu)) {
-		cpu = BPF_CORE_READ(prev, wake_cpu);
-	} else {
-		struct task_struct__old *prev_old = (void*)prev;
-		cpu = BPF_CORE_READ(prev_old, cpu);
-	}
-	struct sched_switch_event *e;
-	char comm[TASK_COMM_LEN];
-	int running = 1;
-	pid_t pid;
+	u32 bucket = value / PELT_HIST_BUCKET_WIDTH;
 
-	pid = BPF_CORE_READ(prev, pid);
-	bpf_map_delete_elem(&sched_switch, &pid);
+	if (bucket >= PELT_HIST_NR_BUCKETS)
+		bucket = PELT_HIST_NR_BUCKETS - 1;
 
-	BPF_CORE_READ_STR_INTO(&comm, prev, comm);
-	bpf_printk("[CPU%d] comm = %s running = %d",
-		   cpu, comm, 0);
+	__sync_fetch_and_add(&hist->buckets[bucket], 1);
+}
 
-	pid = BPF_CORE_READ(next, pid);
-	bpf_map_update_elem(&sched_switch, &pid, &running, BPF_ANY);
+static __always_inline void rq_pelt_hist_add(int cpu, int signal, u32 value)
+{
+	int key = (cpu * 2 + (sa_runtime.hist_slot & 1)) * PELT_HIST_NR_SIGNALS + signal;
+	struct pelt_hist *hist;
 
-	BPF_CORE_READ_STR_INTO(&comm, next, comm);
-	bpf_printk("[CPU%d] comm = %s running = %d",
-		   cpu, comm, 1);
+	if (sa_runtime.paused)
+		return;
 
-	e = bpf_ringbuf_reserve(&sched_switch_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->pid = BPF_CORE_READ(prev, pid);
-		BPF_CORE_READ_STR_INTO(&e->comm, prev, comm);
-		e->running = 0;
-		bpf_ringbuf_submit(e, 0);
-	}
+	hist = bpf_map_lookup_elem(&rq_pelt_hist, &key);
+	if (hist)
+		pelt_hist_add(hist, value);
+}
 
-	e = bpf_ringbuf_reserve(&sched_switch_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->pid = BPF_CORE_READ(next, pid);
-		BPF_CORE_READ_STR_INTO(&e->comm, next, comm);
-		e->running = 1;
-		bpf_ringbuf_submit(e, 0);
+static __always_inline void task_pelt_hist_add(pid_t pid, int signal, u32 value)
+{
+	struct task_pelt_hist_key key = {
+		.pid = pid,
+		.slot = sa_runtime.hist_slot & 1,
+		.signal = signal,
+	};
+	struct pelt_hist *hist;
+
+	if (sa_runtime.paused)
+		return;
+
+	hist = bpf_map_lookup_elem(&task_pelt_hist, &key);
+	if (!hist) {
+		/* Lost the count if the map is full */
+		bpf_map_update_elem(&task_pelt_hist, &key, &pelt_hist_zero, BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&task_pelt_hist, &key);
 	}
+	if (hist)
+		pelt_hist_add(hist, value);
+}
 
-	return 0;
+static __always_inline struct cpu_residency *cpu_residency_of(int cpu)
+{
+	if ((!sa_opts.residency && !sa_opts.cpu_freq) || sa_runtime.paused)
+		return 0;
+
+	return bpf_map_lookup_elem(&cpu_residency, &cpu);
 }
 
-SEC("raw_tp/sched_process_free")
-int BPF_PROG(handle_sched_process_free, struct task_struct *p)
+/*
+ * Nothing is accounted until the first change is seen, we don't know which
+ * state the CPU was in before.
+ */
+static __always_inline void residency_idle(int cpu, unsigned int state, u64 now)
 {
-	struct task_pelt_event *e;
-	char comm[TASK_COMM_LEN];
-	pid_t pid;
-	int cpu;
+	struct cpu_residency *r = cpu_residency_of(cpu);
+	unsigned int prev;
 
-	if (bpf_core_field_exists(p->wake_cpu)) {
-		cpu = BPF_CORE_READ(p, wake_cpu);
-	} else {
-		struct task_struct__old *p_old = (void *)p;
-		cpu = BPF_CORE_READ(p_old, cpu);
-	}
-	pid = BPF_CORE_READ(p, pid);
-	BPF_CORE_READ_STR_INTO(&comm, p, comm);
+	if (!r)
+		return;
 
-	e = bpf_ringbuf_reserve(&task_pelt_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->pid = pid;
-		BPF_CORE_READ_STR_INTO(&e->comm, p, comm);
-		e->load_avg = 0;
-		e->runnable_avg = 0;
-		e->util_avg = -0;
-		e->util_est_enqueued = 0;
-		e->util_est_ewma = 0;
-		e->uclamp_min = 0;
-		e->uclamp_max = 0;
-		e->running = 0;
-		bpf_ringbuf_submit(e, 0);
-	}
+	prev = r->idle_idx;
+	if (r->idle_ts && prev <= SA_MAX_IDLE_STATES)
+		r->idle[prev] += now - r->idle_ts;
 
-	return 0;
+	/* PWR_EVENT_EXIT is -1, which wraps to 0 */
+	state += 1;
+	r->idle_idx = state > SA_MAX_IDLE_STATES ? SA_MAX_IDLE_STATES : state;
+	r->idle_ts = now;
 }
 
-SEC("raw_tp/cpu_frequency")
-int BPF_PROG(handle_cpu_frequency, unsigned int frequency, unsigned int cpu)
+static __always_inline void residency_util(int cpu, u32 util, u64 now)
 {
-	struct freq_idle_event *e;
-	int idle_state = -1;
+	struct cpu_residency *r = cpu_residency_of(cpu);
+	unsigned int prev, bucket;
 
-	bpf_printk("[CPU%d] freq = %u idle_state = %u",
-		   cpu, frequency, idle_state);
+	if (!r)
+		return;
 
-	e = bpf_ringbuf_reserve(&freq_idle_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->frequency = frequency;
-		e->idle_state = idle_state;
-		e->idle_miss = 0;
-		bpf_ringbuf_submit(e, 0);
+	prev = r->util_bucket;
+	if (r->util_ts && prev < PELT_HIST_NR_BUCKETS)
+		r->util[prev] += now - r->util_ts;
+
+	bucket = util / PELT_HIST_BUCKET_WIDTH;
+	r->util_bucket = bucket >= PELT_HIST_NR_BUCKETS ? PELT_HIST_NR_BUCKETS - 1 : bucket;
+	r->util_ts = now;
+}
+
+static __always_inline void residency_freq(int cpu, unsigned int freq, u64 now)
+{
+	struct cpu_residency *r = cpu_residency_of(cpu);
+	struct freq_residency_key key;
+	u64 *total, delta;
+
+	if (!r)
+		return;
+
+	if (r->freq_ts) {
+		key.cpu = cpu;
+		key.freq = r->freq;
+		delta = now - r->freq_ts;
+
+		total = bpf_map_lookup_elem(&freq_residency, &key);
+		if (total)
+			*total += delta;
+		else
+			bpf_map_update_elem(&freq_residency, &key, &delta, BPF_NOEXIST);
 	}
 
-	return 0;
+	r->freq = freq;
+	r->freq_ts = now;
 }
 
-SEC("raw_tp/cpu_idle")
-int BPF_PROG(handle_cpu_idle, unsigned int state, unsigned int cpu)
+/*
+ * Account the time since the last switch or frequency change on @cpu to the
+ * task running there, at the frequency it ran at. A frequency change racing
+ * with a switch could charge a slice to the wrong task, it is never lost.
+ */
+static __always_inline struct cpu_freq_task *task_freq_account(int cpu, u64 now)
 {
-	int idle_state = (int)state;
-	unsigned int frequency = 0;
-	struct freq_idle_event *e;
+	struct task_freq_residency_key key;
+	struct cpu_freq_task *c;
+	u64 *total, delta;
 
-	bpf_printk("[CPU%d] freq = %u idle_state = %u",
-		   cpu, frequency, idle_state);
+	if (!sa_opts.cpu_freq || sa_runtime.paused)
+		return 0;
 
-	e = bpf_ringbuf_reserve(&freq_idle_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->frequency = frequency;
-		e->idle_state = idle_state;
-		e->idle_miss = 0;
-		bpf_ringbuf_submit(e, 0);
+	c = bpf_map_lookup_elem(&cpu_freq_task, &cpu);
+	if (!c)
+		return 0;
+
+	if (c->pid && c->freq && c->ts) {
+		key.pid = c->pid;
+		key.freq = c->freq;
+		delta = now - c->ts;
+
+		total = bpf_map_lookup_elem(&task_freq_residency, &key);
+		if (total)
+			__sync_fetch_and_add(total, delta);
+		else
+			bpf_map_update_elem(&task_freq_residency, &key, &delta, BPF_NOEXIST);
 	}
 
-	return 0;
+	c->ts = now;
+
+	return c;
 }
 
-SEC("raw_tp/cpu_idle_miss")
-int BPF_PROG(handle_cpu_idle_miss, unsigned int cpu,
-	     unsigned int state, bool below)
+/*
+ * Submit a rq or task PELT event made of @nr packed @values, @nr must be a
+ * constant. @values may hold more than what @fields says is present.
+ */
+static __always_inline void submit_pelt(void *rb, unsigned int nr, int prog,
+					struct pelt_last *last, int cpu,
+					pid_t pid, u8 type, u8 fields,
+					const u32 *values)
 {
-	int idle_state = (int)state;
-	unsigned int frequency = 0;
-	struct freq_idle_event *e;
+	u64 now = bpf_ktime_get_boot_ns();
+	struct pelt_event *hdr;
+	unsigned int *dst;
+	unsigned int i;
 
-	bpf_printk("[CPU%d] freq = %u idle_state = %u",
-		   cpu, frequency, idle_state);
+	if (!pelt_changed(last, fields, values, nr, now))
+		return;
 
-	e = bpf_ringbuf_reserve(&freq_idle_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = bpf_ktime_get_boot_ns();
-		e->cpu = cpu;
-		e->frequency = frequency;
-		e->idle_state = idle_state;
-		e->idle_miss = below ? -1 : 1;
-		bpf_ringbuf_submit(e, 0);
-	}
+	hdr = sa_ringbuf_reserve(rb, sizeof(*hdr) + nr * sizeof(*dst), prog);
+	if (!hdr)
+		return;
 
-	return 0;
+	pelt_event_init(hdr, now, cpu, pid, type, fields);
+	dst = (void *)(hdr + 1);
+	for (i = 0; i < nr; i++)
+		dst[i] = values[i];
+	bpf_ringbuf_submit(hdr, 0);
+
+	pelt_update_last(last, fields, values, nr, now);
 }
 
-SEC("raw_tp/softirq_entry")
-int BPF_PROG(handle_softirq_entry, unsigned int vec_nr)
+/*
+ * Effective uclamp values of @p when active, the requested ones otherwise.
+ * -1 when the kernel doesn't support uclamp.
+ */
+static __always_inline void task_uclamp(struct task_struct *p,
+					unsigned long *uclamp_min,
+					unsigned long *uclamp_max)
 {
-	int cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
-	bpf_map_update_elem(&softirq_entry, &cpu, &ts, BPF_ANY);
-
-	return 0;
+	*uclamp_min = -1;
+	*uclamp_max = -1;
+
+	if (bpf_core_field_exists(p->uclamp_req[UCLAMP_MIN].value))
+		*uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp_req[UCLAMP_MIN].value);
+	if (bpf_core_field_exists(p->uclamp_req[UCLAMP_MAX].value))
+		*uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp_req[UCLAMP_MAX].value);
+
+	if (bpf_core_field_exists(p->uclamp[UCLAMP_MIN].value)) {
+		bool active = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].active);
+		if (active)
+			*uclamp_min = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MIN].value);
+	}
+	if (bpf_core_field_exists(p->uclamp[UCLAMP_MAX].value)) {
+		bool active = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].active);
+		if (active)
+			*uclamp_max = BPF_CORE_READ_BITFIELD_PROBED(p, uclamp[UCLAMP_MAX].value);
+	}
 }
 
-SEC("raw_tp/softirq_exit")
-int BPF_PROG(handle_softirq_exit, unsigned int vec_nr)
+static __always_inline int __handle_pelt_se(struct sched_entity *se, bool direct)
 {
-	int cpu = bpf_get_smp_processor_id();
-	u64 exit_ts = bpf_ktime_get_boot_ns();
-	struct softirq_event *e;
-	u64 entry_ts, *ts;
+	if (entity_is_task(se, direct)) {
+		struct task_struct *p = container_of(se, struct task_struct, se);
+		unsigned long uclamp_min, uclamp_max;
+		struct task_state *state;
+		u32 values[5];
+		bool running;
+		u8 fields;
+		int cpu;
+		pid_t pid;
 
-	ts = bpf_map_lookup_elem(&softirq_entry, &cpu);
-	if (!ts)
-		return 0;
-	bpf_map_delete_elem(&softirq_entry, &cpu);
+		if (bpf_core_field_exists(p->wake_cpu)) {
+			cpu = BPF_CORE_READ(p, wake_cpu);
+		} else {
+			struct task_struct__old *p_old = (void *)p;
+			cpu = BPF_CORE_READ(p_old, cpu);
+		}
+		pid = BPF_CORE_READ(p, pid);
+		if (ignore_task(p, pid))
+			return 0;
+
+		if (sa_opts.histogram) {
+			if (sa_opts.runnable_avg_task)
+				task_pelt_hist_add(pid, PELT_HIST_RUNNABLE_AVG,
+						   pelt_u32(SA_READ(direct, se, avg.runnable_avg)));
+			if (sa_opts.util_avg_task)
+				task_pelt_hist_add(pid, PELT_HIST_UTIL_AVG,
+						   pelt_u32(SA_READ(direct, se, avg.util_avg)));
+			return 0;
+		}
 
-	entry_ts = *ts;
+		state = task_state_of(p, pid, direct, SA_PROG_PELT_SE);
+		running = task_running(p, state);
 
-	e = bpf_ringbuf_reserve(&softirq_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = entry_ts;
-		e->cpu = cpu;
-		copy_softirq(e->softirq, vec_nr);
-		e->duration = exit_ts - entry_ts;
-		bpf_ringbuf_submit(e, 0);
+		task_uclamp(p, &uclamp_min, &uclamp_max);
+
+		bpf_printk("[%d] Eff: uclamp_min = %lu uclamp_max = %lu",
+			   pid, uclamp_min, uclamp_max);
+
+		fields = PELT_F(LOAD_AVG) | PELT_F(RUNNABLE_AVG) | PELT_F(UTIL_AVG);
+		if (uclamp_min != -1 && uclamp_max != -1)
+			fields |= PELT_F(UCLAMP_MIN) | PELT_F(UCLAMP_MAX);
+
+		values[0] = pelt_u32(SA_READ(direct, se, avg.load_avg));
+		values[1] = pelt_u32(SA_READ(direct, se, avg.runnable_avg));
+		values[2] = pelt_u32(SA_READ(direct, se, avg.util_avg));
+		values[3] = uclamp_min;
+		values[4] = uclamp_max;
+
+		submit_pelt(&task_pelt_rb, 5, SA_PROG_PELT_SE,
+			    task_pelt_last_of(state), cpu, pid,
+			    PELT_TYPE_CFS | (running ? PELT_FLAG_RUNNING : 0),
+			    fields, values);
 	}
 
 	return 0;
 }
 
-SEC("kprobe/_nohz_idle_balance.isra.0")
-int BPF_PROG(handle_nohz_idle_balance_entry, struct rq *rq)
+SEC("raw_tp/pelt_se_tp")
+int BPF_PROG(handle_pelt_se, struct sched_entity *se)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	int lb_cpu = BPF_CORE_READ(rq, cpu);
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	return __handle_pelt_se(se, false);
+}
+
+SEC("tp_btf/pelt_se_tp")
+int BPF_PROG(handle_pelt_se_btf, struct sched_entity *se)
+{
+	return __handle_pelt_se(se, true);
+}
+
+static __always_inline int __handle_util_est_se(struct sched_entity *se, bool direct)
+{
+	if (entity_is_task(se, direct)) {
+		struct task_struct *p = container_of(se, struct task_struct, se);
+		unsigned long util_est_enqueued, util_est_ewma;
+		struct task_state *state;
+		u32 values[2];
+		bool running;
+		int cpu;
+		pid_t pid;
+
+		if (bpf_core_field_exists(p->wake_cpu)) {
+			cpu = BPF_CORE_READ(p, wake_cpu);
+		} else {
+			struct task_struct__old *p_old = (void *)p;
+			cpu = BPF_CORE_READ(p_old, cpu);
+		}
+		pid = BPF_CORE_READ(p, pid);
+		if (ignore_task(p, pid))
+			return 0;
+
+		if (LINUX_KERNEL_VERSION < KERNEL_VERSION(6, 8, 0)) {
+			struct sched_avg__pre68 *avg_old = (void *)&se->avg;
+			util_est_enqueued = BPF_PROBE_READ(avg_old, util_est.enqueued);
+			util_est_ewma = BPF_PROBE_READ(avg_old, util_est.ewma);
+		} else {
+			util_est_enqueued = SA_READ(direct, se, avg.util_est);
+			util_est_ewma = 0;
+		}
+
+		values[0] = util_est_enqueued & ~UTIL_AVG_UNCHANGED;
+		values[1] = util_est_ewma;
+
+		if (sa_opts.histogram) {
+			task_pelt_hist_add(pid, PELT_HIST_UTIL_EST, values[0]);
+			return 0;
+		}
+
+		state = task_state_of(p, pid, direct, SA_PROG_UTIL_EST_SE);
+		running = task_running(p, state);
+
+		submit_pelt(&task_pelt_rb, 2, SA_PROG_UTIL_EST_SE,
+			    task_pelt_last_of(state), cpu, pid,
+			    PELT_TYPE_CFS | (running ? PELT_FLAG_RUNNING : 0),
+			    PELT_F(UTIL_EST_ENQUEUED) | PELT_F(UTIL_EST_EWMA),
+			    values);
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/sched_util_est_se_tp")
+int BPF_PROG(handle_util_est_se, struct sched_entity *se)
+{
+	return __handle_util_est_se(se, false);
+}
+
+SEC("tp_btf/sched_util_est_se_tp")
+int BPF_PROG(handle_util_est_se_btf, struct sched_entity *se)
+{
+	return __handle_util_est_se(se, true);
+}
+
+static __always_inline int __handle_pelt_cfs(struct cfs_rq *cfs_rq, bool direct)
+{
+	if (cfs_rq_is_root(cfs_rq, direct)) {
+		struct rq *rq = rq_of(cfs_rq, direct);
+		int cpu = SA_READ(rq_direct(cfs_rq, direct), rq, cpu);
+		u32 values[5];
+		u8 fields;
+
+		unsigned long uclamp_min = -1;
+		unsigned long uclamp_max = -1;
+
+		if (sa_opts.residency)
+			residency_util(cpu, pelt_u32(SA_READ(direct, cfs_rq, avg.util_avg)),
+				       bpf_ktime_get_boot_ns());
+
+		/* Could be loaded for --residency only */
+		if (!sa_opts.load_avg_cpu && !sa_opts.runnable_avg_cpu && !sa_opts.util_avg_cpu)
+			return 0;
+
+		if (sa_opts.histogram) {
+			if (sa_opts.runnable_avg_cpu)
+				rq_pelt_hist_add(cpu, PELT_HIST_RUNNABLE_AVG,
+						 pelt_u32(SA_READ(direct, cfs_rq, avg.runnable_avg)));
+			if (sa_opts.util_avg_cpu)
+				rq_pelt_hist_add(cpu, PELT_HIST_UTIL_AVG,
+						 pelt_u32(SA_READ(direct, cfs_rq, avg.util_avg)));
+			return 0;
+		}
+
+		if (bpf_core_field_exists(rq->uclamp[UCLAMP_MIN].value))
+			uclamp_min = SA_READ(rq_direct(cfs_rq, direct), rq, uclamp[UCLAMP_MIN].value);
+		if (bpf_core_field_exists(rq->uclamp[UCLAMP_MAX].value))
+			uclamp_max = SA_READ(rq_direct(cfs_rq, direct), rq, uclamp[UCLAMP_MAX].value);
+
+		bpf_printk("cfs: [CPU%d] uclamp_min = %lu uclamp_max = %lu",
+			   cpu, uclamp_min, uclamp_max);
+
+		fields = PELT_F(LOAD_AVG) | PELT_F(RUNNABLE_AVG) | PELT_F(UTIL_AVG);
+		if (uclamp_min != -1 && uclamp_max != -1)
+			fields |= PELT_F(UCLAMP_MIN) | PELT_F(UCLAMP_MAX);
+
+		values[0] = pelt_u32(SA_READ(direct, cfs_rq, avg.load_avg));
+		values[1] = pelt_u32(SA_READ(direct, cfs_rq, avg.runnable_avg));
+		values[2] = pelt_u32(SA_READ(direct, cfs_rq, avg.util_avg));
+		values[3] = uclamp_min;
+		values[4] = uclamp_max;
+
+		submit_pelt(&rq_pelt_rb, 5, SA_PROG_PELT_CFS,
+			    rq_pelt_last_of(cpu, PELT_TYPE_CFS), cpu, 0,
+			    PELT_TYPE_CFS, fields, values);
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/pelt_cfs_tp")
+int BPF_PROG(handle_pelt_cfs, struct cfs_rq *cfs_rq)
+{
+	return __handle_pelt_cfs(cfs_rq, false);
+}
+
+SEC("tp_btf/pelt_cfs_tp")
+int BPF_PROG(handle_pelt_cfs_btf, struct cfs_rq *cfs_rq)
+{
+	return __handle_pelt_cfs(cfs_rq, true);
+}
+
+static __always_inline int __handle_util_est_cfs(struct cfs_rq *cfs_rq, bool direct)
+{
+	if (cfs_rq_is_root(cfs_rq, direct)) {
+		unsigned long util_est_enqueued, util_est_ewma;
+		struct rq *rq = rq_of(cfs_rq, direct);
+		int cpu = SA_READ(rq_direct(cfs_rq, direct), rq, cpu);
+		u32 values[2];
+
+		if (LINUX_KERNEL_VERSION < KERNEL_VERSION(6, 8, 0)) {
+			struct sched_avg__pre68 *avg_old = (void *)&cfs_rq->avg;
+			util_est_enqueued = BPF_PROBE_READ(avg_old, util_est.enqueued);
+			util_est_ewma = BPF_PROBE_READ(avg_old, util_est.ewma);
+		} else {
+			util_est_enqueued = SA_READ(direct, cfs_rq, avg.util_est);
+			util_est_ewma = 0;
+		}
+
+		bpf_printk("cfs: [CPU%d] util_est.enqueued = %lu util_est.ewma = %lu",
+			   cpu, util_est_enqueued, util_est_ewma);
+
+		values[0] = util_est_enqueued & ~UTIL_AVG_UNCHANGED;
+		values[1] = util_est_ewma;
+
+		if (sa_opts.histogram) {
+			rq_pelt_hist_add(cpu, PELT_HIST_UTIL_EST, values[0]);
+			return 0;
+		}
+
+		submit_pelt(&rq_pelt_rb, 2, SA_PROG_UTIL_EST_CFS,
+			    rq_pelt_last_of(cpu, PELT_TYPE_CFS), cpu, 0,
+			    PELT_TYPE_CFS,
+			    PELT_F(UTIL_EST_ENQUEUED) | PELT_F(UTIL_EST_EWMA),
+			    values);
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/sched_util_est_cfs_tp")
+int BPF_PROG(handle_util_est_cfs, struct cfs_rq *cfs_rq)
+{
+	return __handle_util_est_cfs(cfs_rq, false);
+}
+
+SEC("tp_btf/sched_util_est_cfs_tp")
+int BPF_PROG(handle_util_est_cfs_btf, struct cfs_rq *cfs_rq)
+{
+	return __handle_util_est_cfs(cfs_rq, true);
+}
+
+static __always_inline int __handle_pelt_rt(struct rq *rq, bool direct)
+{
+	int cpu = SA_READ(direct, rq, cpu);
+	u32 value;
+
+	if (!bpf_core_field_exists(rq->avg_rt))
+		return 0;
+
+	unsigned long util_avg = SA_READ(direct, rq, avg_rt.util_avg);
+
+	value = pelt_u32(util_avg);
+	submit_pelt(&rq_pelt_rb, 1, SA_PROG_PELT_RT,
+		    rq_pelt_last_of(cpu, PELT_TYPE_RT), cpu, 0,
+		    PELT_TYPE_RT, PELT_F(UTIL_AVG), &value);
+
+	return 0;
+}
+
+SEC("raw_tp/pelt_rt_tp")
+int BPF_PROG(handle_pelt_rt, struct rq *rq)
+{
+	return __handle_pelt_rt(rq, false);
+}
+
+SEC("tp_btf/pelt_rt_tp")
+int BPF_PROG(handle_pelt_rt_btf, struct rq *rq)
+{
+	return __handle_pelt_rt(rq, true);
+}
+
+static __always_inline int __handle_pelt_dl(struct rq *rq, bool direct)
+{
+	int cpu = SA_READ(direct, rq, cpu);
+	u32 value;
+
+	if (!bpf_core_field_exists(rq->avg_dl))
+		return 0;
+
+	unsigned long util_avg = SA_READ(direct, rq, avg_dl.util_avg);
+
+	value = pelt_u32(util_avg);
+	submit_pelt(&rq_pelt_rb, 1, SA_PROG_PELT_DL,
+		    rq_pelt_last_of(cpu, PELT_TYPE_DL), cpu, 0,
+		    PELT_TYPE_DL, PELT_F(UTIL_AVG), &value);
+
+	return 0;
+}
+
+SEC("raw_tp/pelt_dl_tp")
+int BPF_PROG(handle_pelt_dl, struct rq *rq)
+{
+	return __handle_pelt_dl(rq, false);
+}
+
+SEC("tp_btf/pelt_dl_tp")
+int BPF_PROG(handle_pelt_dl_btf, struct rq *rq)
+{
+	return __handle_pelt_dl(rq, true);
+}
+
+static __always_inline int __handle_pelt_irq(struct rq *rq, bool direct)
+{
+	int cpu = SA_READ(direct, rq, cpu);
+	u32 value;
+
+	if (!bpf_core_field_exists(rq->avg_irq))
+		return 0;
+
+	unsigned long util_avg = SA_READ(direct, rq, avg_irq.util_avg);
+
+	value = pelt_u32(util_avg);
+	submit_pelt(&rq_pelt_rb, 1, SA_PROG_PELT_IRQ,
+		    rq_pelt_last_of(cpu, PELT_TYPE_IRQ), cpu, 0,
+		    PELT_TYPE_IRQ, PELT_F(UTIL_AVG), &value);
+
+	return 0;
+}
+
+SEC("raw_tp/pelt_irq_tp")
+int BPF_PROG(handle_pelt_irq, struct rq *rq)
+{
+	return __handle_pelt_irq(rq, false);
+}
+
+SEC("tp_btf/pelt_irq_tp")
+int BPF_PROG(handle_pelt_irq_btf, struct rq *rq)
+{
+	return __handle_pelt_irq(rq, true);
+}
+
+static __always_inline int __handle_pelt_thermal(struct rq *rq, bool direct)
+{
+	int cpu = SA_READ(direct, rq, cpu);
+	u32 value;
+
+	if (!bpf_core_field_exists(rq->avg_thermal))
+		return 0;
+
+	unsigned long load_avg = SA_READ(direct, rq, avg_thermal.load_avg);
+
+	value = pelt_u32(load_avg);
+	submit_pelt(&rq_pelt_rb, 1, SA_PROG_PELT_THERMAL,
+		    rq_pelt_last_of(cpu, PELT_TYPE_THERMAL), cpu, 0,
+		    PELT_TYPE_THERMAL, PELT_F(LOAD_AVG), &value);
+
+	return 0;
+}
+
+SEC("raw_tp/pelt_thermal_tp")
+int BPF_PROG(handle_pelt_thermal, struct rq *rq)
+{
+	return __handle_pelt_thermal(rq, false);
+}
+
+SEC("tp_btf/pelt_thermal_tp")
+int BPF_PROG(handle_pelt_thermal_btf, struct rq *rq)
+{
+	return __handle_pelt_thermal(rq, true);
+}
+
+static __always_inline int __handle_sched_update_nr_running(struct rq *rq, int change, bool direct)
+{
+	int cpu = SA_READ(direct, rq, cpu);
+	struct rq_nr_running_event *e;
+
+	int nr_running = SA_READ(direct, rq, nr_running);
+
+	bpf_printk("[CPU%d] nr_running = %d change = %d",
+		  cpu, nr_running, change);
+
+	e = sa_ringbuf_reserve(&rq_nr_running_rb, sizeof(*e), SA_PROG_SCHED_UPDATE_NR_RUNNING);
+	if (e) {
+	       e->ts = bpf_ktime_get_boot_ns();
+	       e->cpu = cpu;
+	       e->nr_running = nr_running;
+	       e->change = change;
+	       bpf_ringbuf_submit(e, 0);
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/sched_update_nr_running_tp")
+int BPF_PROG(handle_sched_update_nr_running, struct rq *rq, int change)
+{
+	return __handle_sched_update_nr_running(rq, change, false);
+}
+
+SEC("tp_btf/sched_update_nr_running_tp")
+int BPF_PROG(handle_sched_update_nr_running_btf, struct rq *rq, int change)
+{
+	return __handle_sched_update_nr_running(rq, change, true);
+}
+
+static __always_inline unsigned int log2_u64(u64 v)
+{
+	unsigned int r = 0, shift;
+
+	for (shift = 32; shift; shift >>= 1) {
+		if (v >> shift) {
+			v >>= shift;
+			r += shift;
+		}
+	}
+
+	return r;
+}
+
+static __always_inline void duration_stats_add(struct duration_stats *stats, u64 duration)
+{
+	unsigned int bucket = duration >= 2000 ? log2_u64(duration / 1000) : 0;
+
+	if (bucket >= DURATION_HIST_NR_BUCKETS)
+		bucket = DURATION_HIST_NR_BUCKETS - 1;
+
+	stats->count++;
+	stats->time += duration;
+	stats->buckets[bucket]++;
+}
+
+static __always_inline bool task_runnable(struct task_struct *p)
+{
+	struct task_struct__old *p_old = (void *)p;
+
+	if (bpf_core_field_exists(p->__state))
+		return !BPF_CORE_READ(p, __state);
+
+	return !BPF_CORE_READ(p_old, state);
+}
+
+/*
+ * Start the --wakeup_latency clock of @p, it is stopped when @p switches in.
+ */
+static __always_inline void wakeup_latency_start(struct task_struct *p, u64 ts)
+{
+	struct task_state *state;
+	pid_t pid = p->pid;
+
+	if (!pid || task_filtered(p, pid))
+		return;
+
+	state = get_task_state(p);
+	if (state)
+		state->runnable_ts = ts;
+}
+
+static __always_inline void wakeup_latency_add(void *map, void *key, u64 delay)
+{
+	struct duration_stats *stats;
+
+	stats = bpf_map_lookup_elem(map, key);
+	if (!stats) {
+		struct duration_stats zero_stats = { 0 };
+
+		bpf_map_update_elem(map, key, &zero_stats, BPF_NOEXIST);
+		stats = bpf_map_lookup_elem(map, key);
+	}
+	if (stats)
+		duration_stats_add(stats, delay);
+}
+
+static __always_inline void wakeup_latency_stop(struct task_struct *p,
+						struct task_state *state,
+						int cpu, u64 ts)
+{
+	struct wakeup_event *e;
+	u64 runnable_ts, delay, cgrp_id;
+	pid_t pid = p->pid;
+	int zero = 0;
+
+	if (!state || !state->runnable_ts)
+		return;
+
+	runnable_ts = state->runnable_ts;
+	state->runnable_ts = 0;
+	delay = ts - runnable_ts;
+
+	if (sa_runtime.paused)
+		return;
+
+	wakeup_latency_add(&cpu_wakeup_latency, &zero, delay);
+	wakeup_latency_add(&task_wakeup_latency, &pid, delay);
+	cgrp_id = BPF_CORE_READ(p, cgroups, dfl_cgrp, kn, id);
+	wakeup_latency_add(&cgroup_wakeup_latency, &cgrp_id, delay);
+
+	/* Only delays longer than --wakeup_latency_threshold are sent individually */
+	if (!sa_opts.wakeup_latency_threshold ||
+	    delay < sa_opts.wakeup_latency_threshold * 1000ULL)
+		return;
+
+	e = sa_ringbuf_reserve(&wakeup_rb, sizeof(*e), SA_PROG_WAKEUP_LATENCY);
+	if (e) {
+		e->ts = runnable_ts;
+		e->delay = delay;
+		e->cpu = cpu;
+		e->pid = pid;
+		bpf_ringbuf_submit(e, 0);
+	}
+}
+
+SEC("tp_btf/sched_waking")
+int BPF_PROG(handle_sched_waking, struct task_struct *p)
+{
+	wakeup_latency_start(p, bpf_ktime_get_boot_ns());
+	return 0;
+}
+
+SEC("tp_btf/sched_wakeup_new")
+int BPF_PROG(handle_sched_wakeup_new, struct task_struct *p)
+{
+	wakeup_latency_start(p, bpf_ktime_get_boot_ns());
+	return 0;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(handle_sched_switch, bool preempt,
+	     struct task_struct *prev, struct task_struct *next)
+{
+	int cpu = bpf_get_smp_processor_id();
+	struct sched_switch_event *e;
+	struct task_state *state;
+	pid_t pid;
+
+	state = bpf_task_storage_get(&task_state, prev, 0, 0);
+	if (state) {
+		state->running = false;
+		/* Userspace drops prev signals to 0, next ones must go through */
+		if (sa_opts.sched_switch && pelt_filtering())
+			__builtin_memset(&state->pelt, 0, sizeof(state->pelt));
+	}
+
+	state = get_task_state(next);
+	if (state)
+		state->running = true;
+
+	announce_task(next, state, SA_PROG_SCHED_SWITCH_META);
+
+	if (sa_opts.wakeup_latency) {
+		u64 ts = bpf_ktime_get_boot_ns();
+
+		/* Preempted tasks wait on the rq just like woken up ones */
+		if (preempt || task_runnable(prev))
+			wakeup_latency_start(prev, ts);
+		wakeup_latency_stop(next, state, cpu, ts);
+	}
+
+	if (sa_opts.cpu_freq) {
+		struct cpu_freq_task *c = task_freq_account(cpu, bpf_ktime_get_boot_ns());
+
+		if (c)
+			c->pid = task_filtered(next, next->pid) ? 0 : next->pid;
+	}
+
+	if (!sa_opts.sched_switch)
+		return 0;
+
+	/* Userspace only cares about tasks switching out */
+	pid = prev->pid;
+	if (!pid || ignore_task(prev, pid))
+		return 0;
+
+	bpf_printk("[CPU%d] pid = %d running = %d",
+		   cpu, pid, 0);
+
+	e = sa_ringbuf_reserve(&sched_switch_rb, sizeof(*e), SA_PROG_SCHED_SWITCH);
+	if (e) {
+		e->ts = bpf_ktime_get_boot_ns();
+		e->cpu = cpu;
+		e->pid = pid;
+		e->running = 0;
+		bpf_ringbuf_submit(e, 0);
+	}
+
+	return 0;
+}
+
+static __always_inline int __handle_sched_process_free(struct task_struct *p, bool direct)
+{
+	struct task_pelt_event *e;
+	pid_t pid;
+	int cpu;
+
+	if (bpf_core_field_exists(p->wake_cpu)) {
+		cpu = SA_READ(direct, p, wake_cpu);
+	} else {
+		struct task_struct__old *p_old = (void *)p;
+		cpu = BPF_CORE_READ(p_old, cpu);
+	}
+	pid = SA_READ(direct, p, pid);
+	if (sa_opts.histogram || ignore_task(p, pid))
+		goto out;
+
+	/* No values, userspace drops all the signals of an exited task to 0 */
+	e = sa_ringbuf_reserve(&task_pelt_rb, TASK_PELT_EVENT_SIZE(0), SA_PROG_SCHED_PROCESS_FREE);
+	if (e) {
+		pelt_event_init(&e->hdr, bpf_ktime_get_boot_ns(), cpu, pid,
+				PELT_TYPE_CFS | PELT_FLAG_EXITED, 0);
+		bpf_ringbuf_submit(e, 0);
+	}
+
+out:
+	bpf_map_delete_elem(&filter_comm_cache, &pid);
+	if (sa_opts.wakeup_latency)
+		bpf_map_delete_elem(&task_wakeup_latency, &pid);
+	return 0;
+}
+
+SEC("raw_tp/sched_process_free")
+int BPF_PROG(handle_sched_process_free, struct task_struct *p)
+{
+	return __handle_sched_process_free(p, false);
+}
+
+SEC("tp_btf/sched_process_free")
+int BPF_PROG(handle_sched_process_free_btf, struct task_struct *p)
+{
+	return __handle_sched_process_free(p, true);
+}
+
+static __always_inline int __handle_task_rename(struct task_struct *p, const char *comm, bool direct)
+{
+	pid_t pid = SA_READ(direct, p, pid);
+
+	/* Force matching the new comm against --comm filters */
+	bpf_map_delete_elem(&filter_comm_cache, &pid);
+
+	/* p->comm is updated after the tracepoint, match and send the new one */
+	if ((task_events_enabled() || sa_opts.cpu_freq) &&
+	    !__task_filtered(p, pid, comm))
+		emit_task_meta(pid, comm, SA_PROG_TASK_RENAME);
+
+	return 0;
+}
+
+SEC("raw_tp/task_rename")
+int BPF_PROG(handle_task_rename, struct task_struct *p, const char *comm)
+{
+	return __handle_task_rename(p, comm, false);
+}
+
+SEC("tp_btf/task_rename")
+int BPF_PROG(handle_task_rename_btf, struct task_struct *p, const char *comm)
+{
+	return __handle_task_rename(p, comm, true);
+}
+
+SEC("raw_tp/cpu_frequency")
+int BPF_PROG(handle_cpu_frequency, unsigned int frequency, unsigned int cpu)
+{
+	u64 now = bpf_ktime_get_boot_ns();
+	struct cpu_freq_task *c;
+
+	bpf_printk("[CPU%d] freq = %u", cpu, frequency);
+
+	/* The frequency timeline comes from perfetto's own cpu_frequency event */
+	residency_freq(cpu, frequency, now);
+
+	c = task_freq_account(cpu, now);
+	if (c)
+		c->freq = frequency;
+
+	if (sa_opts.sugov && !sa_runtime.paused) {
+		struct sugov_event *e;
+
+		e = sa_ringbuf_reserve(&sugov_rb, sizeof(*e), SA_PROG_SUGOV_CPU_FREQUENCY);
+		if (e) {
+			__builtin_memset(e, 0, sizeof(*e));
+			e->ts = now;
+			e->type = SUGOV_FREQ;
+			e->cpu = cpu;
+			e->cur_freq = frequency;
+			bpf_ringbuf_submit(e, 0);
+		}
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/cpu_idle")
+int BPF_PROG(handle_cpu_idle, unsigned int state, unsigned int cpu)
+{
+	int idle_state = (int)state;
+	unsigned int frequency = 0;
+	struct freq_idle_event *e;
+
+	bpf_printk("[CPU%d] freq = %u idle_state = %u",
+		   cpu, frequency, idle_state);
+
+	if (sa_opts.residency)
+		residency_idle(cpu, state, bpf_ktime_get_boot_ns());
+
+	/* Could be loaded for --residency only */
+	if (!sa_opts.cpu_idle)
+		return 0;
+
+	e = sa_ringbuf_reserve(&freq_idle_rb, sizeof(*e), SA_PROG_CPU_IDLE);
+	if (e) {
+		e->ts = bpf_ktime_get_boot_ns();
+		e->cpu = cpu;
+		e->frequency = frequency;
+		e->idle_state = idle_state;
+		e->idle_miss = 0;
+		bpf_ringbuf_submit(e, 0);
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/cpu_idle_miss")
+int BPF_PROG(handle_cpu_idle_miss, unsigned int cpu,
+	     unsigned int state, bool below)
+{
+	int idle_state = (int)state;
+	unsigned int frequency = 0;
+	struct freq_idle_event *e;
+
+	bpf_printk("[CPU%d] freq = %u idle_state = %u",
+		   cpu, frequency, idle_state);
+
+	/* Fires on the CPU leaving idle */
+	if (sa_opts.idle_governor && !sa_runtime.paused && state < SA_MAX_IDLE_STATES) {
+		int zero = 0;
+		struct idle_gov_stats *stats = bpf_map_lookup_elem(&idle_gov_stats, &zero);
+
+		if (stats) {
+			if (below)
+				stats->miss_below[state]++;
+			else
+				stats->miss_above[state]++;
+		}
+	}
+
+	if (!sa_opts.cpu_idle_miss_events)
+		return 0;
+
+	e = sa_ringbuf_reserve(&freq_idle_rb, sizeof(*e), SA_PROG_CPU_IDLE_MISS);
+	if (e) {
+		e->ts = bpf_ktime_get_boot_ns();
+		e->cpu = cpu;
+		e->frequency = frequency;
+		e->idle_state = idle_state;
+		e->idle_miss = below ? -1 : 1;
+		bpf_ringbuf_submit(e, 0);
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/softirq_entry")
+int BPF_PROG(handle_softirq_entry, unsigned int vec_nr)
+{
+	int zero = 0;
+	u64 *ts;
+
+	ts = bpf_map_lookup_elem(&softirq_entry, &zero);
+	if (ts)
+		*ts = bpf_ktime_get_boot_ns();
+
+	return 0;
+}
+
+SEC("raw_tp/softirq_exit")
+int BPF_PROG(handle_softirq_exit, unsigned int vec_nr)
+{
+	int cpu = bpf_get_smp_processor_id();
+	u64 exit_ts = bpf_ktime_get_boot_ns();
+	struct duration_stats *stats;
+	struct softirq_event *e;
+	u64 entry_ts, duration, *ts;
+	int zero = 0;
+	int vec = vec_nr;
+
+	ts = bpf_map_lookup_elem(&softirq_entry, &zero);
+	if (!ts || !*ts)
+		return 0;
+
+	entry_ts = *ts;
+	*ts = 0;
+	duration = exit_ts - entry_ts;
+
+	if (sa_runtime.paused)
+		return 0;
+
+	stats = bpf_map_lookup_elem(&softirq_stats, &vec);
+	if (stats)
+		duration_stats_add(stats, duration);
+
+	/* Only softirqs longer than --softirq_threshold are sent individually */
+	if (!sa_opts.softirq_threshold || duration < sa_opts.softirq_threshold * 1000ULL)
+		return 0;
+
+	e = sa_ringbuf_reserve(&softirq_rb, sizeof(*e), SA_PROG_SOFTIRQ_EXIT);
+	if (e) {
+		e->ts = entry_ts;
+		e->cpu = cpu;
+		copy_softirq(e->softirq, vec_nr);
+		e->duration = duration;
+		bpf_ringbuf_submit(e, 0);
+	}
+
+	return 0;
+}
+
+SEC("raw_tp/irq_handler_entry")
+int BPF_PROG(handle_irq_handler_entry, int irq, struct irqaction *action)
+{
+	int zero = 0;
+	u64 *ts;
+
+	ts = bpf_map_lookup_elem(&irq_entry, &zero);
+	if (ts)
+		*ts = bpf_ktime_get_boot_ns();
+
+	return 0;
+}
+
+SEC("raw_tp/irq_handler_exit")
+int BPF_PROG(handle_irq_handler_exit, int irq, struct irqaction *action, int ret)
+{
+	int cpu = bpf_get_smp_processor_id();
+	u64 exit_ts = bpf_ktime_get_boot_ns();
+	struct duration_stats *stats;
+	u64 entry_ts, duration, *ts;
+	struct irq_event *e;
+	int zero = 0;
+
+	ts = bpf_map_lookup_elem(&irq_entry, &zero);
+	if (!ts || !*ts)
+		return 0;
+
+	entry_ts = *ts;
+	*ts = 0;
+	duration = exit_ts - entry_ts;
+
+	if (sa_runtime.paused)
+		return 0;
+
+	stats = bpf_map_lookup_elem(&irq_stats, &irq);
+	if (!stats) {
+		struct duration_stats zero_stats = { 0 };
+
+		bpf_map_update_elem(&irq_stats, &irq, &zero_stats, BPF_NOEXIST);
+		stats = bpf_map_lookup_elem(&irq_stats, &irq);
+	}
+	if (stats)
+		duration_stats_add(stats, duration);
+
+	/* Only irqs longer than --irq_threshold are sent individually */
+	if (!sa_opts.irq_threshold || duration < sa_opts.irq_threshold * 1000ULL)
+		return 0;
+
+	e = sa_ringbuf_reserve(&irq_rb, sizeof(*e), SA_PROG_IRQ_HANDLER_EXIT);
+	if (e) {
+		e->ts = entry_ts;
+		e->duration = duration;
+		e->cpu = cpu;
+		e->irq = irq;
+		bpf_probe_read_kernel_str(e->name, sizeof(e->name), BPF_CORE_READ(action, name));
+		bpf_ringbuf_submit(e, 0);
+	}
+
+	return 0;
+}
+
+static __always_inline void lb_phase_enter(enum lb_phases phase, int lb_cpu,
+					   int sd_level)
+{
+	int key = phase;
+	struct lb_phase_state *state = bpf_map_lookup_elem(&lb_state, &key);
+
+	if (state) {
+		state->ts = bpf_ktime_get_boot_ns();
+		state->imbalance = 0;
+		state->lb_cpu = lb_cpu;
+		state->sd_level = sd_level;
+		state->active = true;
+	}
+}
 
-	int key = LB_NOHZ_IDLE_BALANCE << 16 | this_cpu;
-	bpf_map_update_elem(&lb_map, &key, &lb_cpu, BPF_ANY);
+static __always_inline struct lb_event *lb_event_reserve(enum lb_phases phase,
+							 int lb_cpu, bool entry,
+							 int prog)
+{
+	struct lb_event *e;
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
+	e = sa_ringbuf_reserve(&lb_rb, sizeof(*e), prog);
 	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
+		e->hdr.ts = bpf_ktime_get_boot_ns();
+		e->hdr.cpu = bpf_get_smp_processor_id();
+		e->hdr.type = LB_RECORD_PHASE;
+		e->duration = 0;
 		e->lb_cpu = lb_cpu;
-		e->phase = LB_NOHZ_IDLE_BALANCE;
-		e->entry = true;
+		e->phase = phase;
+		e->entry = entry;
+		e->sd_level = -1;
+		e->outcome = -1;
+		e->overloaded = -1;
+		e->overutilized = -1;
+		e->misfit_task_load = -1;
+	}
+
+	return e;
+}
+
+static __always_inline void lb_entry(enum lb_phases phase, struct rq *rq,
+				     int lb_cpu, int sd_level, bool misfit, int prog)
+{
+	struct lb_event *e;
+
+	lb_phase_enter(phase, lb_cpu, sd_level);
+
+	/* --load_balance_stats only sends outliers, on exit */
+	if (sa_opts.load_balance_stats)
+		return;
+
+	e = lb_event_reserve(phase, lb_cpu, true, prog);
+	if (e) {
+		e->sd_level = sd_level;
 		e->overloaded = BPF_CORE_READ(rq, rd, overload);
 		e->overutilized = BPF_CORE_READ(rq, rd, overutilized);
-		e->misfit_task_load = -1;
+		if (misfit)
+			e->misfit_task_load = BPF_CORE_READ(rq, misfit_task_load);
+		bpf_ringbuf_submit(e, 0);
+	}
+}
+
+/*
+ * Account a phase into --load_balance_stats and send it whole when it took
+ * longer than --load_balance_threshold. @ld_moved is what load_balance()
+ * returned, -1 for the other phases.
+ */
+static __always_inline void lb_stats_add(enum lb_phases phase,
+					 struct lb_phase_state *state,
+					 int ld_moved, int prog)
+{
+	u64 duration = bpf_ktime_get_boot_ns() - state->ts;
+	int sd_level = -1, outcome = -1;
+	struct lb_stats *stats;
+	struct lb_event *e;
+	int key;
+
+	if (sa_runtime.paused)
+		return;
+
+	if (phase == LB_LOAD_BALANCE) {
+		sd_level = state->sd_level;
+		if (ld_moved > 0)
+			outcome = LB_PULLED;
+		else if (state->imbalance > 0)
+			outcome = LB_FAILED;
+		else
+			outcome = LB_BALANCED;
+	}
+
+	if (sd_level < 0)
+		key = LB_STATS_KEY(phase, 0);
+	else if (sd_level >= MAX_SD_LEVELS)
+		key = LB_STATS_KEY(phase, MAX_SD_LEVELS - 1);
+	else
+		key = LB_STATS_KEY(phase, sd_level);
+
+	stats = bpf_map_lookup_elem(&lb_stats, &key);
+	if (stats) {
+		duration_stats_add(&stats->duration, duration);
+		if (outcome >= 0 && outcome < LB_NR_OUTCOMES)
+			stats->outcome[outcome]++;
+		if (ld_moved > 0)
+			stats->nr_moved += ld_moved;
+	}
+
+	if (!sa_opts.load_balance_threshold ||
+	    duration < sa_opts.load_balance_threshold * 1000ULL)
+		return;
+
+	e = lb_event_reserve(phase, state->lb_cpu, true, prog);
+	if (e) {
+		e->hdr.ts = state->ts;
+		e->duration = duration;
+		e->sd_level = sd_level;
+		e->outcome = outcome;
 		bpf_ringbuf_submit(e, 0);
 	}
+}
+
+static __always_inline void lb_exit(enum lb_phases phase, int ld_moved, int prog)
+{
+	int key = phase;
+	struct lb_phase_state *state = bpf_map_lookup_elem(&lb_state, &key);
+	struct lb_event *e;
+
+	/* We didn't see the entry */
+	if (!state || !state->active)
+		return;
+
+	state->active = false;
+
+	if (sa_opts.load_balance_stats) {
+		lb_stats_add(phase, state, ld_moved, prog);
+		return;
+	}
+
+	e = lb_event_reserve(phase, state->lb_cpu, false, prog);
+	if (e)
+		bpf_ringbuf_submit(e, 0);
+}
+
+/*
+ * Load balance functions are traced with fentry/fexit, or kprobe/kretprobe
+ * pairs when the kernel can't attach them. Userspace picks one flavour and
+ * resolves .isra/.constprop clones for kprobes.
+ */
+SEC("fentry/_nohz_idle_balance")
+int BPF_PROG(handle_nohz_idle_balance_fentry, struct rq *rq)
+{
+	lb_entry(LB_NOHZ_IDLE_BALANCE, rq, BPF_CORE_READ(rq, cpu), -1, false,
+		 SA_PROG_NOHZ_IDLE_BALANCE_ENTRY);
+	return 0;
+}
+
+SEC("fexit/_nohz_idle_balance")
+int BPF_PROG(handle_nohz_idle_balance_fexit)
+{
+	lb_exit(LB_NOHZ_IDLE_BALANCE, -1, SA_PROG_NOHZ_IDLE_BALANCE_EXIT);
+	return 0;
+}
+
+SEC("kprobe/_nohz_idle_balance")
+int BPF_KPROBE(handle_nohz_idle_balance_entry, struct rq *rq)
+{
+	lb_entry(LB_NOHZ_IDLE_BALANCE, rq, BPF_CORE_READ(rq, cpu), -1, false,
+		 SA_PROG_NOHZ_IDLE_BALANCE_ENTRY);
+	return 0;
+}
 
+SEC("kretprobe/_nohz_idle_balance")
+int BPF_KRETPROBE(handle_nohz_idle_balance_exit)
+{
+	lb_exit(LB_NOHZ_IDLE_BALANCE, -1, SA_PROG_NOHZ_IDLE_BALANCE_EXIT);
 	return 0;
 }
 
-SEC("kretprobe/_nohz_idle_balance.isra.0")
-int BPF_PROG(handle_nohz_idle_balance_exit)
+static __always_inline void run_rebalance_domains_entry(void)
 {
 	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
 	struct lb_event *e;
 
-	int key = LB_NOHZ_IDLE_BALANCE << 16 | this_cpu;
-	int *lb_cpu = bpf_map_lookup_elem(&lb_map, &key);
-	if (!lb_cpu)
-		return 0;
-	bpf_map_delete_elem(&lb_map, &key);
+	lb_phase_enter(LB_RUN_REBALANCE_DOMAINS, this_cpu, -1);
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = *lb_cpu;
-		e->phase = LB_NOHZ_IDLE_BALANCE;
-		e->entry = false;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
+	if (sa_opts.load_balance_stats)
+		return;
+
+	e = lb_event_reserve(LB_RUN_REBALANCE_DOMAINS, this_cpu, true,
+			     SA_PROG_RUN_REBALANCE_DOMAINS_ENTRY);
+	if (e)
 		bpf_ringbuf_submit(e, 0);
-	}
+}
+
+SEC("fentry/run_rebalance_domains")
+int BPF_PROG(handle_run_rebalance_domains_fentry)
+{
+	run_rebalance_domains_entry();
+	return 0;
+}
 
+SEC("fexit/run_rebalance_domains")
+int BPF_PROG(handle_run_rebalance_domains_fexit)
+{
+	lb_exit(LB_RUN_REBALANCE_DOMAINS, -1, SA_PROG_RUN_REBALANCE_DOMAINS_EXIT);
 	return 0;
 }
 
 SEC("kprobe/run_rebalance_domains")
-int BPF_PROG(handle_run_rebalance_domains_entry)
+int BPF_KPROBE(handle_run_rebalance_domains_entry)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
+	run_rebalance_domains_entry();
+	return 0;
+}
+
+SEC("kretprobe/run_rebalance_domains")
+int BPF_KRETPROBE(handle_run_rebalance_domains_exit)
+{
+	lb_exit(LB_RUN_REBALANCE_DOMAINS, -1, SA_PROG_RUN_REBALANCE_DOMAINS_EXIT);
+	return 0;
+}
+
+/*
+ * Send the balance_interval of each domain of @rq that changed since we last
+ * saw it.
+ */
+static __always_inline void lb_sd_intervals_update(struct rq *rq,
+						   enum cpu_idle_type idle, int prog)
+{
+	struct sched_domain *sd = BPF_CORE_READ(rq, sd);
+	unsigned int nr_running = BPF_CORE_READ(rq, nr_running);
+	int cpu = BPF_CORE_READ(rq, cpu);
+	bool sched_idle = false, busy;
+	int i;
+
+	/* Kernels without SCHED_IDLE accounting in cfs_rq never see it as such */
+	if (bpf_core_field_exists(rq->cfs.idle_h_nr_running))
+		sched_idle = nr_running &&
+			     nr_running == BPF_CORE_READ(rq, cfs.idle_h_nr_running);
+	busy = idle != CPU_IDLE && !sched_idle;
+
+	for (i = 0; i < MAX_SD_LEVELS && sd; i++) {
+		unsigned int interval = BPF_CORE_READ(sd, balance_interval);
+		int level = BPF_CORE_READ(sd, level);
+		int key = cpu * MAX_SD_LEVELS + i;
+		struct lb_sd_event *e;
+		u32 *last;
+
+		if (busy)
+			interval *= BPF_CORE_READ(sd, busy_factor);
+
+		sd = BPF_CORE_READ(sd, parent);
+
+		last = bpf_map_lookup_elem(&lb_sd_interval, &key);
+		if (!last || *last == interval)
+			continue;
+
+		e = sa_ringbuf_reserve(&lb_rb, sizeof(*e), prog);
+		if (e) {
+			e->hdr.ts = bpf_ktime_get_boot_ns();
+			e->hdr.cpu = cpu;
+			e->hdr.type = LB_RECORD_SD_INTERVAL;
+			e->level = level;
+			e->balance_interval = interval;
+			bpf_ringbuf_submit(e, 0);
+			*last = interval;
+		}
+	}
+}
+
+static __always_inline void rebalance_domains_entry(struct rq *rq, enum cpu_idle_type idle)
+{
+	int lb_cpu = BPF_CORE_READ(rq, cpu);
 	struct lb_event *e;
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = this_cpu;
-		e->phase = LB_RUN_REBALANCE_DOMAINS;
-		e->entry = true;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
-		bpf_ringbuf_submit(e, 0);
-	}
+	lb_phase_enter(LB_REBALANCE_DOMAINS, lb_cpu, -1);
+	lb_sd_intervals_update(rq, idle, SA_PROG_REBALANCE_DOMAINS_ENTRY);
+
+	if (sa_opts.load_balance_stats)
+		return;
+
+	e = lb_event_reserve(LB_REBALANCE_DOMAINS, lb_cpu, true,
+			     SA_PROG_REBALANCE_DOMAINS_ENTRY);
+	if (e) {
+		e->overloaded = BPF_CORE_READ(rq, rd, overload);
+		e->overutilized = BPF_CORE_READ(rq, rd, overutilized);
+		e->misfit_task_load = BPF_CORE_READ(rq, misfit_task_load);
+		bpf_ringbuf_submit(e, 0);
+	}
+}
+
+SEC("fentry/rebalance_domains")
+int BPF_PROG(handle_rebalance_domains_fentry, struct rq *rq, enum cpu_idle_type idle)
+{
+	rebalance_domains_entry(rq, idle);
+	return 0;
+}
+
+SEC("fexit/rebalance_domains")
+int BPF_PROG(handle_rebalance_domains_fexit)
+{
+	lb_exit(LB_REBALANCE_DOMAINS, -1, SA_PROG_REBALANCE_DOMAINS_EXIT);
+	return 0;
+}
+
+SEC("kprobe/rebalance_domains")
+int BPF_KPROBE(handle_rebalance_domains_entry, struct rq *rq, enum cpu_idle_type idle)
+{
+	rebalance_domains_entry(rq, idle);
+	return 0;
+}
+
+SEC("kretprobe/rebalance_domains")
+int BPF_KRETPROBE(handle_rebalance_domains_exit)
+{
+	lb_exit(LB_REBALANCE_DOMAINS, -1, SA_PROG_REBALANCE_DOMAINS_EXIT);
+	return 0;
+}
+
+SEC("fentry/balance_fair")
+int BPF_PROG(handle_balance_fair_fentry, struct rq *rq)
+{
+	lb_entry(LB_BALANCE_FAIR, rq, BPF_CORE_READ(rq, cpu), -1, true,
+		 SA_PROG_BALANCE_FAIR_ENTRY);
+	return 0;
+}
+
+SEC("fexit/balance_fair")
+int BPF_PROG(handle_balance_fair_fexit)
+{
+	lb_exit(LB_BALANCE_FAIR, -1, SA_PROG_BALANCE_FAIR_EXIT);
+	return 0;
+}
+
+SEC("kprobe/balance_fair")
+int BPF_KPROBE(handle_balance_fair_entry, struct rq *rq)
+{
+	lb_entry(LB_BALANCE_FAIR, rq, BPF_CORE_READ(rq, cpu), -1, true,
+		 SA_PROG_BALANCE_FAIR_ENTRY);
+	return 0;
+}
+
+SEC("kretprobe/balance_fair")
+int BPF_KRETPROBE(handle_balance_fair_exit)
+{
+	lb_exit(LB_BALANCE_FAIR, -1, SA_PROG_BALANCE_FAIR_EXIT);
+	return 0;
+}
+
+SEC("fentry/pick_next_task_fair")
+int BPF_PROG(handle_pick_next_task_fair_fentry, struct rq *rq)
+{
+	lb_entry(LB_PICK_NEXT_TASK_FAIR, rq, BPF_CORE_READ(rq, cpu), -1, true,
+		 SA_PROG_PICK_NEXT_TASK_FAIR_ENTRY);
+	return 0;
+}
+
+SEC("fexit/pick_next_task_fair")
+int BPF_PROG(handle_pick_next_task_fair_fexit)
+{
+	lb_exit(LB_PICK_NEXT_TASK_FAIR, -1, SA_PROG_PICK_NEXT_TASK_FAIR_EXIT);
+	return 0;
+}
+
+SEC("kprobe/pick_next_task_fair")
+int BPF_KPROBE(handle_pick_next_task_fair_entry, struct rq *rq)
+{
+	lb_entry(LB_PICK_NEXT_TASK_FAIR, rq, BPF_CORE_READ(rq, cpu), -1, true,
+		 SA_PROG_PICK_NEXT_TASK_FAIR_ENTRY);
+	return 0;
+}
+
+SEC("kretprobe/pick_next_task_fair")
+int BPF_KRETPROBE(handle_pick_next_task_fair_exit)
+{
+	lb_exit(LB_PICK_NEXT_TASK_FAIR, -1, SA_PROG_PICK_NEXT_TASK_FAIR_EXIT);
+	return 0;
+}
+
+SEC("fentry/newidle_balance")
+int BPF_PROG(handle_newidle_balance_fentry, struct rq *rq)
+{
+	lb_entry(LB_NEWIDLE_BALANCE, rq, BPF_CORE_READ(rq, cpu), -1, true,
+		 SA_PROG_NEWIDLE_BALANCE_ENTRY);
+	return 0;
+}
+
+SEC("fexit/newidle_balance")
+int BPF_PROG(handle_newidle_balance_fexit)
+{
+	lb_exit(LB_NEWIDLE_BALANCE, -1, SA_PROG_NEWIDLE_BALANCE_EXIT);
+	return 0;
+}
+
+SEC("kprobe/newidle_balance")
+int BPF_KPROBE(handle_newidle_balance_entry, struct rq *rq)
+{
+	lb_entry(LB_NEWIDLE_BALANCE, rq, BPF_CORE_READ(rq, cpu), -1, true,
+		 SA_PROG_NEWIDLE_BALANCE_ENTRY);
+	return 0;
+}
+
+SEC("kretprobe/newidle_balance")
+int BPF_KRETPROBE(handle_newidle_balance_exit)
+{
+	lb_exit(LB_NEWIDLE_BALANCE, -1, SA_PROG_NEWIDLE_BALANCE_EXIT);
+	return 0;
+}
+
+SEC("fentry/load_balance")
+int BPF_PROG(handle_load_balance_fentry, int lb_cpu, struct rq *lb_rq,
+	     struct sched_domain *sd)
+{
+	lb_entry(LB_LOAD_BALANCE, lb_rq, lb_cpu, BPF_CORE_READ(sd, level), true,
+		 SA_PROG_LOAD_BALANCE_ENTRY);
+	return 0;
+}
+
+SEC("fexit/load_balance")
+int BPF_PROG(handle_load_balance_fexit, int lb_cpu, struct rq *lb_rq,
+	     struct sched_domain *sd, enum cpu_idle_type idle,
+	     int *continue_balancing, int ld_moved)
+{
+	lb_exit(LB_LOAD_BALANCE, ld_moved, SA_PROG_LOAD_BALANCE_EXIT);
+	return 0;
+}
+
+SEC("kprobe/load_balance")
+int BPF_KPROBE(handle_load_balance_entry, int lb_cpu, struct rq *lb_rq,
+	       struct sched_domain *sd)
+{
+	lb_entry(LB_LOAD_BALANCE, lb_rq, lb_cpu, BPF_CORE_READ(sd, level), true,
+		 SA_PROG_LOAD_BALANCE_ENTRY);
+	return 0;
+}
+
+SEC("kretprobe/load_balance")
+int BPF_KRETPROBE(handle_load_balance_exit, int ld_moved)
+{
+	lb_exit(LB_LOAD_BALANCE, ld_moved, SA_PROG_LOAD_BALANCE_EXIT);
+	return 0;
+}
+
+/*
+ * find_busiest_group() returns the busiest group when load_balance() has an
+ * imbalance to fix, env->imbalance tells how much. Only for
+ * --load_balance_stats, to tell failed attempts from balanced domains.
+ */
+static __always_inline void lb_imbalance_found(struct lb_env *env,
+					       struct sched_group *busiest)
+{
+	int key = LB_LOAD_BALANCE;
+	struct lb_phase_state *state = bpf_map_lookup_elem(&lb_state, &key);
+
+	if (state && state->active && busiest)
+		state->imbalance = BPF_CORE_READ(env, imbalance);
+}
+
+SEC("fexit/find_busiest_group")
+int BPF_PROG(handle_find_busiest_group, struct lb_env *env, struct sched_group *busiest)
+{
+	lb_imbalance_found(env, busiest);
+	return 0;
+}
+
+SEC("kprobe/find_busiest_group")
+int BPF_KPROBE(handle_find_busiest_group_entry, struct lb_env *env)
+{
+	int key = LB_LOAD_BALANCE;
+	struct lb_phase_state *state = bpf_map_lookup_elem(&lb_state, &key);
+
+	if (state)
+		state->env = (u64)env;
+
+	return 0;
+}
+
+SEC("kretprobe/find_busiest_group")
+int BPF_KRETPROBE(handle_find_busiest_group_exit, struct sched_group *busiest)
+{
+	int key = LB_LOAD_BALANCE;
+	struct lb_phase_state *state = bpf_map_lookup_elem(&lb_state, &key);
+
+	if (state)
+		lb_imbalance_found((struct lb_env *)state->env, busiest);
+
+	return 0;
+}
+
+/*
+ * Keys carry the sending CPU, which is the only one updating them.
+ */
+static __always_inline void ipi_matrix_add(int cpu, void *callsite, void *callback)
+{
+	struct ipi_key key = {
+		.from_cpu = bpf_get_smp_processor_id(),
+		.target_cpu = cpu,
+		.callsite = (u64)callsite,
+		.callback = (u64)callback,
+	};
+	u64 *count;
+
+	count = bpf_map_lookup_elem(&ipi_matrix, &key);
+	if (!count) {
+		u64 zero = 0;
+
+		bpf_map_update_elem(&ipi_matrix, &key, &zero, BPF_NOEXIST);
+		count = bpf_map_lookup_elem(&ipi_matrix, &key);
+	}
+	if (count)
+		(*count)++;
+}
+
+struct ipi_mask_ctx {
+	const unsigned long *mask;
+	unsigned long word;
+	void *callsite;
+	void *callback;
+};
+
+static long ipi_mask_add(u32 cpu, void *data)
+{
+	struct ipi_mask_ctx *ctx = data;
+
+	if (!(cpu % 64))
+		bpf_probe_read_kernel(&ctx->word, sizeof(ctx->word), ctx->mask + cpu / 64);
+
+	if (ctx->word & (1UL << (cpu % 64)))
+		ipi_matrix_add(cpu, ctx->callsite, ctx->callback);
+
+	return 0;
+}
+
+extern const void nr_cpu_ids __ksym __weak;
+
+/*
+ * Multicast IPIs, only counted with --ipi_matrix. Every CPU in @cpumask counts
+ * as one IPI from this CPU.
+ */
+SEC("raw_tp/ipi_send_cpumask")
+int BPF_PROG(handle_ipi_send_cpumask, const struct cpumask *cpumask,
+	     unsigned long callsite, void *callback)
+{
+	struct ipi_mask_ctx mask_ctx = {
+		.mask = (const unsigned long *)cpumask,
+		.callsite = (void *)callsite,
+		.callback = callback,
+	};
+	unsigned int nr_cpus = 0;
+
+	if (!sa_opts.ipi_matrix || sa_runtime.paused || !&nr_cpu_ids)
+		return 0;
+
+	bpf_probe_read_kernel(&nr_cpus, sizeof(nr_cpus), &nr_cpu_ids);
+	bpf_loop(nr_cpus, ipi_mask_add, &mask_ctx, 0);
 
 	return 0;
 }
 
-SEC("kretprobe/run_rebalance_domains")
-int BPF_PROG(handle_run_rebalance_domains_exit)
+SEC("raw_tp/ipi_send_cpu")
+int BPF_PROG(handle_ipi_send_cpu, int cpu, void *callsite, void *callback)
 {
-	int this_cpu = bpf_get_smp_processor_id();
 	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	struct ipi_event *e;
+
+	if (sa_opts.ipi_matrix) {
+		if (!sa_runtime.paused)
+			ipi_matrix_add(cpu, callsite, callback);
+		return 0;
+	}
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
+	e = sa_ringbuf_reserve(&ipi_rb, sizeof(*e), SA_PROG_IPI_SEND_CPU);
 	if (e) {
 		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = this_cpu;
-		e->phase = LB_RUN_REBALANCE_DOMAINS;
-		e->entry = false;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
+		e->from_cpu = bpf_get_smp_processor_id();
+		e->target_cpu = cpu;
+		e->callsite = callsite;
+		e->callback = callback;
 		bpf_ringbuf_submit(e, 0);
 	}
 
 	return 0;
 }
 
-static void gen_sched_domain_stats(struct rq *rq, enum cpu_idle_type idle,
-				   struct lb_sd_stats *sd_stats)
+extern struct rq runqueues __ksym __weak;
+/* arch_scale_cpu_capacity() of arm, arm64 and riscv */
+extern unsigned long cpu_scale __ksym __weak;
+
+/*
+ * rq->cpu_capacity_orig is gone since 6.8, arch_scale_cpu_capacity() is read
+ * directly instead. Architectures without cpu_scale report the default.
+ */
+static __always_inline void cpu_capacity_of(int cpu, unsigned int *capacity,
+					    unsigned int *capacity_orig)
 {
-	struct sched_domain *sd = BPF_CORE_READ(rq, sd);
-	int cpu = BPF_CORE_READ(rq, cpu);
-	int i = 0;
+	struct rq *rq;
 
-	bool sched_idle = BPF_CORE_READ(rq, nr_running) == BPF_CORE_READ(rq, cfs.idle_h_nr_running);
-	sched_idle = sched_idle && BPF_CORE_READ(rq, nr_running);
-	bool busy = idle != CPU_IDLE && !sched_idle;
+	*capacity = 0;
+	*capacity_orig = 0;
 
-	sd_stats->cpu = cpu;
+	if (cpu < 0 || !&runqueues)
+		return;
 
-	while (sd && i < MAX_SD_LEVELS) {
-		unsigned int interval = BPF_CORE_READ(sd, balance_interval);
-		if (busy)
-			interval *= BPF_CORE_READ(sd, busy_factor);
+	rq = bpf_per_cpu_ptr(&runqueues, cpu);
+	if (!rq)
+		return;
 
-		sd_stats->level[i] = BPF_CORE_READ(sd, level);
-		sd_stats->balance_interval[i] = interval;
+	*capacity = BPF_CORE_READ(rq, cpu_capacity);
 
-		sd = BPF_CORE_READ(sd, parent);
-		i++;
-	}
+	if (bpf_core_field_exists(rq->cpu_capacity_orig)) {
+		*capacity_orig = BPF_CORE_READ(rq, cpu_capacity_orig);
+	} else if (&cpu_scale) {
+		unsigned long *scale = bpf_per_cpu_ptr(&cpu_scale, cpu);
 
-	sd_stats->level[i] = -1;
-	sd_stats->balance_interval[i] = 0;
+		if (scale)
+			*capacity_orig = *scale;
+	} else {
+		*capacity_orig = SCHED_CAPACITY_SCALE;
+	}
 }
 
-SEC("kprobe/rebalance_domains")
-int BPF_PROG(handle_rebalance_domains_entry, struct rq *rq, enum cpu_idle_type idle)
+static __always_inline void placement_record(struct task_struct *p, int prev_cpu,
+					     int new_cpu, int decision, int prog)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	int lb_cpu = BPF_CORE_READ(rq, cpu);
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	struct placement_key key = { 0 };
+	unsigned long uclamp_min, uclamp_max;
+	struct placement_stats *stats;
+	struct placement_event *e;
+	unsigned int util_avg;
+	pid_t pid;
+
+	if (sa_runtime.paused || new_cpu < 0)
+		return;
+
+	pid = BPF_CORE_READ(p, pid);
+	if (ignore_task(p, pid))
+		return;
+
+	util_avg = pelt_u32(BPF_CORE_READ(p, se.avg.util_avg));
+
+	key.pid = pid;
+	key.prev_cpu = prev_cpu;
+	key.new_cpu = new_cpu;
+	key.decision = decision;
+
+	stats = bpf_map_lookup_elem(&placement_matrix, &key);
+	if (!stats) {
+		struct placement_stats zero_stats = { 0 };
 
-	int key = LB_REBALANCE_DOMAINS << 16 | this_cpu;
-	bpf_map_update_elem(&lb_map, &key, &lb_cpu, BPF_ANY);
+		bpf_map_update_elem(&placement_matrix, &key, &zero_stats, BPF_NOEXIST);
+		stats = bpf_map_lookup_elem(&placement_matrix, &key);
+	}
+	if (stats) {
+		__sync_fetch_and_add(&stats->count, 1);
+		__sync_fetch_and_add(&stats->util_avg, util_avg);
+	}
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
+	if (!sa_opts.placement_events)
+		return;
+
+	e = sa_ringbuf_reserve(&placement_rb, sizeof(*e), prog);
 	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = lb_cpu;
-		e->phase = LB_REBALANCE_DOMAINS;
-		e->entry = true;
-		e->overloaded = BPF_CORE_READ(rq, rd, overload);
-		e->overutilized = BPF_CORE_READ(rq, rd, overutilized);
-		e->misfit_task_load = BPF_CORE_READ(rq, misfit_task_load);
-		gen_sched_domain_stats(rq, idle, &e->sd_stats);
+		task_uclamp(p, &uclamp_min, &uclamp_max);
+
+		e->ts = bpf_ktime_get_boot_ns();
+		e->pid = pid;
+		e->decision = decision;
+		e->prev_cpu = prev_cpu;
+		e->new_cpu = new_cpu;
+		e->util_avg = util_avg;
+		e->uclamp_min = uclamp_min;
+		e->uclamp_max = uclamp_max;
+		cpu_capacity_of(prev_cpu, &e->capacity[0], &e->capacity_orig[0]);
+		cpu_capacity_of(new_cpu, &e->capacity[1], &e->capacity_orig[1]);
 		bpf_ringbuf_submit(e, 0);
 	}
+}
 
+/*
+ * fexit sees both the arguments and the returned CPU. kprobes are used when
+ * the kernel can't attach it or the function isn't in BTF.
+ */
+SEC("fexit/select_task_rq_fair")
+int BPF_PROG(handle_select_task_rq_fair, struct task_struct *p, int prev_cpu,
+	     int wake_flags, int new_cpu)
+{
+	placement_record(p, prev_cpu, new_cpu, PLACEMENT_SELECT_TASK_RQ,
+			 SA_PROG_SELECT_TASK_RQ_FAIR);
 	return 0;
 }
 
-SEC("kretprobe/rebalance_domains")
-int BPF_PROG(handle_rebalance_domains_exit)
+SEC("fexit/find_energy_efficient_cpu")
+int BPF_PROG(handle_find_energy_efficient_cpu, struct task_struct *p,
+	     int prev_cpu, int new_cpu)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	placement_record(p, prev_cpu, new_cpu, PLACEMENT_EAS,
+			 SA_PROG_FIND_ENERGY_EFFICIENT_CPU);
+	return 0;
+}
 
-	int key = LB_REBALANCE_DOMAINS << 16 | this_cpu;
-	int *lb_cpu = bpf_map_lookup_elem(&lb_map, &key);
-	if (!lb_cpu)
-		return 0;
-	bpf_map_delete_elem(&lb_map, &key);
+static __always_inline void placement_args_save(struct task_struct *p,
+						int prev_cpu, int decision)
+{
+	struct placement_args *args = bpf_map_lookup_elem(&placement_args, &decision);
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = *lb_cpu;
-		e->phase = LB_REBALANCE_DOMAINS;
-		e->entry = false;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
-		bpf_ringbuf_submit(e, 0);
+	if (args) {
+		args->p = p;
+		args->prev_cpu = prev_cpu;
 	}
+}
+
+static __always_inline void placement_args_record(int new_cpu, int decision,
+						  int prog)
+{
+	struct placement_args *args = bpf_map_lookup_elem(&placement_args, &decision);
+
+	if (!args || !args->p)
+		return;
+
+	placement_record(args->p, args->prev_cpu, new_cpu, decision, prog);
+	args->p = 0;
+}
 
+SEC("kprobe/select_task_rq_fair")
+int BPF_KPROBE(handle_select_task_rq_fair_entry, struct task_struct *p, int prev_cpu)
+{
+	placement_args_save(p, prev_cpu, PLACEMENT_SELECT_TASK_RQ);
 	return 0;
 }
 
-SEC("kprobe/balance_fair")
-int BPF_PROG(handle_balance_fair_entry, struct rq *rq)
+SEC("kretprobe/select_task_rq_fair")
+int BPF_KRETPROBE(handle_select_task_rq_fair_exit, int new_cpu)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	int lb_cpu = BPF_CORE_READ(rq, cpu);
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	placement_args_record(new_cpu, PLACEMENT_SELECT_TASK_RQ,
+			      SA_PROG_SELECT_TASK_RQ_FAIR);
+	return 0;
+}
+
+SEC("kprobe/find_energy_efficient_cpu")
+int BPF_KPROBE(handle_find_energy_efficient_cpu_entry, struct task_struct *p, int prev_cpu)
+{
+	placement_args_save(p, prev_cpu, PLACEMENT_EAS);
+	return 0;
+}
 
-	int key = LB_BALANCE_FAIR << 16 | this_cpu;
-	bpf_map_update_elem(&lb_map, &key, &lb_cpu, BPF_ANY);
+SEC("kretprobe/find_energy_efficient_cpu")
+int BPF_KRETPROBE(handle_find_energy_efficient_cpu_exit, int new_cpu)
+{
+	placement_args_record(new_cpu, PLACEMENT_EAS,
+			      SA_PROG_FIND_ENERGY_EFFICIENT_CPU);
+	return 0;
+}
+
+/*
+ * sugov_should_update_freq() is usually inlined, tell what it decided from
+ * what it left behind instead. last_freq_update_time is only moved to @time
+ * when a new frequency is requested, and updates closer than
+ * freq_update_delay_ns to it are dropped by rate_limit_us.
+ */
+static __always_inline void sugov_updated(struct update_util_data *hook, u64 time,
+					  int prog)
+{
+	struct sugov_cpu *sg_cpu = container_of(hook, struct sugov_cpu, update_util);
+	struct sugov_policy *sg_policy = BPF_CORE_READ(sg_cpu, sg_policy);
+	u64 last_update = BPF_CORE_READ(sg_policy, last_freq_update_time);
+	s64 delay = BPF_CORE_READ(sg_policy, freq_update_delay_ns);
+	int cpu = BPF_CORE_READ(sg_policy, policy, cpu);
+	struct sugov_stats *stats;
+	struct sugov_event *e;
+	int type;
+
+	if (sa_runtime.paused)
+		return;
+
+	stats = bpf_map_lookup_elem(&sugov_stats, &cpu);
+	if (!stats)
+		return;
+
+	/*
+	 * fexit runs after sg_policy->update_lock is released, CPUs of a
+	 * shared policy can get here at the same time. A racing update can at
+	 * worst report one more or one less dropped update of a row.
+	 */
+	if (last_update == time) {
+		type = SUGOV_REQUEST;
+		__sync_fetch_and_add(&stats->requests, 1);
+		stats->rate_limited_reported = false;
+	} else if ((s64)(time - last_update) < delay) {
+		type = SUGOV_RATE_LIMITED;
+		__sync_fetch_and_add(&stats->rate_limited, 1);
+		/* Only report the first dropped update of a row */
+		if (stats->rate_limited_reported)
+			return;
+		stats->rate_limited_reported = true;
+	} else {
+		/* Same frequency as before */
+		return;
+	}
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
+	e = sa_ringbuf_reserve(&sugov_rb, sizeof(*e), prog);
 	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = lb_cpu;
-		e->phase = LB_BALANCE_FAIR;
-		e->entry = true;
-		e->overloaded = BPF_CORE_READ(rq, rd, overload);
-		e->overutilized = BPF_CORE_READ(rq, rd, overutilized);
-		e->misfit_task_load = BPF_CORE_READ(rq, misfit_task_load);
+		e->ts = bpf_ktime_get_boot_ns();
+		e->type = type;
+		e->cpu = cpu;
+		e->update_cpu = BPF_CORE_READ(sg_cpu, cpu);
+		e->util = 0;
+		if (bpf_core_field_exists(sg_cpu->util))
+			e->util = BPF_CORE_READ(sg_cpu, util);
+		e->requested_freq = BPF_CORE_READ(sg_policy, next_freq);
+		e->cur_freq = BPF_CORE_READ(sg_policy, policy, cur);
 		bpf_ringbuf_submit(e, 0);
 	}
+}
 
+SEC("fexit/sugov_update_single_freq")
+int BPF_PROG(handle_sugov_update_single_freq, struct update_util_data *hook,
+	     u64 time, unsigned int flags)
+{
+	sugov_updated(hook, time, SA_PROG_SUGOV_UPDATE_SINGLE_FREQ);
 	return 0;
 }
 
-SEC("kretprobe/balance_fair")
-int BPF_PROG(handle_balance_fair_exit)
+SEC("fexit/sugov_update_shared")
+int BPF_PROG(handle_sugov_update_shared, struct update_util_data *hook,
+	     u64 time, unsigned int flags)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	sugov_updated(hook, time, SA_PROG_SUGOV_UPDATE_SHARED);
+	return 0;
+}
 
-	int key = LB_BALANCE_FAIR << 16 | this_cpu;
-	int *lb_cpu = bpf_map_lookup_elem(&lb_map, &key);
-	if (!lb_cpu)
-		return 0;
-	bpf_map_delete_elem(&lb_map, &key);
+static __always_inline void sugov_args_save(struct update_util_data *hook, u64 time)
+{
+	int zero = 0;
+	struct sugov_args *args = bpf_map_lookup_elem(&sugov_args, &zero);
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = *lb_cpu;
-		e->phase = LB_BALANCE_FAIR;
-		e->entry = false;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
-		bpf_ringbuf_submit(e, 0);
+	if (args) {
+		args->hook = hook;
+		args->time = time;
 	}
+}
+
+static __always_inline void sugov_args_updated(int prog)
+{
+	int zero = 0;
+	struct sugov_args *args = bpf_map_lookup_elem(&sugov_args, &zero);
+
+	if (!args || !args->hook)
+		return;
 
+	sugov_updated(args->hook, args->time, prog);
+	args->hook = 0;
+}
+
+SEC("kprobe/sugov_update_single_freq")
+int BPF_KPROBE(handle_sugov_update_single_freq_entry, struct update_util_data *hook, u64 time)
+{
+	sugov_args_save(hook, time);
 	return 0;
 }
 
-SEC("kprobe/pick_next_task_fair")
-int BPF_PROG(handle_pick_next_task_fair_entry, struct rq *rq)
+SEC("kretprobe/sugov_update_single_freq")
+int BPF_KRETPROBE(handle_sugov_update_single_freq_exit)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	int lb_cpu = BPF_CORE_READ(rq, cpu);
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	sugov_args_updated(SA_PROG_SUGOV_UPDATE_SINGLE_FREQ);
+	return 0;
+}
+
+SEC("kprobe/sugov_update_shared")
+int BPF_KPROBE(handle_sugov_update_shared_entry, struct update_util_data *hook, u64 time)
+{
+	sugov_args_save(hook, time);
+	return 0;
+}
 
-	int key = LB_PICK_NEXT_TASK_FAIR << 16 | this_cpu;
-	bpf_map_update_elem(&lb_map, &key, &lb_cpu, BPF_ANY);
+SEC("kretprobe/sugov_update_shared")
+int BPF_KRETPROBE(handle_sugov_update_shared_exit)
+{
+	sugov_args_updated(SA_PROG_SUGOV_UPDATE_SHARED);
+	return 0;
+}
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = lb_cpu;
-		e->phase = LB_PICK_NEXT_TASK_FAIR;
-		e->entry = true;
-		e->overloaded = BPF_CORE_READ(rq, rd, overload);
-		e->overutilized = BPF_CORE_READ(rq, rd, overutilized);
-		e->misfit_task_load = BPF_CORE_READ(rq, misfit_task_load);
-		bpf_ringbuf_submit(e, 0);
+extern struct teo_cpu teo_cpus __ksym __weak;
+extern struct menu_device menu_devices __ksym __weak;
+
+/*
+ * Deepest enabled state whose target residency is covered by @residency_ns.
+ */
+static __always_inline int ideal_idle_state(struct cpuidle_driver *drv,
+					    struct cpuidle_device *dev,
+					    u64 residency_ns)
+{
+	int state_count = BPF_CORE_READ(drv, state_count);
+	int i, ideal = 0;
+
+	for (i = 1; i < SA_MAX_IDLE_STATES; i++) {
+		if (i >= state_count)
+			break;
+		if (BPF_CORE_READ(dev, states_usage[i].disable))
+			continue;
+		if (BPF_CORE_READ(drv, states[i].target_residency_ns) > residency_ns)
+			break;
+		ideal = i;
 	}
 
-	return 0;
+	return ideal;
 }
 
-SEC("kretprobe/pick_next_task_fair")
-int BPF_PROG(handle_pick_next_task_fair_exit)
+static __always_inline void idle_gov_selected(struct cpuidle_driver *drv,
+					      struct cpuidle_device *dev,
+					      int selected, s64 predicted_ns)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	struct idle_gov_last *last;
+	int zero = 0;
+
+	last = bpf_map_lookup_elem(&idle_gov_last, &zero);
+	if (!last)
+		return;
+
+	last->valid = selected >= 0 && selected < SA_MAX_IDLE_STATES;
+	last->entered = false;
+	last->selected = selected;
+	last->predicted_ns = predicted_ns;
+	last->drv = drv;
+	last->dev = dev;
+}
 
-	int key = LB_PICK_NEXT_TASK_FAIR << 16 | this_cpu;
-	int *lb_cpu = bpf_map_lookup_elem(&lb_map, &key);
-	if (!lb_cpu)
+/*
+ * Account the last decision once the CPU leaves the state it selected.
+ * dev->last_residency_ns is only updated after the exit event and could still
+ * be the one of an older idle period, measure the residency here instead.
+ */
+SEC("raw_tp/cpu_idle")
+int BPF_PROG(handle_idle_gov_cpu_idle, unsigned int state, unsigned int cpu)
+{
+	u64 now = bpf_ktime_get_boot_ns();
+	struct idle_gov_stats *stats;
+	struct idle_gov_last *last;
+	struct idle_gov_cell *cell;
+	u64 residency_ns;
+	int zero = 0;
+	int ideal;
+
+	last = bpf_map_lookup_elem(&idle_gov_last, &zero);
+	stats = bpf_map_lookup_elem(&idle_gov_stats, &zero);
+	if (!last || !stats || !last->valid)
 		return 0;
-	bpf_map_delete_elem(&lb_map, &key);
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = *lb_cpu;
-		e->phase = LB_PICK_NEXT_TASK_FAIR;
-		e->entry = false;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
-		bpf_ringbuf_submit(e, 0);
+	/* PWR_EVENT_EXIT */
+	if (state != (unsigned int)-1) {
+		/* Entering something else than what was selected, drop it */
+		last->entered = (int)state == last->selected;
+		last->valid = last->entered;
+		last->idle_ts = now;
+		return 0;
 	}
 
+	last->valid = false;
+	if (!last->entered || sa_runtime.paused ||
+	    last->selected < 0 || last->selected >= SA_MAX_IDLE_STATES)
+		return 0;
+
+	residency_ns = now - last->idle_ts;
+	ideal = ideal_idle_state(last->drv, last->dev, residency_ns);
+
+	cell = &stats->matrix[last->selected][ideal];
+	cell->count++;
+	cell->predicted_ns += last->predicted_ns > 0 ? last->predicted_ns : 0;
+	cell->residency_ns += residency_ns;
+
 	return 0;
 }
 
-SEC("kprobe/newidle_balance")
-int BPF_PROG(handle_newidle_balance_entry, struct rq *rq)
+static __always_inline s64 teo_sleep_length(struct cpuidle_device *dev)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	int lb_cpu = BPF_CORE_READ(rq, cpu);
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	struct teo_cpu *cpu_data;
 
-	int key = LB_NEWIDLE_BALANCE << 16 | this_cpu;
-	bpf_map_update_elem(&lb_map, &key, &lb_cpu, BPF_ANY);
+	if (!&teo_cpus)
+		return 0;
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = lb_cpu;
-		e->phase = LB_NEWIDLE_BALANCE;
-		e->entry = true;
-		e->overloaded = BPF_CORE_READ(rq, rd, overload);
-		e->overutilized = BPF_CORE_READ(rq, rd, overutilized);
-		e->misfit_task_load = BPF_CORE_READ(rq, misfit_task_load);
-		bpf_ringbuf_submit(e, 0);
-	}
+	cpu_data = bpf_per_cpu_ptr(&teo_cpus, BPF_CORE_READ(dev, cpu));
 
-	return 0;
+	return cpu_data ? BPF_CORE_READ(cpu_data, sleep_length_ns) : 0;
 }
 
-SEC("kretprobe/newidle_balance")
-int BPF_PROG(handle_newidle_balance_exit)
+/* menu doesn't keep its prediction, only the time to the next timer */
+static __always_inline s64 menu_sleep_length(struct cpuidle_device *dev)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	struct menu_device *data;
 
-	int key = LB_NEWIDLE_BALANCE << 16 | this_cpu;
-	int *lb_cpu = bpf_map_lookup_elem(&lb_map, &key);
-	if (!lb_cpu)
+	if (!&menu_devices)
 		return 0;
-	bpf_map_delete_elem(&lb_map, &key);
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = *lb_cpu;
-		e->phase = LB_NEWIDLE_BALANCE;
-		e->entry = false;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
-		bpf_ringbuf_submit(e, 0);
-	}
+	data = bpf_per_cpu_ptr(&menu_devices, BPF_CORE_READ(dev, cpu));
+
+	return data ? BPF_CORE_READ(data, next_timer_ns) : 0;
+}
 
+SEC("fexit/teo_select")
+int BPF_PROG(handle_teo_select, struct cpuidle_driver *drv,
+	     struct cpuidle_device *dev, bool *stop_tick, int selected)
+{
+	idle_gov_selected(drv, dev, selected, teo_sleep_length(dev));
 	return 0;
 }
 
-SEC("kprobe/load_balance")
-int BPF_PROG(handle_load_balance_entry, int lb_cpu, struct rq *lb_rq,
-	     struct sched_domain *sd, enum cpu_idle_type idle)
+SEC("fexit/menu_select")
+int BPF_PROG(handle_menu_select, struct cpuidle_driver *drv,
+	     struct cpuidle_device *dev, bool *stop_tick, int selected)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
+	idle_gov_selected(drv, dev, selected, menu_sleep_length(dev));
+	return 0;
+}
 
-	int key = LB_LOAD_BALANCE << 16 | this_cpu;
-	bpf_map_update_elem(&lb_map, &key, &lb_cpu, BPF_ANY);
+static __always_inline void idle_gov_args_save(struct cpuidle_driver *drv,
+					       struct cpuidle_device *dev)
+{
+	int zero = 0;
+	struct idle_gov_last *last = bpf_map_lookup_elem(&idle_gov_last, &zero);
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = lb_cpu;
-		e->phase = LB_LOAD_BALANCE;
-		e->entry = true;
-		e->overloaded = BPF_CORE_READ(lb_rq, rd, overload);
-		e->overutilized = BPF_CORE_READ(lb_rq, rd, overutilized);
-		e->misfit_task_load = BPF_CORE_READ(lb_rq, misfit_task_load);
-		bpf_ringbuf_submit(e, 0);
+	if (last) {
+		last->drv = drv;
+		last->dev = dev;
 	}
+}
 
+SEC("kprobe/teo_select")
+int BPF_KPROBE(handle_teo_select_entry, struct cpuidle_driver *drv,
+	       struct cpuidle_device *dev)
+{
+	idle_gov_args_save(drv, dev);
 	return 0;
 }
 
-SEC("kretprobe/load_balance")
-int BPF_PROG(handle_load_balance_exit)
+SEC("kretprobe/teo_select")
+int BPF_KRETPROBE(handle_teo_select_exit, int selected)
 {
-	int this_cpu = bpf_get_smp_processor_id();
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct lb_event *e;
-
-	int key = LB_LOAD_BALANCE << 16 | this_cpu;
-	int *lb_cpu = bpf_map_lookup_elem(&lb_map, &key);
-	if (!lb_cpu)
-		return 0;
-	bpf_map_delete_elem(&lb_map, &key);
+	int zero = 0;
+	struct idle_gov_last *last = bpf_map_lookup_elem(&idle_gov_last, &zero);
 
-	e = bpf_ringbuf_reserve(&lb_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->this_cpu = this_cpu;
-		e->lb_cpu = *lb_cpu;
-		e->phase = LB_LOAD_BALANCE;
-		e->entry = false;
-		e->overloaded = -1;
-		e->overutilized = -1;
-		e->misfit_task_load = -1;
-		bpf_ringbuf_submit(e, 0);
-	}
+	if (last && last->dev)
+		idle_gov_selected(last->drv, last->dev, selected,
+				  teo_sleep_length(last->dev));
+	return 0;
+}
 
+SEC("kprobe/menu_select")
+int BPF_KPROBE(handle_menu_select_entry, struct cpuidle_driver *drv,
+	       struct cpuidle_device *dev)
+{
+	idle_gov_args_save(drv, dev);
 	return 0;
 }
 
-SEC("raw_tp/ipi_send_cpu")
-int BPF_PROG(handle_ipi_send_cpu, int cpu, void *callsite, void *callback)
+SEC("kretprobe/menu_select")
+int BPF_KRETPROBE(handle_menu_select_exit, int selected)
 {
-	u64 ts = bpf_ktime_get_boot_ns();
-	struct ipi_event *e;
+	int zero = 0;
+	struct idle_gov_last *last = bpf_map_lookup_elem(&idle_gov_last, &zero);
 
-	e = bpf_ringbuf_reserve(&ipi_rb, sizeof(*e), 0);
-	if (e) {
-		e->ts = ts;
-		e->from_cpu = bpf_get_smp_processor_id();
-		e->target_cpu = cpu;
-		e->callsite = callsite;
-		e->callback = callback;
-		bpf_ringbuf_submit(e, 0);
-	}
+	if (last && last->dev)
+		idle_gov_selected(last->drv, last->dev, selected,
+				  menu_sleep_length(last->dev));
+	return 0;
+}
+
+#define SAMPLE_RB_FILL(id, event) do {							\
+		rb_fill[SA_RB_##id].avail_data = bpf_ringbuf_query(&event##_rb, BPF_RB_AVAIL_DATA); \
+		rb_fill[SA_RB_##id].ring_size = bpf_ringbuf_query(&event##_rb, BPF_RB_RING_SIZE); \
+	} while (0)
+
+SEC("syscall")
+int sample_rb_fill(void *ctx)
+{
+	SAMPLE_RB_FILL(RQ_PELT, rq_pelt);
+	SAMPLE_RB_FILL(TASK_PELT, task_pelt);
+	SAMPLE_RB_FILL(RQ_NR_RUNNING, rq_nr_running);
+	SAMPLE_RB_FILL(SCHED_SWITCH, sched_switch);
+	SAMPLE_RB_FILL(FREQ_IDLE, freq_idle);
+	SAMPLE_RB_FILL(SOFTIRQ, softirq);
+	SAMPLE_RB_FILL(LB, lb);
+	SAMPLE_RB_FILL(IPI, ipi);
+	SAMPLE_RB_FILL(IRQ, irq);
+	SAMPLE_RB_FILL(WAKEUP, wakeup);
+	SAMPLE_RB_FILL(PLACEMENT, placement);
+	SAMPLE_RB_FILL(SUGOV, sugov);
 
 	return 0;
 }
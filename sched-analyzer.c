@@ -1,15 +1,26 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 /* Copyright (C) 2022 Qais Yousef */
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
 #include <bpf/libbpf.h>
+#include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "parse_argp.h"
 #include "parse_kallsyms.h"
 #include "perfetto_wrapper.h"
+#include "task_comm.h"
 
 #include "sched-analyzer-events.h"
 #include "sched-analyzer.skel.h"
@@ -29,310 +40,2534 @@ static void sig_handler(int sig)
 	exiting = true;
 }
 
-static bool ignore_pid_comm(pid_t pid, char *comm)
+struct pelt_sample {
+	unsigned long long ts;
+	pid_t pid;
+	int cpu;
+	int type;
+	unsigned int flags;
+	unsigned int fields;
+	unsigned long val[PELT_NR_FIELDS];
+};
+
+#define pelt_has(s, field)	((s)->fields & PELT_F(field))
+
+/*
+ * Expand a variable length rq or task PELT event into a pelt_sample.
+ * @values points at the packed signals following the fixed part of the event.
+ * An exited task carries no values, all its signals drop to 0.
+ */
+static int decode_pelt_event(struct pelt_sample *s, const struct pelt_event *hdr,
+			     const unsigned int *values, size_t values_sz)
+{
+	unsigned int i, n = 0;
+
+	s->ts = hdr->ts;
+	s->pid = hdr->pid;
+	s->cpu = hdr->cpu;
+	s->type = hdr->type & PELT_TYPE_MASK;
+	s->flags = hdr->type & ~PELT_TYPE_MASK;
+	s->fields = hdr->fields;
+
+	if (s->flags & PELT_FLAG_EXITED) {
+		s->fields = (1 << PELT_NR_FIELDS) - 1;
+		memset(s->val, 0, sizeof(s->val));
+		return 0;
+	}
+
+	for (i = 0; i < PELT_NR_FIELDS; i++) {
+		if (!(s->fields & (1 << i)))
+			continue;
+		if ((n + 1) * sizeof(*values) > values_sz) {
+			fprintf(stderr, "Truncated PELT event: fields = 0x%x size = %zu\n",
+				s->fields, values_sz);
+			return -EINVAL;
+		}
+		s->val[i] = values[n++];
+	}
+
+	return 0;
+}
+
+static int handle_rq_pelt_event(void *ctx, void *data, size_t data_sz)
+{
+	struct rq_pelt_event *e = data;
+	struct pelt_sample s;
+
+	if (data_sz < sizeof(*e))
+		return 0;
+	if (decode_pelt_event(&s, &e->hdr, e->values, data_sz - sizeof(*e)))
+		return 0;
+
+	if (sa_opts.load_avg_cpu && pelt_has(&s, LOAD_AVG) && s.type != PELT_TYPE_THERMAL)
+		trace_cpu_load_avg(s.ts, s.cpu, s.val[PELT_LOAD_AVG]);
+
+	if (sa_opts.runnable_avg_cpu && pelt_has(&s, RUNNABLE_AVG))
+		trace_cpu_runnable_avg(s.ts, s.cpu, s.val[PELT_RUNNABLE_AVG]);
+
+	if (s.type == PELT_TYPE_THERMAL){
+		if (sa_opts.load_avg_thermal && pelt_has(&s, LOAD_AVG))
+			trace_cpu_load_avg_thermal(s.ts, s.cpu, s.val[PELT_LOAD_AVG]);
+	}
+
+	if (pelt_has(&s, UTIL_AVG)) {
+		switch (s.type) {
+		case PELT_TYPE_CFS:
+			if (sa_opts.util_avg_cpu) {
+				trace_cpu_util_avg(s.ts, s.cpu, s.val[PELT_UTIL_AVG]);
+				if (pelt_has(&s, UCLAMP_MIN) && pelt_has(&s, UCLAMP_MAX)) {
+					unsigned long uclamped_avg = clamp(s.val[PELT_UTIL_AVG],
+									 s.val[PELT_UCLAMP_MIN],
+									 s.val[PELT_UCLAMP_MAX]);
+					trace_cpu_uclamped_avg(s.ts, s.cpu, uclamped_avg);
+				}
+			}
+			break;
+		case PELT_TYPE_RT:
+			if (sa_opts.util_avg_rt)
+				trace_cpu_util_avg_rt(s.ts, s.cpu, s.val[PELT_UTIL_AVG]);
+			break;
+		case PELT_TYPE_DL:
+			if (sa_opts.util_avg_dl)
+				trace_cpu_util_avg_dl(s.ts, s.cpu, s.val[PELT_UTIL_AVG]);
+			break;
+		case PELT_TYPE_IRQ:
+			if (sa_opts.util_avg_irq)
+				trace_cpu_util_avg_irq(s.ts, s.cpu, s.val[PELT_UTIL_AVG]);
+			break;
+		default:
+			fprintf(stderr, "Unexpected PELT type: %d\n", s.type);
+			break;
+		}
+	}
+
+	if (sa_opts.util_est_cpu && pelt_has(&s, UTIL_EST_ENQUEUED))
+		trace_cpu_util_est_enqueued(s.ts, s.cpu, s.val[PELT_UTIL_EST_ENQUEUED]);
+
+	return 0;
+}
+
+static int handle_task_meta_event(struct task_meta_event *e, size_t data_sz)
+{
+	if (data_sz < sizeof(*e))
+		return 0;
+
+	task_comm_set(e->hdr.pid, e->comm);
+
+	return 0;
+}
+
+static int handle_task_pelt_event(void *ctx, void *data, size_t data_sz)
+{
+	struct task_pelt_event *e = data;
+	char comm[TASK_COMM_LEN];
+	struct pelt_sample s;
+
+	if (data_sz < sizeof(*e))
+		return 0;
+	if ((e->hdr.type & PELT_TYPE_MASK) == PELT_TYPE_TASK_META)
+		return handle_task_meta_event(data, data_sz);
+	if (decode_pelt_event(&s, &e->hdr, e->values, data_sz - sizeof(*e)))
+		return 0;
+
+	task_comm_get(s.pid, comm);
+
+	if (sa_opts.load_avg_task && pelt_has(&s, LOAD_AVG))
+		trace_task_load_avg(s.ts, comm, s.pid, s.val[PELT_LOAD_AVG]);
+
+	if (sa_opts.runnable_avg_task && pelt_has(&s, RUNNABLE_AVG))
+		trace_task_runnable_avg(s.ts, comm, s.pid, s.val[PELT_RUNNABLE_AVG]);
+
+	if (sa_opts.util_avg_task && pelt_has(&s, UTIL_AVG)) {
+		trace_task_util_avg(s.ts, comm, s.pid, s.val[PELT_UTIL_AVG]);
+		if (pelt_has(&s, UCLAMP_MIN) && pelt_has(&s, UCLAMP_MAX)) {
+			unsigned long uclamped_avg = clamp(s.val[PELT_UTIL_AVG],
+							 s.val[PELT_UCLAMP_MIN],
+							 s.val[PELT_UCLAMP_MAX]);
+			trace_task_uclamped_avg(s.ts, comm, s.pid, uclamped_avg);
+		}
+	}
+
+	if (sa_opts.util_est_task && pelt_has(&s, UTIL_EST_ENQUEUED)) {
+		trace_task_util_est_enqueued(s.ts, comm, s.pid, s.val[PELT_UTIL_EST_ENQUEUED]);
+		trace_task_util_est_ewma(s.ts, comm, s.pid, s.val[PELT_UTIL_EST_EWMA]);
+	}
+
+	if (s.flags & PELT_FLAG_EXITED) {
+		release_task_counters(s.pid);
+		task_comm_exit(s.pid);
+	}
+
+	return 0;
+}
+
+static int handle_rq_nr_running_event(void *ctx, void *data, size_t data_sz)
+{
+	struct rq_nr_running_event *e = data;
+
+	if (sa_opts.cpu_nr_running)
+		trace_cpu_nr_running(e->ts, e->cpu, e->nr_running);
+
+	return 0;
+}
+
+static int handle_sched_switch_event(void *ctx, void *data, size_t data_sz)
+{
+	struct sched_switch_event *e = data;
+	char comm[TASK_COMM_LEN];
+
+	if (e->running)
+		return 0;
+
+	task_comm_get(e->pid, comm);
+
+	/* Reset signals to 0 for !running */
+	if (sa_opts.util_avg_task)
+		trace_task_load_avg(e->ts, comm, e->pid, 0);
+
+	if (sa_opts.util_avg_task) {
+		trace_task_util_avg(e->ts, comm, e->pid, 0);
+		trace_task_uclamped_avg(e->ts, comm, e->pid, 0);
+	}
+
+	if (sa_opts.util_est_task) {
+		trace_task_util_est_enqueued(e->ts, comm, e->pid, 0);
+		trace_task_util_est_ewma(e->ts, comm, e->pid, 0);
+	}
+
+	return 0;
+}
+
+static int handle_freq_idle_event(void *ctx, void *data, size_t data_sz)
+{
+	struct freq_idle_event *e = data;
+
+	if (sa_opts.cpu_idle)
+		trace_cpu_idle(e->ts, e->cpu, e->idle_state);
+	if (e->idle_miss && sa_opts.cpu_idle_miss_events)
+		trace_cpu_idle_miss(e->ts, e->cpu, e->idle_state, e->idle_miss);
+
+	return 0;
+}
+
+static int handle_softirq_event(void *ctx, void *data, size_t data_sz)
+{
+	struct softirq_event *e = data;
+
+	trace_softirq(e->ts, e->cpu, e->softirq, e->duration);
+
+	return 0;
+}
+
+static const char * const lb_phase_names[LB_NR_PHASES] = {
+	"_nohz_idle_balance()",
+	"run_rebalance_domains()",
+	"rebalance_domains()",
+	"balance_fair()",
+	"pick_next_task_fair()",
+	"newidle_balance()",
+	"load_balance()",
+};
+
+static const char * const lb_outcome_names[LB_NR_OUTCOMES] = {
+	"balanced", "pulled", "failed",
+};
+
+static void handle_lb_sd_event(struct lb_sd_event *e)
+{
+	trace_lb_sd_interval(e->hdr.ts, e->hdr.cpu, e->level, e->balance_interval);
+}
+
+static int handle_lb_event(void *ctx, void *data, size_t data_sz)
+{
+	struct lb_event *e = data;
+	const char *phase = "unknown";
+
+	if (e->hdr.type == LB_RECORD_SD_INTERVAL) {
+		handle_lb_sd_event(data);
+		return 0;
+	}
+
+	if (e->phase < LB_NR_PHASES)
+		phase = lb_phase_names[e->phase];
+
+	/* --load_balance_stats outlier, the whole phase at once */
+	if (e->duration) {
+		const char *outcome = NULL;
+
+		if (e->outcome >= 0 && e->outcome < LB_NR_OUTCOMES)
+			outcome = lb_outcome_names[e->outcome];
+
+		trace_lb_phase(e->hdr.ts, e->hdr.cpu, e->lb_cpu, phase,
+			       e->sd_level, outcome, e->duration);
+		return 0;
+	}
+
+	if (e->overloaded != -1)
+		trace_lb_overloaded(e->hdr.ts, e->overloaded);
+
+	if (e->overutilized != -1)
+		trace_lb_overutilized(e->hdr.ts, e->overutilized);
+
+	if (e->misfit_task_load != -1)
+		trace_lb_misfit(e->hdr.ts, e->lb_cpu, e->misfit_task_load);
+
+	if (e->entry)
+		trace_lb_entry(e->hdr.ts, e->hdr.cpu, e->lb_cpu, phase);
+	else
+		trace_lb_exit(e->hdr.ts, e->hdr.cpu, e->lb_cpu);
+	return 0;
+}
+
+static int handle_irq_event(void *ctx, void *data, size_t data_sz)
+{
+	struct irq_event *e = data;
+
+	trace_irq(e->ts, e->cpu, e->irq, e->name, e->duration);
+
+	return 0;
+}
+
+static int handle_wakeup_event(void *ctx, void *data, size_t data_sz)
+{
+	struct wakeup_event *e = data;
+	char comm[TASK_COMM_LEN];
+
+	task_comm_get(e->pid, comm);
+	trace_wakeup_latency(e->ts, e->cpu, comm, e->pid, e->delay);
+
+	return 0;
+}
+
+static int handle_placement_event(void *ctx, void *data, size_t data_sz)
+{
+	struct placement_event *e = data;
+	char comm[TASK_COMM_LEN];
+
+	task_comm_get(e->pid, comm);
+	trace_placement(e->ts, comm, e);
+
+	return 0;
+}
+
+static int handle_sugov_event(void *ctx, void *data, size_t data_sz)
+{
+	struct sugov_event *e = data;
+
+	switch (e->type) {
+	case SUGOV_REQUEST:
+		trace_sugov_requested_freq(e->ts, e->cpu, e->util, e->requested_freq);
+		break;
+	case SUGOV_RATE_LIMITED:
+		trace_sugov_rate_limited(e->ts, e->cpu, e->update_cpu);
+		break;
+	case SUGOV_FREQ:
+		trace_cpu_actual_freq(e->ts, e->cpu, e->cur_freq);
+		break;
+	}
+
+	return 0;
+}
+
+static int handle_ipi_event(void *ctx, void *data, size_t data_sz)
+{
+	struct ipi_event *e = data;
+
+	trace_ipi_send_cpu(e->ts, e->from_cpu, e->target_cpu,
+			   find_kallsyms(e->callsite), e->callsite,
+			   find_kallsyms(e->callback), e->callback);
+
+	return 0;
+}
+
+struct sched_analyzer_bpf *skel;
+
+static int init_filters(void)
+{
+	bool val = true;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < sa_opts.num_pids; i++) {
+		err = bpf_map__update_elem(skel->maps.filter_pid,
+					   &sa_opts.pid[i], sizeof(sa_opts.pid[i]),
+					   &val, sizeof(val), BPF_ANY);
+		if (err) {
+			fprintf(stderr, "Failed to add pid %d to filter: %d\n", sa_opts.pid[i], err);
+			return err;
+		}
+	}
+
+	for (i = 0; i < sa_opts.num_tgids; i++) {
+		err = bpf_map__update_elem(skel->maps.filter_tgid,
+					   &sa_opts.tgid[i], sizeof(sa_opts.tgid[i]),
+					   &val, sizeof(val), BPF_ANY);
+		if (err) {
+			fprintf(stderr, "Failed to add tgid %d to filter: %d\n", sa_opts.tgid[i], err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sum a u64 value of a BPF_MAP_TYPE_PERCPU_ARRAY across all CPUs.
+ */
+static unsigned long long sum_percpu_u64(struct bpf_map *map, int key)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	unsigned long long sum = 0;
+	int i;
+
+	if (nr_cpus <= 0)
+		return 0;
+
+	__u64 values[nr_cpus];
+
+	if (bpf_map__lookup_elem(map, &key, sizeof(key), values, sizeof(values), 0))
+		return 0;
+
+	for (i = 0; i < nr_cpus; i++)
+		sum += values[i];
+
+	return sum;
+}
+
+static unsigned long long get_filtered_events(void)
+{
+	return sum_percpu_u64(skel->maps.filtered_events, 0);
+}
+
+struct sa_rb {
+	const char *name;
+	struct bpf_map *map;
+	ring_buffer_sample_fn handler;
+	/* --rb_size_auto: KiB per CPU for each enabled class of events */
+	unsigned int auto_kb_per_cpu;
+};
+
+#define SA_RB(id, event, kb)	[SA_RB_##id] = { #event, NULL, handle_##event##_event, kb }
+
+static struct sa_rb sa_rbs[SA_RB_MAX] = {
+	SA_RB(RQ_PELT, rq_pelt, 16),
+	SA_RB(TASK_PELT, task_pelt, 32),
+	SA_RB(RQ_NR_RUNNING, rq_nr_running, 8),
+	SA_RB(SCHED_SWITCH, sched_switch, 32),
+	SA_RB(FREQ_IDLE, freq_idle, 4),
+	SA_RB(SOFTIRQ, softirq, 8),
+	SA_RB(LB, lb, 32),
+	SA_RB(IPI, ipi, 8),
+	SA_RB(IRQ, irq, 16),
+	SA_RB(WAKEUP, wakeup, 8),
+	SA_RB(PLACEMENT, placement, 32),
+	SA_RB(SUGOV, sugov, 8),
+};
+
+static void init_rbs(void)
+{
+	sa_rbs[SA_RB_RQ_PELT].map = skel->maps.rq_pelt_rb;
+	sa_rbs[SA_RB_TASK_PELT].map = skel->maps.task_pelt_rb;
+	sa_rbs[SA_RB_RQ_NR_RUNNING].map = skel->maps.rq_nr_running_rb;
+	sa_rbs[SA_RB_SCHED_SWITCH].map = skel->maps.sched_switch_rb;
+	sa_rbs[SA_RB_FREQ_IDLE].map = skel->maps.freq_idle_rb;
+	sa_rbs[SA_RB_SOFTIRQ].map = skel->maps.softirq_rb;
+	sa_rbs[SA_RB_LB].map = skel->maps.lb_rb;
+	sa_rbs[SA_RB_IPI].map = skel->maps.ipi_rb;
+	sa_rbs[SA_RB_IRQ].map = skel->maps.irq_rb;
+	sa_rbs[SA_RB_WAKEUP].map = skel->maps.wakeup_rb;
+	sa_rbs[SA_RB_PLACEMENT].map = skel->maps.placement_rb;
+	sa_rbs[SA_RB_SUGOV].map = skel->maps.sugov_rb;
+}
+
+/*
+ * Number of enabled classes of events that write into a ring buffer, used to
+ * scale it with --rb_size_auto.
+ */
+static unsigned int rb_nr_event_classes(enum sa_rb_id id)
+{
+	bool task_pelt = sa_opts.load_avg_task || sa_opts.runnable_avg_task || sa_opts.util_avg_task;
+	bool cpu_pelt = sa_opts.load_avg_cpu || sa_opts.runnable_avg_cpu || sa_opts.util_avg_cpu;
+
+	switch (id) {
+	case SA_RB_RQ_PELT:
+		return cpu_pelt + sa_opts.util_est_cpu + sa_opts.util_avg_rt +
+		       sa_opts.util_avg_dl + sa_opts.util_avg_irq + sa_opts.load_avg_thermal;
+	case SA_RB_TASK_PELT:
+		if (!task_pelt && !sa_opts.util_est_task)
+			/* Only task comms for --cpu_freq, --wakeup_latency and --placement */
+			return sa_opts.cpu_freq || sa_opts.wakeup_latency || sa_opts.placement;
+		return task_pelt + sa_opts.util_est_task;
+	case SA_RB_RQ_NR_RUNNING:
+		return sa_opts.cpu_nr_running;
+	case SA_RB_SCHED_SWITCH:
+		return sa_opts.sched_switch;
+	case SA_RB_FREQ_IDLE:
+		return sa_opts.cpu_idle + sa_opts.cpu_idle_miss_events;
+	case SA_RB_SOFTIRQ:
+		return sa_opts.softirq && sa_opts.softirq_threshold;
+	case SA_RB_LB:
+		return sa_opts.load_balance;
+	case SA_RB_IPI:
+		return sa_opts.ipi && !sa_opts.ipi_matrix;
+	case SA_RB_IRQ:
+		return sa_opts.irq && sa_opts.irq_threshold;
+	case SA_RB_WAKEUP:
+		return sa_opts.wakeup_latency && sa_opts.wakeup_latency_threshold;
+	case SA_RB_PLACEMENT:
+		return sa_opts.placement && sa_opts.placement_events;
+	case SA_RB_SUGOV:
+		return sa_opts.sugov;
+	default:
+		return 1;
+	}
+}
+
+static unsigned long roundup_pow_of_two(unsigned long n)
+{
+	unsigned long pow = 1;
+
+	while (pow < n)
+		pow <<= 1;
+
+	return pow;
+}
+
+/*
+ * Must be called before the skeleton is loaded. Sizes must be a power of 2
+ * multiple of page size; round up what we're given.
+ */
+static int set_rb_sizes(void)
+{
+	unsigned long page_size = sysconf(_SC_PAGESIZE);
+	int nr_cpus = libbpf_num_possible_cpus();
+	unsigned long sizes[SA_RB_MAX] = { 0 };
+	unsigned int i, j;
+	int err;
+
+	if (sa_opts.rb_size_auto) {
+		if (nr_cpus <= 0) {
+			fprintf(stderr, "Failed to get number of possible CPUs: %d\n", nr_cpus);
+			return nr_cpus ? nr_cpus : -EINVAL;
+		}
+
+		for (i = 0; i < SA_RB_MAX; i++)
+			sizes[i] = 1024UL * sa_rbs[i].auto_kb_per_cpu *
+				   rb_nr_event_classes(i) * nr_cpus;
+	}
+
+	for (i = 0; i < sa_opts.num_rb_size; i++) {
+		char *name = sa_opts.rb_size[i];
+		char *size = strchr(name, '=');
+		char *end_ptr;
+		size_t len;
+
+		if (!size) {
+			fprintf(stderr, "rb_size: expected RINGBUFFER=SIZE, got %s\n", name);
+			return -EINVAL;
+		}
+		len = size - name;
+		size++;
+
+		for (j = 0; j < SA_RB_MAX; j++) {
+			if (strlen(sa_rbs[j].name) == len && !strncmp(sa_rbs[j].name, name, len))
+				break;
+		}
+		if (j == SA_RB_MAX) {
+			fprintf(stderr, "rb_size: unknown ringbuffer %.*s\n", (int)len, name);
+			return -EINVAL;
+		}
+
+		errno = 0;
+		sizes[j] = strtoul(size, &end_ptr, 0) * 1024;
+		if (errno != 0 || end_ptr == size) {
+			fprintf(stderr, "rb_size: unsupported size %s\n", size);
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < SA_RB_MAX; i++) {
+		if (!sa_opts.rb_size_auto && !sizes[i])
+			continue;
+
+		sizes[i] = roundup_pow_of_two(sizes[i] < page_size ? page_size : sizes[i]);
+
+		err = bpf_map__set_max_entries(sa_rbs[i].map, sizes[i]);
+		if (err) {
+			fprintf(stderr, "Failed to resize %s ringbuffer: %d\n", sa_rbs[i].name, err);
+			return err;
+		}
+
+		pr_debug(stdout, "%s ringbuffer size: %lu KiB\n", sa_rbs[i].name, sizes[i] / 1024);
+	}
+
+	return 0;
+}
+
+/*
+ * Programs that come in raw_tp and tp_btf flavours. tp_btf reads kernel memory
+ * directly instead of going through bpf_probe_read_kernel() and is preferred
+ * when the kernel BTF describes the tracepoint.
+ */
+struct sa_tp_btf {
+	const char *tp;
+	struct bpf_program *raw;
+	struct bpf_program *btf;
+};
+
+#define SA_TP_BTF(tp, prog)	{ #tp, skel->progs.handle_##prog, skel->progs.handle_##prog##_btf }
+
+static void select_tp_btf(void)
+{
+	struct sa_tp_btf tps[] = {
+		SA_TP_BTF(pelt_se_tp, pelt_se),
+		SA_TP_BTF(sched_util_est_se_tp, util_est_se),
+		SA_TP_BTF(pelt_cfs_tp, pelt_cfs),
+		SA_TP_BTF(sched_util_est_cfs_tp, util_est_cfs),
+		SA_TP_BTF(pelt_rt_tp, pelt_rt),
+		SA_TP_BTF(pelt_dl_tp, pelt_dl),
+		SA_TP_BTF(pelt_irq_tp, pelt_irq),
+		SA_TP_BTF(pelt_thermal_tp, pelt_thermal),
+		SA_TP_BTF(sched_update_nr_running_tp, sched_update_nr_running),
+		SA_TP_BTF(sched_process_free, sched_process_free),
+		SA_TP_BTF(task_rename, task_rename),
+	};
+	struct btf *vmlinux_btf = btf__load_vmlinux_btf();
+	char name[128];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(tps) / sizeof(tps[0]); i++) {
+		bool use_btf = false;
+
+		if (vmlinux_btf && bpf_program__autoload(tps[i].raw)) {
+			snprintf(name, sizeof(name), "btf_trace_%s", tps[i].tp);
+			use_btf = btf__find_by_name_kind(vmlinux_btf, name, BTF_KIND_TYPEDEF) > 0;
+		}
+
+		bpf_program__set_autoload(tps[i].btf, use_btf);
+		if (use_btf)
+			bpf_program__set_autoload(tps[i].raw, false);
+
+		pr_debug(stdout, "%s: using %s\n", tps[i].tp, use_btf ? "tp_btf" : "raw_tp");
+	}
+
+	btf__free(vmlinux_btf);
+}
+
+/*
+ * Programs that come in fexit, optionally paired with fentry, and
+ * kprobe/kretprobe flavours. fentry/fexit are cheaper and preferred, but need
+ * the function in the kernel BTF with the prototype the programs expect, 0
+ * args when they don't care, and trampolines that can attach to it. Otherwise
+ * kprobes are attached to the function, or to its .isra/.constprop clone,
+ * found in kallsyms. Neither is used when BTF shows the prototype changed.
+ */
+struct sa_fexit {
+	const char *func;
+	unsigned int nr_args;
+	struct bpf_program *fentry;
+	struct bpf_program *fexit;
+	struct bpf_program *entry;
+	struct bpf_program *exit;
+};
+
+#define SA_FEXIT(func, nr_args)	{ #func, nr_args, NULL, skel->progs.handle_##func,	\
+				  skel->progs.handle_##func##_entry,			\
+				  skel->progs.handle_##func##_exit }
+
+#define SA_FENTRY_FEXIT(prog, func, nr_args)	{ #func, nr_args,			\
+						  skel->progs.handle_##prog##_fentry,	\
+						  skel->progs.handle_##prog##_fexit,	\
+						  skel->progs.handle_##prog##_entry,	\
+						  skel->progs.handle_##prog##_exit }
+
+/*
+ * libbpf attaches kprobes to the function in their SEC() name, clones are
+ * attached by hand once the skeleton is.
+ */
+#define MAX_CLONE_PROBES	32
+
+struct sa_clone_probe {
+	struct bpf_program *prog;
+	const char *func;
+	bool retprobe;
+	struct bpf_link *link;
+};
+
+static struct sa_clone_probe clone_probes[MAX_CLONE_PROBES];
+static unsigned int nr_clone_probes;
+
+static void add_clone_probe(struct bpf_program *prog, const char *func, bool retprobe)
+{
+	if (nr_clone_probes >= MAX_CLONE_PROBES) {
+		fprintf(stderr, "Too many clones to probe, dropping %s\n", func);
+		bpf_program__set_autoload(prog, false);
+		return;
+	}
+
+	bpf_program__set_autoattach(prog, false);
+	clone_probes[nr_clone_probes].prog = prog;
+	clone_probes[nr_clone_probes].func = func;
+	clone_probes[nr_clone_probes].retprobe = retprobe;
+	nr_clone_probes++;
+}
+
+static int attach_clone_probes(void)
+{
+	struct sa_clone_probe *probe;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nr_clone_probes; i++) {
+		probe = &clone_probes[i];
+
+		probe->link = bpf_program__attach_kprobe(probe->prog, probe->retprobe,
+							 probe->func);
+		if (!probe->link) {
+			err = -errno;
+			fprintf(stderr, "Failed to attach %s to %s: %d\n",
+				bpf_program__name(probe->prog), probe->func, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static void detach_clone_probes(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_clone_probes; i++) {
+		bpf_link__destroy(clone_probes[i].link);
+		clone_probes[i].link = NULL;
+	}
+
+	nr_clone_probes = 0;
+}
+
+/*
+ * Loading fexit programs only needs the function in BTF, attaching can still
+ * fail, eg: arm64 before 6.0 has no trampolines or the function is notrace.
+ * Find out with a program that does nothing.
+ */
+static bool fexit_attachable(int btf_id)
+{
+	struct bpf_insn insns[] = {
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 0 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	LIBBPF_OPTS(bpf_prog_load_opts, opts,
+		.expected_attach_type = BPF_TRACE_FEXIT,
+		.attach_btf_id = btf_id,
+	);
+	int prog_fd, link_fd;
+
+	prog_fd = bpf_prog_load(BPF_PROG_TYPE_TRACING, "sa_fexit_probe", "GPL",
+				insns, sizeof(insns) / sizeof(insns[0]), &opts);
+	if (prog_fd < 0)
+		return false;
+
+	link_fd = bpf_link_create(prog_fd, 0, BPF_TRACE_FEXIT, NULL);
+	if (link_fd >= 0)
+		close(link_fd);
+	close(prog_fd);
+
+	return link_fd >= 0;
+}
+
+static void select_fexit(void)
+{
+	struct sa_fexit funcs[] = {
+		SA_FEXIT(select_task_rq_fair, 3),
+		SA_FEXIT(find_energy_efficient_cpu, 2),
+		SA_FEXIT(sugov_update_single_freq, 3),
+		SA_FEXIT(sugov_update_shared, 3),
+		SA_FEXIT(teo_select, 3),
+		SA_FEXIT(menu_select, 3),
+		SA_FENTRY_FEXIT(nohz_idle_balance, _nohz_idle_balance, 0),
+		SA_FENTRY_FEXIT(run_rebalance_domains, run_rebalance_domains, 0),
+		SA_FENTRY_FEXIT(rebalance_domains, rebalance_domains, 0),
+		SA_FENTRY_FEXIT(balance_fair, balance_fair, 0),
+		SA_FENTRY_FEXIT(pick_next_task_fair, pick_next_task_fair, 0),
+		SA_FENTRY_FEXIT(newidle_balance, newidle_balance, 0),
+		SA_FENTRY_FEXIT(load_balance, load_balance, 5),
+		SA_FEXIT(find_busiest_group, 1),
+	};
+	struct btf *vmlinux_btf = btf__load_vmlinux_btf();
+	const struct btf_type *t;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
+		const char *kprobe_func = NULL;
+		bool use_fexit = false;
+		bool mismatch = false;
+		int id;
+
+		/* Disabled, so are the other flavours */
+		if (!bpf_program__autoload(funcs[i].fexit)) {
+			if (funcs[i].fentry)
+				bpf_program__set_autoload(funcs[i].fentry, false);
+			bpf_program__set_autoload(funcs[i].entry, false);
+			bpf_program__set_autoload(funcs[i].exit, false);
+			continue;
+		}
+
+		if (vmlinux_btf) {
+			id = btf__find_by_name_kind(vmlinux_btf, funcs[i].func, BTF_KIND_FUNC);
+			if (id > 0) {
+				t = btf__type_by_id(vmlinux_btf, id);
+				t = btf__type_by_id(vmlinux_btf, t->type);
+				mismatch = !t || (funcs[i].nr_args &&
+						  btf_vlen(t) != funcs[i].nr_args);
+				use_fexit = !mismatch && fexit_attachable(id);
+			}
+		}
+
+		/* kprobes would read the args of the old prototype just the same */
+		if (mismatch)
+			fprintf(stderr, "%s() prototype changed, can't trace it\n", funcs[i].func);
+
+		if (!use_fexit && !mismatch) {
+			parse_kallsyms();
+			kprobe_func = find_kallsyms_function(funcs[i].func);
+			if (!kprobe_func)
+				fprintf(stderr, "%s() not found, can't trace it\n", funcs[i].func);
+		}
+
+		if (funcs[i].fentry)
+			bpf_program__set_autoload(funcs[i].fentry, use_fexit);
+		bpf_program__set_autoload(funcs[i].fexit, use_fexit);
+		bpf_program__set_autoload(funcs[i].entry, !!kprobe_func);
+		bpf_program__set_autoload(funcs[i].exit, !!kprobe_func);
+
+		if (kprobe_func && strcmp(kprobe_func, funcs[i].func)) {
+			add_clone_probe(funcs[i].entry, kprobe_func, false);
+			add_clone_probe(funcs[i].exit, kprobe_func, true);
+		}
+
+		pr_debug(stdout, "%s: using %s\n", funcs[i].func,
+			 use_fexit ? "fexit" : kprobe_func ? kprobe_func : "nothing");
+	}
+
+	btf__free(vmlinux_btf);
+}
+
+/*
+ * Maps indexed by cpu are sized by userspace to @per_cpu entries for each
+ * possible CPU when the options using them are enabled, they are left with a
+ * single entry otherwise.
+ */
+struct sa_cpu_map {
+	struct bpf_map *map;
+	bool enabled;
+	unsigned int per_cpu;
+};
+
+static int set_cpu_map_size(struct sa_cpu_map *m)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	int err;
+
+	if (!m->enabled)
+		return 0;
+
+	if (nr_cpus <= 0) {
+		fprintf(stderr, "Failed to get number of possible CPUs: %d\n", nr_cpus);
+		return nr_cpus;
+	}
+
+	err = bpf_map__set_max_entries(m->map, nr_cpus * m->per_cpu);
+	if (err)
+		fprintf(stderr, "Failed to resize %s: %d\n", bpf_map__name(m->map), err);
+
+	return err;
+}
+
+static int set_cpu_map_sizes(void)
+{
+	struct sa_cpu_map maps[] = {
+		/* Last PELT signals emitted for each rq */
+		{ skel->maps.rq_pelt_last, sa_opts.pelt_deadband || sa_opts.pelt_min_interval,
+		  PELT_NR_RQ_TYPES },
+		/* Two slots of --histogram buckets for each rq */
+		{ skel->maps.rq_pelt_hist, sa_opts.histogram, 2 * PELT_HIST_NR_SIGNALS },
+		/* --residency totals, and the time at each frequency with --cpu_freq */
+		{ skel->maps.cpu_residency, sa_opts.residency || sa_opts.cpu_freq, 1 },
+		/* What each CPU runs for --cpu_freq */
+		{ skel->maps.cpu_freq_task, sa_opts.cpu_freq, 1 },
+		/* --sugov counters of each policy, indexed by policy->cpu */
+		{ skel->maps.sugov_stats, sa_opts.sugov, 1 },
+		/* Last balance_interval sent for each domain of each CPU */
+		{ skel->maps.lb_sd_interval, sa_opts.load_balance, MAX_SD_LEVELS },
+	};
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < sizeof(maps) / sizeof(maps[0]); i++) {
+		err = set_cpu_map_size(&maps[i]);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static bool pelt_hist_empty(const struct pelt_hist *hist)
+{
+	int i;
+
+	for (i = 0; i < PELT_HIST_NR_BUCKETS; i++) {
+		if (hist->buckets[i])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * pelt_hist_start is the start of the interval BPF is counting into. The
+ * previous interval, [pelt_hist_pending_start, pelt_hist_pending_end], sits
+ * in the other slot until the next sample.
+ */
+static unsigned long long pelt_hist_start;
+static unsigned long long pelt_hist_pending_start, pelt_hist_pending_end;
+
+static void sample_rq_pelt_hist(unsigned int slot, uint64_t start, uint64_t end)
+{
+	int fd = bpf_map__fd(skel->maps.rq_pelt_hist);
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct pelt_hist hist, zero = { 0 };
+	int cpu, signal;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		for (signal = 0; signal < PELT_HIST_NR_SIGNALS; signal++) {
+			int key = (cpu * 2 + slot) * PELT_HIST_NR_SIGNALS + signal;
+
+			if (bpf_map_lookup_elem(fd, &key, &hist) || pelt_hist_empty(&hist))
+				continue;
+
+			trace_cpu_pelt_hist(start, end, cpu, signal, hist.buckets);
+			bpf_map_update_elem(fd, &key, &zero, BPF_ANY);
+		}
+	}
+}
+
+static void sample_task_pelt_hist(unsigned int slot, uint64_t start, uint64_t end)
+{
+	int fd = bpf_map__fd(skel->maps.task_pelt_hist);
+	struct task_pelt_hist_key *keys = NULL, *prev = NULL, key;
+	unsigned int nr_keys = 0, max_keys = 0, i;
+	struct pelt_hist hist;
+	char comm[TASK_COMM_LEN];
+
+	/*
+	 * Deleting while walking the map restarts the walk, collect the keys
+	 * of this slot first.
+	 */
+	while (!bpf_map_get_next_key(fd, prev, &key)) {
+		if (key.slot == slot) {
+			if (nr_keys == max_keys) {
+				void *tmp;
+
+				max_keys = max_keys ? max_keys * 2 : 1024;
+				tmp = realloc(keys, max_keys * sizeof(*keys));
+				if (!tmp) {
+					fprintf(stderr, "Failed to allocate task histogram keys\n");
+					break;
+				}
+				keys = tmp;
+			}
+			keys[nr_keys++] = key;
+		}
+		prev = &key;
+	}
+
+	for (i = 0; i < nr_keys; i++) {
+		if (bpf_map_lookup_elem(fd, &keys[i], &hist))
+			continue;
+
+		task_comm_get(keys[i].pid, comm);
+		trace_task_pelt_hist(start, end, comm, keys[i].pid,
+				     keys[i].signal, hist.buckets);
+		bpf_map_delete_elem(fd, &keys[i]);
+
+		/* No exit events in this mode, forget the comm once it's gone */
+		if (kill(keys[i].pid, 0) && errno == ESRCH)
+			task_comm_exit(keys[i].pid);
+	}
+
+	free(keys);
+}
+
+static void emit_pelt_hist(unsigned int slot)
+{
+	if (!pelt_hist_pending_end)
+		return;
+
+	sample_rq_pelt_hist(slot, pelt_hist_pending_start, pelt_hist_pending_end);
+	sample_task_pelt_hist(slot, pelt_hist_pending_start, pelt_hist_pending_end);
+
+	pelt_hist_pending_end = 0;
+}
+
+/*
+ * Start a new interval and emit the one before the last. BPF is switched to
+ * the other slot, which was left one interval ago, so any update that raced
+ * with that switch has landed by the time we read and reset it. The interval
+ * that just ended is emitted on the next call.
+ */
+static void sample_pelt_hist(void)
+{
+	unsigned int slot = skel->bss->sa_runtime.hist_slot & 1;
+	struct timespec now;
+	uint64_t ts;
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	/* First interval starts with the trace */
+	if (!pelt_hist_start) {
+		pelt_hist_start = ts;
+		return;
+	}
+
+	emit_pelt_hist(!slot);
+
+	skel->bss->sa_runtime.hist_slot = !slot;
+
+	pelt_hist_pending_start = pelt_hist_start;
+	pelt_hist_pending_end = ts;
+	pelt_hist_start = ts;
+}
+
+/*
+ * Emit everything once BPF is paused, nothing writes to either slot anymore.
+ */
+static void flush_pelt_hist(void)
+{
+	unsigned int slot = skel->bss->sa_runtime.hist_slot & 1;
+
+	sample_pelt_hist();
+	emit_pelt_hist(slot);
+}
+
+/*
+ * cpu_frequency only fires on changes, start from the current frequency of
+ * each CPU instead of waiting for the first one.
+ */
+static void seed_cpu_freq(void)
+{
+	int residency_fd = bpf_map__fd(skel->maps.cpu_residency);
+	int task_fd = bpf_map__fd(skel->maps.cpu_freq_task);
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct cpu_residency r;
+	struct cpu_freq_task c;
+	struct timespec now;
+	char path[64];
+	unsigned int freq;
+	uint64_t ts;
+	FILE *fp;
+	int cpu;
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (fscanf(fp, "%u", &freq) != 1)
+			freq = 0;
+		fclose(fp);
+		if (!freq)
+			continue;
+
+		if (!bpf_map_lookup_elem(residency_fd, &cpu, &r)) {
+			r.freq = freq;
+			r.freq_ts = ts;
+			bpf_map_update_elem(residency_fd, &cpu, &r, BPF_ANY);
+		}
+
+		if (!bpf_map_lookup_elem(task_fd, &cpu, &c)) {
+			c.freq = freq;
+			bpf_map_update_elem(task_fd, &cpu, &c, BPF_ANY);
+		}
+	}
+}
+
+static char residency_path[PATH_MAX];
+
+static void write_freq_residency(FILE *fp, struct cpu_residency *r, int nr_cpus,
+				 uint64_t ts)
+{
+	int fd = bpf_map__fd(skel->maps.freq_residency);
+	struct freq_residency_key key, *prev = NULL;
+	bool *seen = calloc(nr_cpus, sizeof(*seen));
+	unsigned long long total;
+	int cpu;
+
+	if (!seen)
+		return;
+
+	while (!bpf_map_get_next_key(fd, prev, &key)) {
+		prev = &key;
+
+		if (key.cpu < 0 || key.cpu >= nr_cpus)
+			continue;
+		if (bpf_map_lookup_elem(fd, &key, &total))
+			continue;
+
+		if (r[key.cpu].freq_ts && r[key.cpu].freq == key.freq) {
+			total += ts - r[key.cpu].freq_ts;
+			seen[key.cpu] = true;
+		}
+		fprintf(fp, "%d,freq,%u,%llu\n", key.cpu, key.freq, total);
+	}
+
+	/* Still at the first frequency seen */
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (r[cpu].freq_ts && !seen[cpu])
+			fprintf(fp, "%d,freq,%u,%llu\n", cpu, r[cpu].freq,
+				(unsigned long long)(ts - r[cpu].freq_ts));
+	}
+
+	free(seen);
+}
+
+/*
+ * csv tables are replaced atomically so that they are always complete, write
+ * into a temporary file and commit it with close_csv_file().
+ */
+static FILE *open_csv_file(char *path, size_t size, char *tmp_path,
+			  size_t tmp_size, const char *suffix)
+{
+	FILE *fp;
+
+	if (!path[0])
+		snprintf(path, size, "%s/%s.%s.csv", sa_opts.output_path,
+			 sa_opts.output, suffix);
+	snprintf(tmp_path, tmp_size, "%s.tmp", path);
+
+	fp = fopen(tmp_path, "w");
+	if (!fp)
+		fprintf(stderr, "Failed to create %s: %d\n", tmp_path, -errno);
+
+	return fp;
+}
+
+static void close_csv_file(FILE *fp, const char *path, const char *tmp_path)
+{
+	fclose(fp);
+
+	if (rename(tmp_path, path))
+		fprintf(stderr, "Failed to write %s: %d\n", path, -errno);
+}
+
+/*
+ * Dump --residency totals as a cpu,type,state,time_ns table. idle states are
+ * -1 for time spent out of idle, util states are the lower bound of the
+ * bucket.
+ */
+static void write_residency(void)
+{
+	int fd = bpf_map__fd(skel->maps.cpu_residency);
+	int nr_cpus = libbpf_num_possible_cpus();
+	char tmp_path[PATH_MAX + 4];
+	struct cpu_residency *r;
+	struct timespec now;
+	uint64_t ts;
+	FILE *fp;
+	int cpu, i;
+
+	r = calloc(nr_cpus, sizeof(*r));
+	if (!r)
+		return;
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		bpf_map_lookup_elem(fd, &cpu, &r[cpu]);
+
+	fp = open_csv_file(residency_path, sizeof(residency_path),
+			   tmp_path, sizeof(tmp_path), "residency");
+	if (!fp) {
+		free(r);
+		return;
+	}
+
+	fprintf(fp, "cpu,type,state,time_ns\n");
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		for (i = 0; i <= SA_MAX_IDLE_STATES; i++) {
+			unsigned long long total = r[cpu].idle[i];
+
+			if (r[cpu].idle_ts && r[cpu].idle_idx == i)
+				total += ts - r[cpu].idle_ts;
+			if (total)
+				fprintf(fp, "%d,idle,%d,%llu\n", cpu, i - 1, total);
+		}
+
+		for (i = 0; i < PELT_HIST_NR_BUCKETS; i++) {
+			unsigned long long total = r[cpu].util[i];
+
+			if (r[cpu].util_ts && r[cpu].util_bucket == i)
+				total += ts - r[cpu].util_ts;
+			if (total)
+				fprintf(fp, "%d,util,%d,%llu\n", cpu,
+					i * PELT_HIST_BUCKET_WIDTH, total);
+		}
+	}
+
+	write_freq_residency(fp, r, nr_cpus, ts);
+
+	close_csv_file(fp, residency_path, tmp_path);
+	free(r);
+}
+
+static char task_freq_path[PATH_MAX];
+
+/*
+ * Rows of tasks that exited, moved out of task_freq_residency so that the map
+ * only holds live tasks. They're summed per comm and frequency so that
+ * short lived tasks don't grow the table forever.
+ */
+struct task_freq_exited {
+	char comm[TASK_COMM_LEN];
+	unsigned int freq;
+	unsigned long long total;
+};
+
+static struct task_freq_exited *task_freq_exited;
+static unsigned int nr_task_freq_exited, max_task_freq_exited;
+
+static bool task_exited(pid_t pid)
+{
+	return kill(pid, 0) && errno == ESRCH;
+}
+
+static void task_freq_retire(const struct task_freq_residency_key *key,
+			     unsigned long long total)
+{
+	char comm[TASK_COMM_LEN];
+	struct task_freq_exited *e;
+	unsigned int i;
+
+	task_comm_get(key->pid, comm);
+	task_comm_exit(key->pid);
+
+	for (i = 0; i < nr_task_freq_exited; i++) {
+		e = &task_freq_exited[i];
+		if (e->freq == key->freq && !strcmp(e->comm, comm)) {
+			e->total += total;
+			return;
+		}
+	}
+
+	if (nr_task_freq_exited == max_task_freq_exited) {
+		unsigned int max = max_task_freq_exited ? max_task_freq_exited * 2 : 1024;
+		void *tmp;
+
+		tmp = realloc(task_freq_exited, max * sizeof(*task_freq_exited));
+		if (!tmp) {
+			fprintf(stderr, "Failed to allocate exited task frequency residency\n");
+			return;
+		}
+		task_freq_exited = tmp;
+		max_task_freq_exited = max;
+	}
+
+	e = &task_freq_exited[nr_task_freq_exited++];
+	memcpy(e->comm, comm, TASK_COMM_LEN);
+	e->freq = key->freq;
+	e->total = total;
+}
+
+/*
+ * BPF only accounts the time a CPU spent running a task on the next switch or
+ * frequency change. Charge what's left once BPF is paused.
+ */
+static void flush_task_freq_residency(void)
+{
+	int residency_fd = bpf_map__fd(skel->maps.task_freq_residency);
+	int task_fd = bpf_map__fd(skel->maps.cpu_freq_task);
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct task_freq_residency_key key;
+	unsigned long long total;
+	struct cpu_freq_task c;
+	struct timespec now;
+	uint64_t ts;
+	int cpu;
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (bpf_map_lookup_elem(task_fd, &cpu, &c))
+			continue;
+		if (!c.pid || !c.freq || !c.ts || ts < c.ts)
+			continue;
+
+		key.pid = c.pid;
+		key.freq = c.freq;
+		if (bpf_map_lookup_elem(residency_fd, &key, &total))
+			total = 0;
+		total += ts - c.ts;
+		bpf_map_update_elem(residency_fd, &key, &total, BPF_ANY);
+
+		c.ts = ts;
+		bpf_map_update_elem(task_fd, &cpu, &c, BPF_ANY);
+	}
+}
+
+/*
+ * Dump --cpu_freq time each task ran at each frequency as a
+ * pid,comm,freq,time_ns table. Time since the last switch or frequency change
+ * is accounted on the next one.
+ *
+ * Tasks that exited are moved out of the map as they're found, there are no
+ * exit events for this in BPF as a task has one entry per frequency. They're
+ * written with a pid of -1, summed per comm.
+ */
+static void write_task_freq_residency(void)
+{
+	int fd = bpf_map__fd(skel->maps.task_freq_residency);
+	struct task_freq_residency_key key, *prev = NULL;
+	struct task_freq_residency_key *exited = NULL;
+	unsigned int nr_exited = 0, max_exited = 0, i;
+	char tmp_path[PATH_MAX + 4];
+	char comm[TASK_COMM_LEN];
+	unsigned long long total;
+	pid_t last_pid = 0;
+	bool last_exited = false;
+	FILE *fp;
+
+	fp = open_csv_file(task_freq_path, sizeof(task_freq_path),
+			   tmp_path, sizeof(tmp_path), "task_freq");
+	if (!fp)
+		return;
+
+	fprintf(fp, "pid,comm,freq,time_ns\n");
+
+	while (!bpf_map_get_next_key(fd, prev, &key)) {
+		prev = &key;
+
+		if (bpf_map_lookup_elem(fd, &key, &total))
+			continue;
+
+		task_comm_get(key.pid, comm);
+		fprintf(fp, "%d,%s,%u,%llu\n", key.pid, comm, key.freq, total);
+
+		if (key.pid != last_pid) {
+			last_pid = key.pid;
+			last_exited = task_exited(key.pid);
+		}
+		if (!last_exited)
+			continue;
+
+		/* Deleting while walking the map restarts the walk */
+		if (nr_exited == max_exited) {
+			void *tmp;
+
+			max_exited = max_exited ? max_exited * 2 : 64;
+			tmp = realloc(exited, max_exited * sizeof(*exited));
+			if (!tmp)
+				continue;
+			exited = tmp;
+		}
+		exited[nr_exited++] = key;
+	}
+
+	for (i = 0; i < nr_task_freq_exited; i++)
+		fprintf(fp, "-1,%s,%u,%llu\n", task_freq_exited[i].comm,
+			task_freq_exited[i].freq, task_freq_exited[i].total);
+
+	close_csv_file(fp, task_freq_path, tmp_path);
+
+	for (i = 0; i < nr_exited; i++) {
+		if (bpf_map_lookup_elem(fd, &exited[i], &total))
+			continue;
+		task_freq_retire(&exited[i], total);
+		bpf_map_delete_elem(fd, &exited[i]);
+	}
+
+	free(exited);
+}
+
+static const char * const softirq_names[SA_NR_SOFTIRQS] = {
+	"hi", "timer", "net_tx", "net_rx", "block",
+	"irq_poll", "tasklet", "sched", "hrtimer", "rcu",
+};
+
+static void write_duration_stats_header(FILE *fp, const char *columns)
+{
+	int i;
+
+	fprintf(fp, "%s,count,time_ns", columns);
+	for (i = 0; i < DURATION_HIST_NR_BUCKETS; i++)
+		fprintf(fp, ",%luus", i ? 1UL << i : 0);
+	fprintf(fp, "\n");
+}
+
+static void write_duration_stats(FILE *fp, const struct duration_stats *stats)
+{
+	int i;
+
+	fprintf(fp, ",%llu,%llu", stats->count, stats->time);
+	for (i = 0; i < DURATION_HIST_NR_BUCKETS; i++)
+		fprintf(fp, ",%llu", stats->buckets[i]);
+	fprintf(fp, "\n");
+}
+
+static char softirq_path[PATH_MAX];
+
+/*
+ * Dump --softirq statistics as a cpu,softirq,count,time_ns table followed by
+ * the duration histogram, one column per bucket named after its lower bound.
+ */
+static void write_softirq_stats(void)
+{
+	int fd = bpf_map__fd(skel->maps.softirq_stats);
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct duration_stats *stats;
+	char tmp_path[PATH_MAX + 4];
+	int vec, cpu;
+	FILE *fp;
+
+	stats = calloc(nr_cpus, sizeof(*stats));
+	if (!stats)
+		return;
+
+	fp = open_csv_file(softirq_path, sizeof(softirq_path),
+			   tmp_path, sizeof(tmp_path), "softirq");
+	if (!fp) {
+		free(stats);
+		return;
+	}
+
+	write_duration_stats_header(fp, "cpu,softirq");
+
+	for (vec = 0; vec < SA_NR_SOFTIRQS; vec++) {
+		if (bpf_map_lookup_elem(fd, &vec, stats))
+			continue;
+
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (!stats[cpu].count)
+				continue;
+
+			fprintf(fp, "%d,%s", cpu, softirq_names[vec]);
+			write_duration_stats(fp, &stats[cpu]);
+		}
+	}
+
+	close_csv_file(fp, softirq_path, tmp_path);
+	free(stats);
+}
+
+static char lb_stats_path[PATH_MAX];
+
+/*
+ * Dump --load_balance_stats as a cpu,phase,level table with what
+ * load_balance() achieved and how many tasks it moved, followed by the
+ * duration histogram.
+ */
+static void write_lb_stats(void)
+{
+	int fd = bpf_map__fd(skel->maps.lb_stats);
+	int nr_cpus = libbpf_num_possible_cpus();
+	char tmp_path[PATH_MAX + 4];
+	struct lb_stats *stats;
+	int key, cpu;
+	FILE *fp;
+
+	stats = calloc(nr_cpus, sizeof(*stats));
+	if (!stats)
+		return;
+
+	fp = open_csv_file(lb_stats_path, sizeof(lb_stats_path),
+			   tmp_path, sizeof(tmp_path), "load_balance");
+	if (!fp) {
+		free(stats);
+		return;
+	}
+
+	write_duration_stats_header(fp, "cpu,phase,level,balanced,pulled,failed,moved");
+
+	for (key = 0; key < LB_STATS_NR_KEYS; key++) {
+		if (bpf_map_lookup_elem(fd, &key, stats))
+			continue;
+
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			struct lb_stats *s = &stats[cpu];
+
+			if (!s->duration.count)
+				continue;
+
+			fprintf(fp, "%d,%s,%d,%llu,%llu,%llu,%llu", cpu,
+				lb_phase_names[key / MAX_SD_LEVELS], key % MAX_SD_LEVELS,
+				s->outcome[LB_BALANCED], s->outcome[LB_PULLED],
+				s->outcome[LB_FAILED], s->nr_moved);
+			write_duration_stats(fp, &s->duration);
+		}
+	}
+
+	close_csv_file(fp, lb_stats_path, tmp_path);
+	free(stats);
+}
+
+struct ipi_count {
+	struct ipi_key key;
+	unsigned long long count;
+};
+
+struct ipi_sym {
+	unsigned long long address;
+	const char *name;
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	unsigned long long i = *(const unsigned long long *)a;
+	unsigned long long j = *(const unsigned long long *)b;
+
+	return i < j ? -1 : i > j;
+}
+
+/* By from_cpu, callsite then callback */
+static int cmp_ipi_callback(const void *a, const void *b)
+{
+	const struct ipi_key *i = &((const struct ipi_count *)a)->key;
+	const struct ipi_key *j = &((const struct ipi_count *)b)->key;
+
+	if (i->from_cpu != j->from_cpu)
+		return i->from_cpu - j->from_cpu;
+	if (i->callsite != j->callsite)
+		return i->callsite < j->callsite ? -1 : 1;
+	if (i->callback != j->callback)
+		return i->callback < j->callback ? -1 : 1;
+	return 0;
+}
+
+/* By from_cpu then the most IPIs first */
+static int cmp_ipi_top(const void *a, const void *b)
+{
+	const struct ipi_count *i = a;
+	const struct ipi_count *j = b;
+
+	if (i->key.from_cpu != j->key.from_cpu)
+		return i->key.from_cpu - j->key.from_cpu;
+	if (i->count != j->count)
+		return i->count > j->count ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Symbolize each address in @counts once. Returns the number of unique
+ * addresses in @syms, sorted so they can be looked up with bsearch().
+ */
+static unsigned int ipi_syms_build(const struct ipi_count *counts, unsigned int nr,
+				   struct ipi_sym *syms)
+{
+	unsigned long long *addresses;
+	unsigned int i, nr_syms = 0;
+
+	addresses = calloc(2 * nr, sizeof(*addresses));
+	if (!addresses)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		addresses[2 * i] = counts[i].key.callsite;
+		addresses[2 * i + 1] = counts[i].key.callback;
+	}
+
+	qsort(addresses, 2 * nr, sizeof(*addresses), cmp_u64);
+
+	for (i = 0; i < 2 * nr; i++) {
+		if (nr_syms && syms[nr_syms - 1].address == addresses[i])
+			continue;
+
+		syms[nr_syms].address = addresses[i];
+		syms[nr_syms].name = find_kallsyms((void *)(unsigned long)addresses[i]);
+		nr_syms++;
+	}
+
+	free(addresses);
+
+	return nr_syms;
+}
+
+static void write_ipi_sym(FILE *fp, const struct ipi_sym *syms, unsigned int nr_syms,
+			  unsigned long long address)
+{
+	const struct ipi_sym *sym;
+
+	/* syms start with their address, compare them as such */
+	sym = bsearch(&address, syms, nr_syms, sizeof(*syms), cmp_u64);
+	if (sym && sym->name)
+		fprintf(fp, ",%s", sym->name);
+	else
+		fprintf(fp, ",0x%llx", address);
+}
+
+static char ipi_matrix_path[PATH_MAX];
+static char ipi_callbacks_path[PATH_MAX];
+
+/*
+ * Dump --ipi_matrix as a from_cpu x target_cpu table ready to be plotted as a
+ * heatmap, and the --ipi_top callsite and callback pairs that sent the most
+ * IPIs from each CPU.
+ */
+static void write_ipi_stats(void)
+{
+	int fd = bpf_map__fd(skel->maps.ipi_matrix);
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct ipi_key key, *prev_key = NULL;
+	unsigned int nr = 0, nr_syms, i, j;
+	char tmp_path[PATH_MAX + 4];
+	struct ipi_count *counts;
+	unsigned long long *matrix;
+	struct ipi_sym *syms;
+	int cpu, rank;
+	FILE *fp;
+
+	counts = calloc(IPI_MATRIX_MAX_ENTRIES, sizeof(*counts));
+	matrix = calloc(nr_cpus * nr_cpus, sizeof(*matrix));
+	syms = calloc(2 * IPI_MATRIX_MAX_ENTRIES, sizeof(*syms));
+	if (!counts || !matrix || !syms)
+		goto out;
+
+	while (nr < IPI_MATRIX_MAX_ENTRIES &&
+	       !bpf_map_get_next_key(fd, prev_key, &key)) {
+		prev_key = &key;
+
+		if (bpf_map_lookup_elem(fd, &key, &counts[nr].count))
+			continue;
+		if (key.from_cpu >= nr_cpus || key.target_cpu >= nr_cpus)
+			continue;
+
+		counts[nr].key = key;
+		matrix[key.from_cpu * nr_cpus + key.target_cpu] += counts[nr].count;
+		nr++;
+	}
+
+	fp = open_csv_file(ipi_matrix_path, sizeof(ipi_matrix_path),
+			   tmp_path, sizeof(tmp_path), "ipi_matrix");
+	if (fp) {
+		fprintf(fp, "from_cpu");
+		for (cpu = 0; cpu < nr_cpus; cpu++)
+			fprintf(fp, ",%d", cpu);
+		fprintf(fp, "\n");
+
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			fprintf(fp, "%d", cpu);
+			for (i = 0; i < (unsigned int)nr_cpus; i++)
+				fprintf(fp, ",%llu", matrix[cpu * nr_cpus + i]);
+			fprintf(fp, "\n");
+		}
+
+		close_csv_file(fp, ipi_matrix_path, tmp_path);
+	}
+
+	/* Sum target CPUs of each from_cpu, callsite, callback */
+	qsort(counts, nr, sizeof(*counts), cmp_ipi_callback);
+	for (i = 0, j = 0; i < nr; i++) {
+		if (j && !cmp_ipi_callback(&counts[j - 1], &counts[i])) {
+			counts[j - 1].count += counts[i].count;
+			continue;
+		}
+		counts[j++] = counts[i];
+	}
+	nr = j;
+
+	qsort(counts, nr, sizeof(*counts), cmp_ipi_top);
+	nr_syms = ipi_syms_build(counts, nr, syms);
+
+	fp = open_csv_file(ipi_callbacks_path, sizeof(ipi_callbacks_path),
+			   tmp_path, sizeof(tmp_path), "ipi_callbacks");
+	if (!fp)
+		goto out;
+
+	fprintf(fp, "cpu,rank,callback,callsite,count\n");
+
+	for (i = 0, rank = 0; i < nr; i++) {
+		if (i && counts[i].key.from_cpu != counts[i - 1].key.from_cpu)
+			rank = 0;
+		if (++rank > (int)sa_opts.ipi_top)
+			continue;
+
+		fprintf(fp, "%d,%d", counts[i].key.from_cpu, rank);
+		write_ipi_sym(fp, syms, nr_syms, counts[i].key.callback);
+		write_ipi_sym(fp, syms, nr_syms, counts[i].key.callsite);
+		fprintf(fp, ",%llu\n", counts[i].count);
+	}
+
+	close_csv_file(fp, ipi_callbacks_path, tmp_path);
+out:
+	free(counts);
+	free(matrix);
+	free(syms);
+}
+
+/*
+ * Name of the first handler of @irq, commas are replaced to keep the csv sane.
+ */
+static void irq_name(int irq, char *name, size_t size)
+{
+	char path[64];
+	FILE *fp;
+	char *c;
+
+	snprintf(path, sizeof(path), "/sys/kernel/irq/%d/actions", irq);
+	fp = fopen(path, "r");
+	if (!fp || !fgets(name, size, fp) || name[0] == '\n')
+		snprintf(name, size, "irq%d", irq);
+	if (fp)
+		fclose(fp);
+
+	name[strcspn(name, "\n")] = '\0';
+	for (c = name; *c; c++) {
+		if (*c == ',')
+			*c = ' ';
+	}
+}
+
+static char irq_path[PATH_MAX];
+
+/*
+ * Dump --irq statistics as a cpu,irq,name,count,time_ns table followed by the
+ * duration histogram.
+ */
+static void write_irq_stats(void)
+{
+	int fd = bpf_map__fd(skel->maps.irq_stats);
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct duration_stats *stats;
+	char tmp_path[PATH_MAX + 4];
+	int irq, *prev = NULL, cpu;
+	char name[IRQ_NAME_LEN];
+	FILE *fp;
+
+	stats = calloc(nr_cpus, sizeof(*stats));
+	if (!stats)
+		return;
+
+	fp = open_csv_file(irq_path, sizeof(irq_path),
+			   tmp_path, sizeof(tmp_path), "irq");
+	if (!fp) {
+		free(stats);
+		return;
+	}
+
+	write_duration_stats_header(fp, "cpu,irq,name");
+
+	while (!bpf_map_get_next_key(fd, prev, &irq)) {
+		prev = &irq;
+
+		if (bpf_map_lookup_elem(fd, &irq, stats))
+			continue;
+
+		irq_name(irq, name, sizeof(name));
+
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (!stats[cpu].count)
+				continue;
+
+			fprintf(fp, "%d,%d,%s", cpu, irq, name);
+			write_duration_stats(fp, &stats[cpu]);
+		}
+	}
+
+	close_csv_file(fp, irq_path, tmp_path);
+	free(stats);
+}
+
+#define CGROUP_ROOT	"/sys/fs/cgroup"
+
+/*
+ * cgroup ids are the inode numbers of their directory in cgroupfs. The whole
+ * hierarchy is cached and walked again when an id is missing. Ids still
+ * missing after a walk belong to cgroups that are gone and are remembered so
+ * that they don't cause a walk every time a table is written.
+ */
+struct cgroup_name {
+	unsigned long long id;
+	char *path;
+};
+
+static struct cgroup_name *cgroup_names;
+static unsigned int nr_cgroup_names;
+static unsigned long long *cgroup_dead;
+static unsigned int nr_cgroup_dead;
+
+static bool cgroup_is_dead(unsigned long long id)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_cgroup_dead; i++) {
+		if (cgroup_dead[i] == id)
+			return true;
+	}
+
+	return false;
+}
+
+static void cgroup_set_dead(unsigned long long id)
+{
+	unsigned long long *dead;
+
+	dead = realloc(cgroup_dead, (nr_cgroup_dead + 1) * sizeof(*dead));
+	if (!dead)
+		return;
+
+	cgroup_dead = dead;
+	cgroup_dead[nr_cgroup_dead++] = id;
+}
+
+static void cgroup_names_clear(void)
 {
 	unsigned int i;
 
-	if (!sa_opts.num_pids && !sa_opts.num_comms)
-		return false;
+	for (i = 0; i < nr_cgroup_names; i++)
+		free(cgroup_names[i].path);
+	free(cgroup_names);
+	cgroup_names = NULL;
+	nr_cgroup_names = 0;
+}
 
-	for (i = 0; i < sa_opts.num_pids; i++)
-		if (sa_opts.pid[i] == pid)
-			return false;
+static void cgroup_names_scan(char *path, size_t len, size_t size)
+{
+	const char *name = path + strlen(CGROUP_ROOT);
+	struct cgroup_name *names;
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
 
-	for (i = 0; i < sa_opts.num_comms; i++)
-		if (strstr(comm, sa_opts.comm[i]))
-			return false;
+	if (stat(path, &st))
+		return;
 
-	return true;
+	names = realloc(cgroup_names, (nr_cgroup_names + 1) * sizeof(*names));
+	if (!names)
+		return;
+
+	cgroup_names = names;
+	cgroup_names[nr_cgroup_names].id = st.st_ino;
+	cgroup_names[nr_cgroup_names].path = strdup(name[0] ? name : "/");
+	if (!cgroup_names[nr_cgroup_names].path)
+		return;
+	nr_cgroup_names++;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		int n;
+
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
+			continue;
+
+		n = snprintf(path + len, size - len, "/%s", entry->d_name);
+		if (n < 0 || (size_t)n >= size - len)
+			continue;
+
+		cgroup_names_scan(path, len + n, size);
+	}
+	path[len] = '\0';
+
+	closedir(dir);
 }
 
-static int handle_rq_pelt_event(void *ctx, void *data, size_t data_sz)
+static const char *__cgroup_name(unsigned long long id)
 {
-	struct rq_pelt_event *e = data;
+	unsigned int i;
+
+	for (i = 0; i < nr_cgroup_names; i++) {
+		if (cgroup_names[i].id == id)
+			return cgroup_names[i].path;
+	}
+
+	return NULL;
+}
+
+/*
+ * @refreshed limits the walk to once per table when several new cgroups show
+ * up at once.
+ */
+static const char *cgroup_name(unsigned long long id, bool *refreshed)
+{
+	char path[PATH_MAX];
+	const char *name;
+
+	name = __cgroup_name(id);
+	if (name)
+		return name;
+
+	if (cgroup_is_dead(id) || *refreshed)
+		return "?";
+
+	*refreshed = true;
+	cgroup_names_clear();
+	snprintf(path, sizeof(path), "%s", CGROUP_ROOT);
+	cgroup_names_scan(path, strlen(path), sizeof(path));
 
-	if (sa_opts.load_avg_cpu && e->load_avg != -1)
-		trace_cpu_load_avg(e->ts, e->cpu, e->load_avg);
+	name = __cgroup_name(id);
+	if (name)
+		return name;
 
-	if (sa_opts.runnable_avg_cpu && e->runnable_avg != -1)
-		trace_cpu_runnable_avg(e->ts, e->cpu, e->runnable_avg);
+	/* Dead cgroups never show up again */
+	cgroup_set_dead(id);
 
-	if (e->type == PELT_TYPE_THERMAL){
-		if (sa_opts.load_avg_thermal)
-			trace_cpu_load_avg_thermal(e->ts, e->cpu, e->load_avg);
+	return "?";
+}
+
+/*
+ * Name of idle state @state as seen by sysfs, commas are replaced to keep the
+ * csv sane.
+ */
+static void read_idle_state_name(int cpu, int state, char *name, size_t size)
+{
+	char path[96];
+	FILE *fp;
+	char *c;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name", cpu, state);
+	fp = fopen(path, "r");
+	if (!fp || !fgets(name, size, fp) || name[0] == '\n')
+		snprintf(name, size, "state%d", state);
+	if (fp)
+		fclose(fp);
+
+	name[strcspn(name, "\n")] = '\0';
+	for (c = name; *c; c++) {
+		if (*c == ',')
+			*c = ' ';
 	}
+}
 
-	if (e->util_avg != -1) {
-		switch (e->type) {
-		case PELT_TYPE_CFS:
-			if (sa_opts.util_avg_cpu) {
-				trace_cpu_util_avg(e->ts, e->cpu, e->util_avg);
-				if (e->uclamp_min != -1 && e->uclamp_max != -1) {
-					unsigned long uclamped_avg = clamp(e->util_avg,
-									 e->uclamp_min,
-									 e->uclamp_max);
-					trace_cpu_uclamped_avg(e->ts, e->cpu, uclamped_avg);
-				}
+#define IDLE_STATE_NAME_LEN	16
+
+/* Read once, idle states don't change while we run */
+static char (*idle_state_names)[SA_MAX_IDLE_STATES][IDLE_STATE_NAME_LEN];
+
+static const char *idle_state_name(int cpu, int state)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	int c, i;
+
+	if (!idle_state_names) {
+		idle_state_names = calloc(nr_cpus, sizeof(*idle_state_names));
+		if (!idle_state_names)
+			return "?";
+
+		for (c = 0; c < nr_cpus; c++) {
+			for (i = 0; i < SA_MAX_IDLE_STATES; i++)
+				read_idle_state_name(c, i, idle_state_names[c][i],
+						     IDLE_STATE_NAME_LEN);
+		}
+	}
+
+	return idle_state_names[cpu][state];
+}
+
+static char idle_gov_path[PATH_MAX];
+static char idle_miss_path[PATH_MAX];
+
+/*
+ * cpu,state,below,above table of the cpu_idle_miss events of each state, too
+ * deep for how long the CPU stayed idle or too shallow.
+ */
+static void write_idle_miss_stats(const struct idle_gov_stats *stats, int nr_cpus)
+{
+	char tmp_path[PATH_MAX + 4];
+	int cpu, i;
+	FILE *fp;
+
+	fp = open_csv_file(idle_miss_path, sizeof(idle_miss_path),
+			   tmp_path, sizeof(tmp_path), "idle_miss");
+	if (!fp)
+		return;
+
+	fprintf(fp, "cpu,state,state_name,below,above\n");
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		for (i = 0; i < SA_MAX_IDLE_STATES; i++) {
+			if (!stats[cpu].miss_below[i] && !stats[cpu].miss_above[i])
+				continue;
+
+			fprintf(fp, "%d,%d,%s,%llu,%llu\n", cpu, i,
+				idle_state_name(cpu, i), stats[cpu].miss_below[i],
+				stats[cpu].miss_above[i]);
+		}
+	}
+
+	close_csv_file(fp, idle_miss_path, tmp_path);
+}
+
+/*
+ * Dump the --idle_governor confusion matrix of each CPU as a
+ * cpu,selected,ideal,count table with the average predicted sleep length and
+ * actual residency of each cell.
+ */
+static void write_idle_gov_stats(void)
+{
+	int fd = bpf_map__fd(skel->maps.idle_gov_stats);
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct idle_gov_stats *stats;
+	char tmp_path[PATH_MAX + 4];
+	int zero = 0, cpu, i, j;
+	FILE *fp;
+
+	stats = calloc(nr_cpus, sizeof(*stats));
+	if (!stats)
+		return;
+
+	if (bpf_map_lookup_elem(fd, &zero, stats)) {
+		free(stats);
+		return;
+	}
+
+	fp = open_csv_file(idle_gov_path, sizeof(idle_gov_path),
+			   tmp_path, sizeof(tmp_path), "idle_governor");
+	if (!fp) {
+		free(stats);
+		return;
+	}
+
+	fprintf(fp, "cpu,selected,selected_name,ideal,ideal_name,count,predicted_ns,residency_ns\n");
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		for (i = 0; i < SA_MAX_IDLE_STATES; i++) {
+			for (j = 0; j < SA_MAX_IDLE_STATES; j++) {
+				struct idle_gov_cell *cell = &stats[cpu].matrix[i][j];
+
+				if (!cell->count)
+					continue;
+
+				fprintf(fp, "%d,%d,%s,%d,%s,%llu,%llu,%llu\n",
+					cpu, i, idle_state_name(cpu, i), j,
+					idle_state_name(cpu, j), cell->count,
+					cell->predicted_ns / cell->count,
+					cell->residency_ns / cell->count);
 			}
-			break;
-		case PELT_TYPE_RT:
-			if (sa_opts.util_avg_rt)
-				trace_cpu_util_avg_rt(e->ts, e->cpu, e->util_avg);
-			break;
-		case PELT_TYPE_DL:
-			if (sa_opts.util_avg_dl)
-				trace_cpu_util_avg_dl(e->ts, e->cpu, e->util_avg);
-			break;
-		case PELT_TYPE_IRQ:
-			if (sa_opts.util_avg_irq)
-				trace_cpu_util_avg_irq(e->ts, e->cpu, e->util_avg);
-			break;
-		default:
-			fprintf(stderr, "Unexpected PELT type: %d\n", e->type);
-			break;
 		}
 	}
 
-	if (sa_opts.util_est_cpu && e->util_est_enqueued != -1)
-		trace_cpu_util_est_enqueued(e->ts, e->cpu, e->util_est_enqueued);
+	close_csv_file(fp, idle_gov_path, tmp_path);
 
-	return 0;
+	write_idle_miss_stats(stats, nr_cpus);
+	free(stats);
 }
 
-static int handle_task_pelt_event(void *ctx, void *data, size_t data_sz)
+static char sugov_path[PATH_MAX];
+
+/*
+ * Dump --sugov counters as a policy_cpu,requests,rate_limited table.
+ */
+static void write_sugov_stats(void)
 {
-	struct task_pelt_event *e = data;
+	int fd = bpf_map__fd(skel->maps.sugov_stats);
+	int nr_cpus = libbpf_num_possible_cpus();
+	char tmp_path[PATH_MAX + 4];
+	struct sugov_stats stats;
+	FILE *fp;
+	int cpu;
+
+	fp = open_csv_file(sugov_path, sizeof(sugov_path),
+			   tmp_path, sizeof(tmp_path), "sugov");
+	if (!fp)
+		return;
+
+	fprintf(fp, "policy_cpu,requests,rate_limited\n");
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (bpf_map_lookup_elem(fd, &cpu, &stats))
+			continue;
+		if (!stats.requests && !stats.rate_limited)
+			continue;
+
+		fprintf(fp, "%d,%llu,%llu\n", cpu, stats.requests, stats.rate_limited);
+	}
 
-	if (ignore_pid_comm(e->pid, e->comm))
-		return 0;
+	close_csv_file(fp, sugov_path, tmp_path);
+}
+
+static char placement_path[PATH_MAX];
+
+static const char * const placement_decisions[PLACEMENT_NR_DECISIONS] = {
+	"select_task_rq_fair", "find_energy_efficient_cpu",
+};
+
+/*
+ * Rows of tasks that exited, moved out of placement_matrix so that the map
+ * only holds live tasks. They're summed per comm and transition like the
+ * task_freq ones, with the pid of @key set to -1.
+ */
+struct placement_exited {
+	struct placement_key key;
+	char comm[TASK_COMM_LEN];
+	struct placement_stats stats;
+};
 
-	if (sa_opts.load_avg_task && e->load_avg != -1)
-		trace_task_load_avg(e->ts, e->comm, e->pid, e->load_avg);
+static struct placement_exited *placement_exited;
+static unsigned int nr_placement_exited, max_placement_exited;
 
-	if (sa_opts.runnable_avg_task && e->runnable_avg != -1)
-		trace_task_runnable_avg(e->ts, e->comm, e->pid, e->runnable_avg);
+static void placement_retire(const struct placement_key *key,
+			     const struct placement_stats *stats)
+{
+	char comm[TASK_COMM_LEN];
+	struct placement_exited *e;
+	unsigned int i;
 
-	if (sa_opts.util_avg_task && e->util_avg != -1) {
-		trace_task_util_avg(e->ts, e->comm, e->pid, e->util_avg);
-		if (e->uclamp_min != -1 && e->uclamp_max != -1) {
-			unsigned long uclamped_avg = clamp(e->util_avg,
-							 e->uclamp_min,
-							 e->uclamp_max);
-			trace_task_uclamped_avg(e->ts, e->comm, e->pid, uclamped_avg);
+	task_comm_get(key->pid, comm);
+	task_comm_exit(key->pid);
+
+	for (i = 0; i < nr_placement_exited; i++) {
+		e = &placement_exited[i];
+		if (e->key.decision == key->decision &&
+		    e->key.prev_cpu == key->prev_cpu &&
+		    e->key.new_cpu == key->new_cpu && !strcmp(e->comm, comm)) {
+			e->stats.count += stats->count;
+			e->stats.util_avg += stats->util_avg;
+			return;
 		}
 	}
 
-	if (sa_opts.util_est_task && e->util_est_enqueued != -1) {
-		trace_task_util_est_enqueued(e->ts, e->comm, e->pid, e->util_est_enqueued);
-		trace_task_util_est_ewma(e->ts, e->comm, e->pid, e->util_est_ewma);
+	if (nr_placement_exited == max_placement_exited) {
+		unsigned int max = max_placement_exited ? max_placement_exited * 2 : 1024;
+		void *tmp;
+
+		tmp = realloc(placement_exited, max * sizeof(*placement_exited));
+		if (!tmp) {
+			fprintf(stderr, "Failed to allocate exited task placement\n");
+			return;
+		}
+		placement_exited = tmp;
+		max_placement_exited = max;
 	}
 
-	return 0;
+	e = &placement_exited[nr_placement_exited++];
+	e->key = *key;
+	e->key.pid = -1;
+	memcpy(e->comm, comm, TASK_COMM_LEN);
+	e->stats = *stats;
 }
 
-static int handle_rq_nr_running_event(void *ctx, void *data, size_t data_sz)
+static void write_placement_row(FILE *fp, const struct placement_key *key,
+				const char *comm, const struct placement_stats *stats)
 {
-	struct rq_nr_running_event *e = data;
+	fprintf(fp, "%d,%s,%s,%u,%u,%llu,%llu\n", key->pid, comm,
+		placement_decisions[key->decision], key->prev_cpu,
+		key->new_cpu, stats->count, stats->util_avg / stats->count);
+}
 
-	if (sa_opts.cpu_nr_running)
-		trace_cpu_nr_running(e->ts, e->cpu, e->nr_running);
+/*
+ * Dump the --placement matrix as a pid,comm,decision,prev_cpu,new_cpu,count
+ * table along with the average util_avg of the task for each transition.
+ *
+ * Like task_freq_residency, tasks that exited are moved out of the map as
+ * they're found and written with a pid of -1, summed per comm.
+ */
+static void write_placement(void)
+{
+	int fd = bpf_map__fd(skel->maps.placement_matrix);
+	struct placement_key key, *prev = NULL;
+	struct placement_key *exited = NULL;
+	unsigned int nr_exited = 0, max_exited = 0, i;
+	char tmp_path[PATH_MAX + 4];
+	struct placement_stats stats;
+	char comm[TASK_COMM_LEN];
+	pid_t last_pid = 0;
+	bool last_exited = false;
+	FILE *fp;
+
+	fp = open_csv_file(placement_path, sizeof(placement_path),
+			   tmp_path, sizeof(tmp_path), "placement");
+	if (!fp)
+		return;
+
+	fprintf(fp, "pid,comm,decision,prev_cpu,new_cpu,count,util_avg\n");
+
+	while (!bpf_map_get_next_key(fd, prev, &key)) {
+		prev = &key;
+
+		if (bpf_map_lookup_elem(fd, &key, &stats) || !stats.count)
+			continue;
+		if (key.decision < 0 || key.decision >= PLACEMENT_NR_DECISIONS)
+			continue;
+
+		task_comm_get(key.pid, comm);
+		write_placement_row(fp, &key, comm, &stats);
+
+		if (key.pid != last_pid) {
+			last_pid = key.pid;
+			last_exited = task_exited(key.pid);
+		}
+		if (!last_exited)
+			continue;
+
+		/* Deleting while walking the map restarts the walk */
+		if (nr_exited == max_exited) {
+			void *tmp;
+
+			max_exited = max_exited ? max_exited * 2 : 64;
+			tmp = realloc(exited, max_exited * sizeof(*exited));
+			if (!tmp)
+				continue;
+			exited = tmp;
+		}
+		exited[nr_exited++] = key;
+	}
 
-	return 0;
+	for (i = 0; i < nr_placement_exited; i++)
+		write_placement_row(fp, &placement_exited[i].key,
+				    placement_exited[i].comm,
+				    &placement_exited[i].stats);
+
+	close_csv_file(fp, placement_path, tmp_path);
+
+	for (i = 0; i < nr_exited; i++) {
+		if (bpf_map_lookup_elem(fd, &exited[i], &stats))
+			continue;
+		placement_retire(&exited[i], &stats);
+		bpf_map_delete_elem(fd, &exited[i]);
+	}
+
+	free(exited);
 }
 
-static int handle_sched_switch_event(void *ctx, void *data, size_t data_sz)
+static char wakeup_latency_path[PATH_MAX];
+
+/*
+ * Dump --wakeup_latency statistics as a scope,id,name,count,time_ns table
+ * followed by the delay histogram. scope is cpu, task or cgroup.
+ */
+static void write_wakeup_latency(void)
 {
-	struct sched_switch_event *e = data;
+	int cpu_fd = bpf_map__fd(skel->maps.cpu_wakeup_latency);
+	int task_fd = bpf_map__fd(skel->maps.task_wakeup_latency);
+	int cgroup_fd = bpf_map__fd(skel->maps.cgroup_wakeup_latency);
+	int nr_cpus = libbpf_num_possible_cpus();
+	unsigned long long cgrp_id, *prev_cgrp = NULL;
+	struct duration_stats *stats, total;
+	char tmp_path[PATH_MAX + 4];
+	char comm[TASK_COMM_LEN];
+	bool refreshed = false;
+	pid_t pid, *prev = NULL;
+	int zero = 0, cpu, i;
+	FILE *fp;
+
+	stats = calloc(nr_cpus, sizeof(*stats));
+	if (!stats)
+		return;
+
+	fp = open_csv_file(wakeup_latency_path, sizeof(wakeup_latency_path),
+			   tmp_path, sizeof(tmp_path), "wakeup_latency");
+	if (!fp) {
+		free(stats);
+		return;
+	}
 
-	if (ignore_pid_comm(e->pid, e->comm))
-		return 0;
+	write_duration_stats_header(fp, "scope,id,name");
+
+	if (!bpf_map_lookup_elem(cpu_fd, &zero, stats)) {
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (!stats[cpu].count)
+				continue;
+
+			fprintf(fp, "cpu,%d,CPU%d", cpu, cpu);
+			write_duration_stats(fp, &stats[cpu]);
+		}
+	}
 
-	/* Reset load_avg to 0 for !running */
-	if (!e->running && sa_opts.util_avg_task)
-		trace_task_load_avg(e->ts, e->comm, e->pid, 0);
+	while (!bpf_map_get_next_key(task_fd, prev, &pid)) {
+		prev = &pid;
 
-	/* Reset util_avg to 0 for !running */
-	if (!e->running && sa_opts.util_avg_task) {
-		trace_task_util_avg(e->ts, e->comm, e->pid, 0);
-		trace_task_uclamped_avg(e->ts, e->comm, e->pid, 0);
+		if (bpf_map_lookup_elem(task_fd, &pid, &total))
+			continue;
+
+		task_comm_get(pid, comm);
+		fprintf(fp, "task,%d,%s", pid, comm);
+		write_duration_stats(fp, &total);
 	}
 
-	/* Reset util_est to 0 for !running */
-	if (!e->running && sa_opts.util_est_task) {
-		trace_task_util_est_enqueued(e->ts, e->comm, e->pid, 0);
-		trace_task_util_est_ewma(e->ts, e->comm, e->pid, 0);
+	while (!bpf_map_get_next_key(cgroup_fd, prev_cgrp, &cgrp_id)) {
+		prev_cgrp = &cgrp_id;
+
+		if (bpf_map_lookup_elem(cgroup_fd, &cgrp_id, stats))
+			continue;
+
+		memset(&total, 0, sizeof(total));
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			total.count += stats[cpu].count;
+			total.time += stats[cpu].time;
+			for (i = 0; i < DURATION_HIST_NR_BUCKETS; i++)
+				total.buckets[i] += stats[cpu].buckets[i];
+		}
+
+		fprintf(fp, "cgroup,%llu,%s", cgrp_id,
+			cgroup_name(cgrp_id, &refreshed));
+		write_duration_stats(fp, &total);
 	}
 
-	return 0;
+	close_csv_file(fp, wakeup_latency_path, tmp_path);
+	free(stats);
 }
 
-static int handle_freq_idle_event(void *ctx, void *data, size_t data_sz)
+struct sa_prog {
+	const char *name;
+	enum sa_rb_id rb;
+};
+
+#define SA_PROG(id, prog, rb)	[SA_PROG_##id] = { "handle_" #prog, SA_RB_##rb }
+/* Tells apart the events of a program that aren't its main ones */
+#define SA_PROG_LABEL(id, prog, label, rb)	\
+	[SA_PROG_##id] = { "handle_" #prog " (" label ")", SA_RB_##rb }
+
+static const struct sa_prog sa_progs[SA_PROG_MAX] = {
+	SA_PROG(PELT_SE, pelt_se, TASK_PELT),
+	SA_PROG(UTIL_EST_SE, util_est_se, TASK_PELT),
+	SA_PROG(PELT_CFS, pelt_cfs, RQ_PELT),
+	SA_PROG(UTIL_EST_CFS, util_est_cfs, RQ_PELT),
+	SA_PROG(PELT_RT, pelt_rt, RQ_PELT),
+	SA_PROG(PELT_DL, pelt_dl, RQ_PELT),
+	SA_PROG(PELT_IRQ, pelt_irq, RQ_PELT),
+	SA_PROG(PELT_THERMAL, pelt_thermal, RQ_PELT),
+	SA_PROG(SCHED_UPDATE_NR_RUNNING, sched_update_nr_running, RQ_NR_RUNNING),
+	SA_PROG(SCHED_SWITCH, sched_switch, SCHED_SWITCH),
+	SA_PROG(SCHED_PROCESS_FREE, sched_process_free, TASK_PELT),
+	SA_PROG(CPU_IDLE, cpu_idle, FREQ_IDLE),
+	SA_PROG(CPU_IDLE_MISS, cpu_idle_miss, FREQ_IDLE),
+	SA_PROG(SOFTIRQ_EXIT, softirq_exit, SOFTIRQ),
+	SA_PROG(NOHZ_IDLE_BALANCE_ENTRY, nohz_idle_balance_entry, LB),
+	SA_PROG(NOHZ_IDLE_BALANCE_EXIT, nohz_idle_balance_exit, LB),
+	SA_PROG(RUN_REBALANCE_DOMAINS_ENTRY, run_rebalance_domains_entry, LB),
+	SA_PROG(RUN_REBALANCE_DOMAINS_EXIT, run_rebalance_domains_exit, LB),
+	SA_PROG(REBALANCE_DOMAINS_ENTRY, rebalance_domains_entry, LB),
+	SA_PROG(REBALANCE_DOMAINS_EXIT, rebalance_domains_exit, LB),
+	SA_PROG(BALANCE_FAIR_ENTRY, balance_fair_entry, LB),
+	SA_PROG(BALANCE_FAIR_EXIT, balance_fair_exit, LB),
+	SA_PROG(PICK_NEXT_TASK_FAIR_ENTRY, pick_next_task_fair_entry, LB),
+	SA_PROG(PICK_NEXT_TASK_FAIR_EXIT, pick_next_task_fair_exit, LB),
+	SA_PROG(NEWIDLE_BALANCE_ENTRY, newidle_balance_entry, LB),
+	SA_PROG(NEWIDLE_BALANCE_EXIT, newidle_balance_exit, LB),
+	SA_PROG(LOAD_BALANCE_ENTRY, load_balance_entry, LB),
+	SA_PROG(LOAD_BALANCE_EXIT, load_balance_exit, LB),
+	SA_PROG(IPI_SEND_CPU, ipi_send_cpu, IPI),
+	SA_PROG_LABEL(SCHED_SWITCH_META, sched_switch, "meta", TASK_PELT),
+	SA_PROG(TASK_RENAME, task_rename, TASK_PELT),
+	SA_PROG(IRQ_HANDLER_EXIT, irq_handler_exit, IRQ),
+	SA_PROG_LABEL(WAKEUP_LATENCY, sched_switch, "wakeup", WAKEUP),
+	SA_PROG(SELECT_TASK_RQ_FAIR, select_task_rq_fair, PLACEMENT),
+	SA_PROG(FIND_ENERGY_EFFICIENT_CPU, find_energy_efficient_cpu, PLACEMENT),
+	SA_PROG(SUGOV_UPDATE_SINGLE_FREQ, sugov_update_single_freq, SUGOV),
+	SA_PROG(SUGOV_UPDATE_SHARED, sugov_update_shared, SUGOV),
+	SA_PROG_LABEL(SUGOV_CPU_FREQUENCY, cpu_frequency, "sugov", SUGOV),
+};
+
+static unsigned long long prog_drops[SA_PROG_MAX];
+static unsigned long long rb_drops[SA_RB_MAX];
+
+static void read_rb_drops(void)
 {
-	struct freq_idle_event *e = data;
+	int i;
 
-	if (sa_opts.cpu_idle) {
-		trace_cpu_idle(e->ts, e->cpu, e->idle_state);
-		if (e->idle_miss)
-			trace_cpu_idle_miss(e->ts, e->cpu, e->idle_state, e->idle_miss);
-	}
+	memset(rb_drops, 0, sizeof(rb_drops));
 
-	return 0;
+	for (i = 0; i < SA_PROG_MAX; i++) {
+		prog_drops[i] = sum_percpu_u64(skel->maps.rb_drops, i);
+		rb_drops[sa_progs[i].rb] += prog_drops[i];
+	}
 }
 
-static int handle_softirq_event(void *ctx, void *data, size_t data_sz)
+/*
+ * Called periodically to emit how full each ring buffer is and how many
+ * events were lost so far, so gaps in the trace can be told apart from
+ * consumer overload.
+ */
+static void sample_rb_stats(void)
 {
-	struct softirq_event *e = data;
-	(void)e;
-	return 0;
+	LIBBPF_OPTS(bpf_test_run_opts, opts);
+	bool sample_fill = bpf_program__autoload(skel->progs.sample_rb_fill);
+	struct timespec now;
+	uint64_t ts;
+	int i;
+
+	if (sample_fill && bpf_prog_test_run_opts(bpf_program__fd(skel->progs.sample_rb_fill), &opts))
+		sample_fill = false;
+
+	read_rb_drops();
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	for (i = 0; i < SA_RB_MAX; i++) {
+		struct rb_fill *fill = &skel->bss->rb_fill[i];
+
+		if (sample_fill && fill->ring_size)
+			trace_rb_fill(ts, i, sa_rbs[i].name,
+				      fill->avail_data * 100 / fill->ring_size);
+		trace_rb_drops(ts, i, sa_rbs[i].name, rb_drops[i]);
+	}
 }
 
-static int handle_lb_event(void *ctx, void *data, size_t data_sz)
+static void print_rb_drops(void)
 {
-	struct lb_event *e = data;
-	char *phase = "unknown";
+	int i, j;
 
-	switch (e->phase) {
-	case LB_NOHZ_IDLE_BALANCE:
-		phase = "_nohz_idle_balance()";
-		break;
-	case LB_RUN_REBALANCE_DOMAINS:
-		phase = "run_rebalance_domains()";
-		break;
-	case LB_REBALANCE_DOMAINS:
-		phase = "rebalance_domains()";
-		if (e->entry)
-			trace_lb_sd_stats(e->ts, &e->sd_stats);
-		break;
-	case LB_BALANCE_FAIR:
-		phase = "balance_fair()";
-		break;
-	case LB_PICK_NEXT_TASK_FAIR:
-		phase = "pick_next_task_fair()";
-		break;
-	case LB_NEWIDLE_BALANCE:
-		phase = "newidle_balance()";
-		break;
-	case LB_LOAD_BALANCE:
-		phase = "load_balance()";
-		break;
+	read_rb_drops();
+
+	for (i = 0; i < SA_RB_MAX; i++) {
+		if (!rb_drops[i])
+			continue;
+
+		printf("Dropped %llu events from %s ringbuffer\n", rb_drops[i], sa_rbs[i].name);
+		for (j = 0; j < SA_PROG_MAX; j++) {
+			if (sa_progs[j].rb == i && prog_drops[j])
+				printf("\t%s: %llu\n", sa_progs[j].name, prog_drops[j]);
+		}
 	}
+}
 
-	if (e->overloaded != -1)
-		trace_lb_overloaded(e->ts, e->overloaded);
+struct rb_consumer {
+	pthread_t tid;
+	bool running;
+	struct ring_buffer *rb;
+};
 
-	if (e->overutilized != -1)
-		trace_lb_overutilized(e->ts, e->overutilized);
+static struct rb_consumer rb_consumers[SA_RB_MAX];
+static unsigned int nr_rb_consumers;
 
-	if (e->misfit_task_load != -1)
-		trace_lb_misfit(e->ts, e->lb_cpu, e->misfit_task_load);
+/* Added to the epoll set of every consumer to wake them up on exit */
+static int rb_exit_fd = -1;
 
-	if (e->entry)
-		trace_lb_entry(e->ts, e->this_cpu, e->lb_cpu, phase);
-	else
-		trace_lb_exit(e->ts, e->this_cpu, e->lb_cpu);
-	return 0;
+static void *rb_consumer_fn(void *data)
+{
+	struct rb_consumer *consumer = data;
+	int err;
+
+	while (!exiting) {
+		err = ring_buffer__poll(consumer->rb, -1);
+		if (err == -EINTR)
+			continue;
+		if (err < 0) {
+			fprintf(stderr, "Error polling ring buffers: %d\n", err);
+			break;
+		}
+		pr_debug(stdout, "[consumer %td] consumed %d events\n",
+			 consumer - rb_consumers, err);
+	}
+
+	/* Don't leave anything behind */
+	ring_buffer__consume(consumer->rb);
+
+	return NULL;
 }
 
-static int handle_ipi_event(void *ctx, void *data, size_t data_sz)
+static int create_rb_consumers(void)
 {
-	struct ipi_event *e = data;
+	unsigned int nr_rbs = 0, i, j = 0;
+	int err;
 
-	trace_ipi_send_cpu(e->ts, e->from_cpu, e->target_cpu,
-			   find_kallsyms(e->callsite), e->callsite,
-			   find_kallsyms(e->callback), e->callback);
+	/* Rings without producers would only cost a wakeup of their consumer */
+	for (i = 0; i < SA_RB_MAX; i++)
+		nr_rbs += !!rb_nr_event_classes(i);
+	if (!nr_rbs)
+		return 0;
+
+	nr_rb_consumers = clamp(sa_opts.consumer_threads, 1, nr_rbs);
+
+	rb_exit_fd = eventfd(0, EFD_CLOEXEC);
+	if (rb_exit_fd < 0) {
+		err = -errno;
+		fprintf(stderr, "Failed to create consumers exit eventfd: %d\n", err);
+		return err;
+	}
+
+	for (i = 0; i < SA_RB_MAX; i++) {
+		struct rb_consumer *consumer;
+		struct sa_rb *sa_rb = &sa_rbs[i];
+		int fd = bpf_map__fd(sa_rb->map);
+
+		if (!rb_nr_event_classes(i))
+			continue;
+
+		consumer = &rb_consumers[j++ % nr_rb_consumers];
+
+		if (!consumer->rb) {
+			consumer->rb = ring_buffer__new(fd, sa_rb->handler, NULL, NULL);
+			err = consumer->rb ? 0 : -errno;
+		} else {
+			err = ring_buffer__add(consumer->rb, fd, sa_rb->handler, NULL);
+		}
+		if (err) {
+			fprintf(stderr, "Failed to create %s ringbuffer: %d\n", sa_rb->name, err);
+			return err;
+		}
+	}
+
+	for (i = 0; i < nr_rb_consumers; i++) {
+		struct rb_consumer *consumer = &rb_consumers[i];
+		/*
+		 * libbpf takes the event data as the index of the ring that is
+		 * ready, point it to the first one which is harmless to consume.
+		 */
+		struct epoll_event ev = { .events = EPOLLIN, .data.u32 = 0 };
+
+		if (epoll_ctl(ring_buffer__epoll_fd(consumer->rb), EPOLL_CTL_ADD,
+			      rb_exit_fd, &ev)) {
+			err = -errno;
+			fprintf(stderr, "Failed to add consumers exit eventfd: %d\n", err);
+			return err;
+		}
+
+		err = pthread_create(&consumer->tid, NULL, rb_consumer_fn, consumer);
+		if (err) {
+			fprintf(stderr, "Failed to create consumer thread: %d\n", err);
+			return -err;
+		}
+		consumer->running = true;
+	}
 
 	return 0;
 }
 
-#define INIT_EVENT_RB(event)	struct ring_buffer *event##_rb = NULL
-
-#define CREATE_EVENT_RB(event) do {							\
-		event##_rb = ring_buffer__new(bpf_map__fd(skel->maps.event##_rb),	\
-					      handle_##event##_event, NULL, NULL);	\
-		if (!event##_rb) {							\
-			err = -1;							\
-			fprintf(stderr, "Failed to create " #event " ringbuffer\n");	\
-			goto cleanup;							\
-		}									\
-	} while(0)
-
-#define DESTROY_EVENT_RB(event) do {							\
-		ring_buffer__free(event##_rb);						\
-	} while(0)
-
-#define POLL_EVENT_RB(event) do {							\
-		err = ring_buffer__poll(event##_rb, 1000);				\
-		if (err == -EINTR) {							\
-			err = 0;							\
-			break;								\
-		}									\
-		if (err < 0) {								\
-			fprintf(stderr, "Error polling " #event " ring buffer: %d\n", err); \
-			break;								\
-		}									\
-		pr_debug(stdout, "[" #event "] consumed %d events\n", err);		\
-	} while(0)
-
-#define INIT_EVENT_THREAD(event) pthread_t event##_tid; int event##_err = -1
-
-#define CREATE_EVENT_THREAD(event) do {							\
-		event##_err = pthread_create(&event##_tid, NULL, event##_thread_fn, NULL);	\
-		if (event##_err) {								\
-			fprintf(stderr, "Failed to create " #event " thread: %d\n", event##_err); \
-			goto cleanup;							\
-		}									\
-	} while(0)
-
-#define DESTROY_EVENT_THREAD(event) do {						\
-		err = event##_err ? 0 : pthread_join(event##_tid, NULL);		\
-		if (err)								\
-			fprintf(stderr, "Failed to destory " #event " thread: %d\n", err); \
-	} while(0)
-
-#define EVENT_THREAD_FN(event)								\
-	void *event##_thread_fn(void *data)						\
-	{										\
-		int err;								\
-		INIT_EVENT_RB(event);							\
-		CREATE_EVENT_RB(event);							\
-		while (!exiting) {							\
-			POLL_EVENT_RB(event);						\
-			usleep(10000);							\
-		}									\
-	cleanup:									\
-		DESTROY_EVENT_RB(event);						\
-		return NULL;								\
-	}
-
-
-/*
- * All events require to access this variable to get access to the ringbuffer.
- * Make it available for all event##_thread_fn.
- */
-struct sched_analyzer_bpf *skel;
+static void destroy_rb_consumers(void)
+{
+	unsigned int i;
+	int err;
 
-/*
- * Define a pthread function handler for each event
- */
-EVENT_THREAD_FN(rq_pelt)
-EVENT_THREAD_FN(task_pelt)
-EVENT_THREAD_FN(rq_nr_running)
-EVENT_THREAD_FN(sched_switch)
-EVENT_THREAD_FN(freq_idle)
-EVENT_THREAD_FN(softirq)
-EVENT_THREAD_FN(lb)
-EVENT_THREAD_FN(ipi)
+	/* Never read, stays readable to wake up every consumer */
+	if (rb_exit_fd >= 0 && eventfd_write(rb_exit_fd, 1))
+		fprintf(stderr, "Failed to wake up consumer threads: %d\n", -errno);
+
+	for (i = 0; i < nr_rb_consumers; i++) {
+		struct rb_consumer *consumer = &rb_consumers[i];
+
+		if (consumer->running) {
+			err = pthread_join(consumer->tid, NULL);
+			if (err)
+				fprintf(stderr, "Failed to destroy consumer thread: %d\n", err);
+			consumer->running = false;
+		}
+		ring_buffer__free(consumer->rb);
+		consumer->rb = NULL;
+	}
+
+	nr_rb_consumers = 0;
+
+	if (rb_exit_fd >= 0) {
+		close(rb_exit_fd);
+		rb_exit_fd = -1;
+	}
+}
 
 int main(int argc, char **argv)
 {
-	INIT_EVENT_THREAD(rq_pelt);
-	INIT_EVENT_THREAD(task_pelt);
-	INIT_EVENT_THREAD(rq_nr_running);
-	INIT_EVENT_THREAD(sched_switch);
-	INIT_EVENT_THREAD(freq_idle);
-	INIT_EVENT_THREAD(softirq);
-	INIT_EVENT_THREAD(lb);
-	INIT_EVENT_THREAD(ipi);
+	unsigned int ticks = 0;
 	int err;
 
 	err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
@@ -353,10 +2588,30 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	/* Initialize BPF global variables */
-	skel->bss->sa_opts = sa_opts;
+	init_rbs();
+
+	err = set_rb_sizes();
+	if (err)
+		goto cleanup;
+
+	err = set_cpu_map_sizes();
+	if (err)
+		goto cleanup;
+
+	/* ipi_matrix is preallocated, don't pay for it without --ipi_matrix */
+	if (!sa_opts.ipi || !sa_opts.ipi_matrix) {
+		err = bpf_map__set_max_entries(skel->maps.ipi_matrix, 1);
+		if (err) {
+			fprintf(stderr, "Failed to resize ipi_matrix: %d\n", err);
+			goto cleanup;
+		}
+	}
+
+	/* Initialize BPF global variables, read-only once loaded */
+	skel->rodata->sa_opts = sa_opts;
 
-	if (!sa_opts.load_avg_cpu && !sa_opts.runnable_avg_cpu && !sa_opts.util_avg_cpu)
+	if (!sa_opts.load_avg_cpu && !sa_opts.runnable_avg_cpu && !sa_opts.util_avg_cpu &&
+	    !sa_opts.residency)
 		bpf_program__set_autoload(skel->progs.handle_pelt_cfs, false);
 	if (!sa_opts.load_avg_task && !sa_opts.runnable_avg_task && !sa_opts.util_avg_task)
 		bpf_program__set_autoload(skel->progs.handle_pelt_se, false);
@@ -374,49 +2629,102 @@ int main(int argc, char **argv)
 		bpf_program__set_autoload(skel->progs.handle_util_est_se, false);
 	if (!sa_opts.cpu_nr_running)
 		bpf_program__set_autoload(skel->progs.handle_sched_update_nr_running, false);
-	if (!sa_opts.cpu_idle) {
+	if (!sa_opts.cpu_idle && !sa_opts.residency)
 		bpf_program__set_autoload(skel->progs.handle_cpu_idle, false);
+	/* Counted by --idle_governor */
+	if (!sa_opts.cpu_idle_miss_events && !sa_opts.idle_governor)
 		bpf_program__set_autoload(skel->progs.handle_cpu_idle_miss, false);
-	}
+	if (!sa_opts.residency && !sa_opts.cpu_freq && !sa_opts.sugov)
+		bpf_program__set_autoload(skel->progs.handle_cpu_frequency, false);
 	if (!sa_opts.load_balance) {
-		bpf_program__set_autoload(skel->progs.handle_run_rebalance_domains_exit, false);
-		bpf_program__set_autoload(skel->progs.handle_run_rebalance_domains_entry, false);
-		bpf_program__set_autoload(skel->progs.handle_run_rebalance_domains_exit, false);
-		bpf_program__set_autoload(skel->progs.handle_rebalance_domains_entry, false);
-		bpf_program__set_autoload(skel->progs.handle_rebalance_domains_exit, false);
-		bpf_program__set_autoload(skel->progs.handle_balance_fair_entry, false);
-		bpf_program__set_autoload(skel->progs.handle_balance_fair_exit, false);
-		bpf_program__set_autoload(skel->progs.handle_pick_next_task_fair_entry, false);
-		bpf_program__set_autoload(skel->progs.handle_pick_next_task_fair_exit, false);
-		bpf_program__set_autoload(skel->progs.handle_newidle_balance_entry, false);
-		bpf_program__set_autoload(skel->progs.handle_newidle_balance_exit, false);
-		bpf_program__set_autoload(skel->progs.handle_load_balance_entry, false);
-		bpf_program__set_autoload(skel->progs.handle_load_balance_exit, false);
+		/* Only fexit is checked by select_fexit(), the rest follows */
+		bpf_program__set_autoload(skel->progs.handle_nohz_idle_balance_fexit, false);
+		bpf_program__set_autoload(skel->progs.handle_run_rebalance_domains_fexit, false);
+		bpf_program__set_autoload(skel->progs.handle_rebalance_domains_fexit, false);
+		bpf_program__set_autoload(skel->progs.handle_balance_fair_fexit, false);
+		bpf_program__set_autoload(skel->progs.handle_pick_next_task_fair_fexit, false);
+		bpf_program__set_autoload(skel->progs.handle_newidle_balance_fexit, false);
+		bpf_program__set_autoload(skel->progs.handle_load_balance_fexit, false);
 	}
+	if (!sa_opts.load_balance || !sa_opts.load_balance_stats)
+		bpf_program__set_autoload(skel->progs.handle_find_busiest_group, false);
 	if (!sa_opts.ipi)
 		bpf_program__set_autoload(skel->progs.handle_ipi_send_cpu, false);
+	if (!sa_opts.ipi || !sa_opts.ipi_matrix)
+		bpf_program__set_autoload(skel->progs.handle_ipi_send_cpumask, false);
 
-	/* Make sure we zero out PELT signals for tasks when they exit */
-	if (!sa_opts.load_avg_task && !sa_opts.runnable_avg_task && !sa_opts.util_avg_task && !sa_opts.util_est_task)
-		bpf_program__set_autoload(skel->progs.handle_sched_process_free, false);
+	bool task_events = sa_opts.load_avg_task || sa_opts.runnable_avg_task ||
+			   sa_opts.util_avg_task || sa_opts.util_est_task;
 
-	/* We can't reliably attach to those yet, so always disable them */
-	bpf_program__set_autoload(skel->progs.handle_nohz_idle_balance_entry, false);
-	bpf_program__set_autoload(skel->progs.handle_nohz_idle_balance_exit, false);
+	/*
+	 * Tracks which tasks are running and announces the comm of tasks on
+	 * first sight, task events don't carry it.
+	 */
+	if (!task_events && !sa_opts.sched_switch && !sa_opts.cpu_freq &&
+	    !sa_opts.wakeup_latency && !sa_opts.placement)
+		bpf_program__set_autoload(skel->progs.handle_sched_switch, false);
 
 	/*
-	 * Were used for old csv mode, no longer used but keep the traces lying
-	 * around but disabled for now.
+	 * comm filter results are cached, drop them when the task is renamed.
+	 * Tables keyed by pid need the new comm too.
 	 */
-	bpf_program__set_autoload(skel->progs.handle_cpu_frequency, false);
-	bpf_program__set_autoload(skel->progs.handle_softirq_entry, false);
-	bpf_program__set_autoload(skel->progs.handle_softirq_exit, false);
+	if (!sa_opts.num_comms && !task_events && !sa_opts.cpu_freq &&
+	    !sa_opts.wakeup_latency && !sa_opts.placement)
+		bpf_program__set_autoload(skel->progs.handle_task_rename, false);
+
+	if (!sa_opts.wakeup_latency) {
+		bpf_program__set_autoload(skel->progs.handle_sched_waking, false);
+		bpf_program__set_autoload(skel->progs.handle_sched_wakeup_new, false);
+	}
+	if (!sa_opts.placement) {
+		bpf_program__set_autoload(skel->progs.handle_select_task_rq_fair, false);
+		bpf_program__set_autoload(skel->progs.handle_select_task_rq_fair_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_select_task_rq_fair_exit, false);
+		bpf_program__set_autoload(skel->progs.handle_find_energy_efficient_cpu, false);
+		bpf_program__set_autoload(skel->progs.handle_find_energy_efficient_cpu_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_find_energy_efficient_cpu_exit, false);
+	}
+	if (!sa_opts.sugov) {
+		bpf_program__set_autoload(skel->progs.handle_sugov_update_single_freq, false);
+		bpf_program__set_autoload(skel->progs.handle_sugov_update_single_freq_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_sugov_update_single_freq_exit, false);
+		bpf_program__set_autoload(skel->progs.handle_sugov_update_shared, false);
+		bpf_program__set_autoload(skel->progs.handle_sugov_update_shared_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_sugov_update_shared_exit, false);
+	}
+	if (!sa_opts.idle_governor) {
+		bpf_program__set_autoload(skel->progs.handle_idle_gov_cpu_idle, false);
+		bpf_program__set_autoload(skel->progs.handle_teo_select, false);
+		bpf_program__set_autoload(skel->progs.handle_teo_select_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_teo_select_exit, false);
+		bpf_program__set_autoload(skel->progs.handle_menu_select, false);
+		bpf_program__set_autoload(skel->progs.handle_menu_select_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_menu_select_exit, false);
+	}
 
 	/*
-	 * Was used to zero out pelt signals when task is not running.
+	 * Make sure we zero out PELT signals for tasks when they exit, and drop
+	 * their wakeup latency
 	 */
-	bpf_program__set_autoload(skel->progs.handle_sched_switch, false);
+	if (!task_events && !sa_opts.wakeup_latency)
+		bpf_program__set_autoload(skel->progs.handle_sched_process_free, false);
+
+	if (!sa_opts.softirq) {
+		bpf_program__set_autoload(skel->progs.handle_softirq_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_softirq_exit, false);
+	}
+	if (!sa_opts.irq) {
+		bpf_program__set_autoload(skel->progs.handle_irq_handler_entry, false);
+		bpf_program__set_autoload(skel->progs.handle_irq_handler_exit, false);
+	}
 
+	/* Only used to sample ring buffers fill level */
+	if (libbpf_probe_bpf_prog_type(BPF_PROG_TYPE_SYSCALL, NULL) != 1)
+		bpf_program__set_autoload(skel->progs.sample_rb_fill, false);
+
+	/* Must come last, follows what's enabled above */
+	select_tp_btf();
+	select_fexit();
 
 	err = sched_analyzer_bpf__load(skel);
 	if (err) {
@@ -424,42 +2732,129 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	err = init_filters();
+	if (err)
+		goto cleanup;
+
+	if (sa_opts.cpu_freq)
+		seed_cpu_freq();
+
 	err = sched_analyzer_bpf__attach(skel);
 	if (err) {
 		fprintf(stderr, "Failed to attach BPF skeleton\n");
 		goto cleanup;
 	}
 
-	CREATE_EVENT_THREAD(rq_pelt);
-	CREATE_EVENT_THREAD(task_pelt);
-	CREATE_EVENT_THREAD(rq_nr_running);
-	CREATE_EVENT_THREAD(sched_switch);
-	CREATE_EVENT_THREAD(freq_idle);
-	CREATE_EVENT_THREAD(softirq);
-	CREATE_EVENT_THREAD(lb);
-	CREATE_EVENT_THREAD(ipi);
+	err = attach_clone_probes();
+	if (err)
+		goto cleanup;
+
+	err = create_rb_consumers();
+	if (err)
+		goto cleanup;
 
 	printf("Collecting data, CTRL+c to stop\n");
 
 	start_perfetto_trace();
 
+	if (sa_opts.histogram)
+		sample_pelt_hist();
+
 	while (!exiting) {
 		sleep(1);
+		sample_rb_stats();
+		if (sa_opts.histogram && !(++ticks % sa_opts.histogram_interval))
+			sample_pelt_hist();
+		if (sa_opts.residency || sa_opts.cpu_freq)
+			write_residency();
+		if (sa_opts.cpu_freq)
+			write_task_freq_residency();
+		if (sa_opts.softirq)
+			write_softirq_stats();
+		if (sa_opts.irq)
+			write_irq_stats();
+		if (sa_opts.wakeup_latency)
+			write_wakeup_latency();
+		if (sa_opts.placement)
+			write_placement();
+		if (sa_opts.sugov)
+			write_sugov_stats();
+		if (sa_opts.idle_governor)
+			write_idle_gov_stats();
+		if (sa_opts.load_balance && sa_opts.load_balance_stats)
+			write_lb_stats();
+		if (sa_opts.ipi && sa_opts.ipi_matrix)
+			write_ipi_stats();
+		task_comm_reap();
 	}
 
+	/* Stop producing and drain what's left before stopping the trace */
+	skel->bss->sa_runtime.paused = true;
+	destroy_rb_consumers();
+
+	if (sa_opts.histogram)
+		flush_pelt_hist();
+	if (sa_opts.cpu_freq)
+		flush_task_freq_residency();
+
+	if (sa_opts.residency || sa_opts.cpu_freq)
+		write_residency();
+	if (sa_opts.cpu_freq)
+		write_task_freq_residency();
+	if (sa_opts.softirq)
+		write_softirq_stats();
+	if (sa_opts.irq)
+		write_irq_stats();
+	if (sa_opts.wakeup_latency)
+		write_wakeup_latency();
+	if (sa_opts.placement)
+		write_placement();
+	if (sa_opts.sugov)
+		write_sugov_stats();
+	if (sa_opts.idle_governor)
+		write_idle_gov_stats();
+	if (sa_opts.load_balance && sa_opts.load_balance_stats)
+		write_lb_stats();
+	if (sa_opts.ipi && sa_opts.ipi_matrix)
+		write_ipi_stats();
+
 	stop_perfetto_trace();
 
 	printf("\rCollected %s/%s\n", sa_opts.output_path, sa_opts.output);
 
+	if (sa_opts.residency || sa_opts.cpu_freq)
+		printf("Residency written to %s\n", residency_path);
+	if (sa_opts.cpu_freq)
+		printf("Task frequency residency written to %s\n", task_freq_path);
+	if (sa_opts.softirq)
+		printf("Softirq statistics written to %s\n", softirq_path);
+	if (sa_opts.irq)
+		printf("Irq statistics written to %s\n", irq_path);
+	if (sa_opts.wakeup_latency)
+		printf("Wakeup latency written to %s\n", wakeup_latency_path);
+	if (sa_opts.placement)
+		printf("Placement matrix written to %s\n", placement_path);
+	if (sa_opts.sugov)
+		printf("Schedutil statistics written to %s\n", sugov_path);
+	if (sa_opts.idle_governor)
+		printf("Idle governor statistics written to %s and %s\n",
+		       idle_gov_path, idle_miss_path);
+	if (sa_opts.load_balance && sa_opts.load_balance_stats)
+		printf("Load balance statistics written to %s\n", lb_stats_path);
+	if (sa_opts.ipi && sa_opts.ipi_matrix)
+		printf("IPI matrix written to %s and %s\n", ipi_matrix_path, ipi_callbacks_path);
+
+	print_rb_drops();
+
+	if (sa_opts.num_pids || sa_opts.num_tgids || sa_opts.num_comms)
+		printf("Filtered out %llu events\n", get_filtered_events());
+
 cleanup:
-	DESTROY_EVENT_THREAD(rq_pelt);
-	DESTROY_EVENT_THREAD(task_pelt);
-	DESTROY_EVENT_THREAD(rq_nr_running);
-	DESTROY_EVENT_THREAD(sched_switch);
-	DESTROY_EVENT_THREAD(freq_idle);
-	DESTROY_EVENT_THREAD(softirq);
-	DESTROY_EVENT_THREAD(lb);
-	DESTROY_EVENT_THREAD(ipi);
+	exiting = true;
+	destroy_rb_consumers();
+	detach_clone_probes();
 	sched_analyzer_bpf__destroy(skel);
+	task_comm_clear();
+	cgroup_names_clear();
 	return err < 0 ? -err : 0;
 }
@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2024 Qais Yousef */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "sched-analyzer-events.h"
+#include "task_comm.h"
+
+/*
+ * pid -> comm of every task we have seen. BPF only announces the comm of a
+ * task once and again when it is renamed, task events carry the pid only.
+ */
+#define TASK_COMM_BUCKETS	4096
+
+struct task_comm {
+	struct task_comm *next;
+	pid_t pid;
+	/* Number of task_comm_reap() calls since the task exited */
+	int exited;
+	char comm[TASK_COMM_LEN];
+};
+
+static struct task_comm *buckets[TASK_COMM_BUCKETS];
+static unsigned int nr_exited;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned int hash(pid_t pid)
+{
+	return (unsigned int)pid % TASK_COMM_BUCKETS;
+}
+
+static struct task_comm *__task_comm_find(pid_t pid)
+{
+	struct task_comm *tc;
+
+	for (tc = buckets[hash(pid)]; tc; tc = tc->next) {
+		if (tc->pid == pid)
+			return tc;
+	}
+
+	return NULL;
+}
+
+void task_comm_set(pid_t pid, const char *comm)
+{
+	struct task_comm *tc;
+
+	pthread_mutex_lock(&lock);
+
+	tc = __task_comm_find(pid);
+	if (!tc) {
+		tc = calloc(1, sizeof(*tc));
+		if (!tc) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		tc->pid = pid;
+		tc->next = buckets[hash(pid)];
+		buckets[hash(pid)] = tc;
+	} else if (tc->exited) {
+		/* The pid was reused */
+		tc->exited = 0;
+		nr_exited--;
+	}
+	strncpy(tc->comm, comm, TASK_COMM_LEN - 1);
+	tc->comm[TASK_COMM_LEN - 1] = 0;
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The comm of a task might not be announced yet when its first event arrives,
+ * for example if it was woken up before it ever ran. Fall back to procfs.
+ */
+static int read_proc_comm(pid_t pid, char *comm)
+{
+	char path[64];
+	FILE *fp;
+	char *nl;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	if (!fgets(comm, TASK_COMM_LEN, fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	nl = strchr(comm, '\n');
+	if (nl)
+		*nl = 0;
+
+	return 0;
+}
+
+/*
+ * @comm must be at least TASK_COMM_LEN long.
+ */
+void task_comm_get(pid_t pid, char *comm)
+{
+	struct task_comm *tc;
+
+	pthread_mutex_lock(&lock);
+	tc = __task_comm_find(pid);
+	if (tc)
+		memcpy(comm, tc->comm, TASK_COMM_LEN);
+	pthread_mutex_unlock(&lock);
+
+	if (tc)
+		return;
+
+	if (!read_proc_comm(pid, comm)) {
+		task_comm_set(pid, comm);
+		return;
+	}
+
+	snprintf(comm, TASK_COMM_LEN, "<unknown>");
+}
+
+void task_comm_del(pid_t pid)
+{
+	struct task_comm **pprev, *tc;
+
+	pthread_mutex_lock(&lock);
+	for (pprev = &buckets[hash(pid)]; (tc = *pprev); pprev = &tc->next) {
+		if (tc->pid == pid) {
+			if (tc->exited)
+				nr_exited--;
+			*pprev = tc->next;
+			free(tc);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Tables written periodically still need the comm of a task for a while after
+ * it exited. Keep it until the second task_comm_reap() call after this one.
+ */
+void task_comm_exit(pid_t pid)
+{
+	struct task_comm *tc;
+
+	pthread_mutex_lock(&lock);
+	tc = __task_comm_find(pid);
+	if (tc && !tc->exited) {
+		tc->exited = 1;
+		nr_exited++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void task_comm_reap(void)
+{
+	struct task_comm **pprev, *tc;
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < TASK_COMM_BUCKETS && nr_exited; i++) {
+		pprev = &buckets[i];
+		while ((tc = *pprev)) {
+			if (tc->exited && tc->exited++ > 1) {
+				*pprev = tc->next;
+				free(tc);
+				nr_exited--;
+				continue;
+			}
+			pprev = &tc->next;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void task_comm_clear(void)
+{
+	struct task_comm *tc, *next;
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < TASK_COMM_BUCKETS; i++) {
+		for (tc = buckets[i]; tc; tc = next) {
+			next = tc->next;
+			free(tc);
+		}
+		buckets[i] = NULL;
+	}
+	nr_exited = 0;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Copyright (C) 2024 Qais Yousef */
+#ifndef __TASK_COMM_H__
+#define __TASK_COMM_H__
+
+#include <sys/types.h>
+
+void task_comm_set(pid_t pid, const char *comm);
+void task_comm_get(pid_t pid, char *comm);
+void task_comm_del(pid_t pid);
+void task_comm_exit(pid_t pid);
+void task_comm_reap(void);
+void task_comm_clear(void);
+
+#endif /* __TASK_COMM_H__ */